@@ -0,0 +1,366 @@
+/*
+ * Logger benchmarks. Prints one JSON object per case on stdout.
+ *
+ *     logger_bench [RECORDS] [MAX_THREADS]
+ *
+ * Every case is run twice: once untimed to measure throughput, and once timing
+ * each call to build the latency percentiles. Latencies have the cost of reading
+ * the clock subtracted.
+ *
+ * The *_tmpfs and *_disk cases write real files, in /dev/shm and /var/tmp. They
+ * are deleted afterwards. The shm cases write to a shared memory ring that a
+ * forked process drains, the way `logger_collect` would.
+ */
+#define LOGGER_IMPLEMENTATION
+#include "logger.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+
+typedef void (*emit_fn)(long i);
+
+typedef struct bench_case_t {
+    const char*         name;
+    emit_fn             emit;
+    log_sink_t*         sink;
+    log_formatter_fn    formatter;
+    log_encoder_fn      encoder;
+    const log_route_t*  routes;
+    size_t              route_count;
+    int                 threads;
+    long                records;    /* In total, split between the threads */
+    const size_t*       syscalls;   /* The sink's own count, for syscalls /proc/self/io leaves out; NULL: that count */
+} bench_case_t;
+
+typedef struct bench_thread_t {
+    const bench_case_t* bench;
+    long                records;
+    uint32_t*           samples;    /* NULL for the throughput run */
+    pthread_barrier_t*  start;
+} bench_thread_t;
+
+
+static uint64_t timer_overhead_ns = 0;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void calibrate_timer(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 100000; ++i) {
+        uint64_t a = now_ns();
+        uint64_t b = now_ns();
+        if (b - a < best)
+            best = b - a;
+    }
+    timer_overhead_ns = best;
+}
+
+// Write syscalls made by this process so far, as accounted by the kernel. `io_uring_enter`
+// isn't one of them.
+static long long write_syscalls(void) {
+    long long count = -1;
+    char key[64];
+    long long value;
+    FILE* file = fopen("/proc/self/io", "r");
+    if (!file)
+        return -1;
+    while (fscanf(file, "%63[^:]: %lld\n", key, &value) == 2) {
+        if (strcmp(key, "syscw") == 0) {
+            count = value;
+            break;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+
+static void emit_disabled(long i) { trace("request %ld served in %d us", i, 42); }
+static void emit_enabled(long i)  { info("request %ld served in %d us", i, 42); }
+static void emit_fields(long i)   { log_fields(LOG_INFO, "request served", log_int("request", i), log_int("us", 42), log_str("path", "/index.html")); }
+static void emit_limited(long i)  { log_per_second(LOG_INFO, 1, "request %ld served in %d us", i, 42); }
+static void emit_burst(long i)    { (void) i; info("request failed, %s is unreachable", "db"); }
+static void emit_span(long i)     { (void) i; log_span("request"); }
+static void emit_span_args(long i) { log_span_args("request", log_span_arg("id", i), log_span_arg("us", 42)); }
+
+static void null_sink_write(void* data, const log_record_t* record) {
+    (void) data;
+    (void) record;
+}
+
+// Stands in for `logger_collect`: frees the slots of completed records until killed.
+static pid_t start_shm_drain(struct logger__shm_ring* ring) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    for (;;) {
+        uint64_t sequence = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&logger__shm_slot(ring, sequence)->state, __ATOMIC_ACQUIRE) == 4 * sequence + LOGGER_SHM_COMPLETE)
+            __atomic_store_n(&ring->tail, sequence + 1, __ATOMIC_RELEASE);
+        else
+            sched_yield();
+    }
+}
+
+static int errors_only(void* data, const log_record_t* record) {
+    (void) data;
+    return record->level >= LOG_ERROR;
+}
+
+static int message_only_formatter(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args) {
+    (void) logger;
+    (void) level;
+    (void) source_location;
+    return vsnprintf(buffer, (size_t) size, message, args);
+}
+
+
+static void* bench_thread(void* arg) {
+    bench_thread_t* t = arg;
+    const bench_case_t* bench = t->bench;
+
+    with_log(.name = "bench", .formatter = bench->formatter, .encoder = bench->encoder, .sinks = { [LOG_INFO] = bench->sink },
+             .routes = bench->routes, .route_count = bench->route_count) {
+        pthread_barrier_wait(t->start);
+        if (t->samples) {
+            for (long i = 0; i < t->records; ++i) {
+                uint64_t start = now_ns();
+                bench->emit(i);
+                uint64_t elapsed = now_ns() - start;
+                elapsed = (elapsed > timer_overhead_ns) ? elapsed - timer_overhead_ns : 0;
+                t->samples[i] = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t) elapsed;
+            }
+        } else {
+            for (long i = 0; i < t->records; ++i)
+                bench->emit(i);
+        }
+        log_flush();
+    }
+    return NULL;
+}
+
+// Runs the case once on `bench->threads` threads. Returns the wall time in ns.
+static uint64_t run_once(const bench_case_t* bench, uint32_t* samples) {
+    int threads = bench->threads;
+    pthread_t handles[threads];
+    bench_thread_t args[threads];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, (unsigned) threads + 1);
+
+    long per_thread = bench->records / threads;
+    for (int i = 0; i < threads; ++i) {
+        args[i] = (bench_thread_t) { bench, per_thread, samples ? samples + i * per_thread : NULL, &start };
+        pthread_create(&handles[i], NULL, bench_thread, &args[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < threads; ++i)
+        pthread_join(handles[i], NULL);
+    uint64_t elapsed = now_ns() - begin;
+
+    pthread_barrier_destroy(&start);
+    return elapsed;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void run_case(const bench_case_t* bench) {
+    long records = (bench->records / bench->threads) * bench->threads;
+
+    long long syscalls_before = bench->syscalls ? (long long) *bench->syscalls : write_syscalls();
+    uint64_t elapsed = run_once(bench, NULL);
+    long long syscalls_after = bench->syscalls ? (long long) *bench->syscalls : write_syscalls();
+    long long syscalls = (syscalls_before < 0 || syscalls_after < 0) ? -1 : syscalls_after - syscalls_before;
+
+    uint32_t* samples = malloc((size_t) records * sizeof(*samples));
+    run_once(bench, samples);
+    qsort(samples, (size_t) records, sizeof(*samples), compare_u32);
+
+    printf("{\"case\":\"%s\",\"threads\":%d,\"records\":%ld,\"records_per_sec\":%.0f,"
+           "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"max_ns\":%u,"
+           "\"syscalls\":%lld,\"syscalls_per_record\":%.4f}\n",
+           bench->name, bench->threads, records, (double) records * 1e9 / (double) elapsed,
+           samples[records / 2], samples[records * 99 / 100], samples[records * 999 / 1000], samples[records - 1],
+           syscalls, (syscalls < 0) ? -1.0 : (double) syscalls / (double) records);
+    fflush(stdout);
+    free(samples);
+}
+
+
+int main(int argc, char** argv) {
+    long records    = (argc > 1) ? atol(argv[1]) : 1000000;
+    int max_threads = (argc > 2) ? atoi(argv[2]) : 4;
+    if (records <= 0 || max_threads <= 0) {
+        fprintf(stderr, "usage: %s [RECORDS] [MAX_THREADS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        perror("logger_bench: /dev/null");
+        return EXIT_FAILURE;
+    }
+    log_init(.level = LOG_INFO, .spans = 4096);
+    calibrate_timer();
+
+    log_sink_t null_sink = { .write = null_sink_write, .data = NULL };
+    log_sink_t raw_sink = { .write = null_sink_write, .data = NULL, .flags = LOG_SINK_RAW };
+
+    // Formatted once for all three text sinks; nothing formatted for the raw one or the filtered route.
+    log_route_t fanout[] = { { .sink = &null_sink }, { .sink = &null_sink }, { .sink = &null_sink }, { .sink = &raw_sink } };
+    log_route_t raw_only[] = { { .sink = &raw_sink } };
+    log_route_t unmatched[] = { { .sink = &null_sink, .level = LOG_ERROR }, { .sink = &null_sink, .filter = errors_only } };
+    log_sink_t fd_sink = log_sink_from_fd(devnull);
+
+    static char ring[64 * 1024];
+    struct ring_sink_state ring_state = { .buffer = ring, .size = sizeof(ring) };
+    log_sink_t ring_sink = log_sink_ring_buffer(&ring_state);
+
+    static char buffer[64 * 1024];
+    struct buffered_sink_state buffered_state = { .fd = devnull, .buffer = buffer, .size = sizeof(buffer) };
+    log_sink_t buffered_sink = log_sink_buffered_fd(&buffered_state);
+
+    // A failing dependency repeating the same record, with and without dedup in front of the sink.
+    struct dedup_sink_state dedup_state = { .sink = &fd_sink };
+    log_sink_t dedup_sink = log_sink_dedup(&dedup_state);
+
+    static char mmap_path[64];
+    snprintf(mmap_path, sizeof(mmap_path), "/tmp/logger_bench.%d.log", (int) getpid());
+    struct mmap_sink_state mmap_state = { .path = mmap_path };
+    log_sink_t mmap_sink = log_sink_mmap_file(&mmap_state);
+
+    // The same records written to files, plainly, buffered, through io_uring, compressed and indexed.
+    const char* file_dirs[2] = { "/dev/shm", "/var/tmp" };
+    char file_paths[2][5][96];
+    int file_fds[2][5];
+    static char file_buffers[2][64 * 1024];
+    struct buffered_sink_state file_buffered_states[2];
+    struct uring_sink_state file_uring_states[2];
+    struct compressed_sink_state file_compressed_states[2];
+    struct indexed_sink_state file_indexed_states[2];
+    log_sink_t file_sinks[2][5];
+    for (int d = 0; d < 2; ++d) {
+        for (int k = 0; k < 5; ++k) {
+            snprintf(file_paths[d][k], sizeof(file_paths[d][k]), "%s/logger_bench.%d.%d.log", file_dirs[d], (int) getpid(), k);
+            file_fds[d][k] = open(file_paths[d][k], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (file_fds[d][k] < 0)
+                file_fds[d][k] = devnull;
+        }
+        file_buffered_states[d] = (struct buffered_sink_state) { .fd = file_fds[d][1], .buffer = file_buffers[d], .size = sizeof(file_buffers[d]) };
+        file_uring_states[d] = (struct uring_sink_state) { .fd = file_fds[d][2] };
+        file_compressed_states[d] = (struct compressed_sink_state) { .fd = file_fds[d][3] };
+        file_indexed_states[d] = (struct indexed_sink_state) { .fd = file_fds[d][4] };
+        file_sinks[d][0] = log_sink_from_fd(file_fds[d][0]);
+        file_sinks[d][1] = log_sink_buffered_fd(&file_buffered_states[d]);
+        file_sinks[d][2] = log_sink_uring(&file_uring_states[d]);
+        file_sinks[d][3] = log_sink_compressed(&file_compressed_states[d]);
+        file_sinks[d][4] = log_sink_indexed(&file_indexed_states[d]);
+    }
+    static char shm_name[64];
+    snprintf(shm_name, sizeof(shm_name), "/logger_bench.%d", (int) getpid());
+    struct shm_sink_state shm_state = { .name = shm_name, .create = 1 };
+    log_sink_t shm_sink = log_sink_shm(&shm_state);
+    pid_t shm_drain = shm_state.ring ? start_shm_drain(shm_state.ring) : -1;
+
+    if (!log_sink_uring_is_native(&file_uring_states[0]))
+        fprintf(stderr, "logger_bench: io_uring is not available, the uring cases use plain writes\n");
+
+    bench_case_t cases[] = {
+        { "disabled_level",                 emit_disabled, &null_sink,     NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "null_sink",                      emit_enabled,  &null_sink,     NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "null_sink_fields",               emit_fields,   &null_sink,     NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "null_sink_fields_json",          emit_fields,   &null_sink,     NULL,                   log_encode_json,    NULL,           0, 1, records, NULL },
+        { "null_sink_fields_logfmt",        emit_fields,   &null_sink,     NULL,                   log_encode_logfmt,  NULL,           0, 1, records, NULL },
+        { "null_sink_fields_binary",        emit_fields,   &null_sink,     NULL,                   log_encode_binary,  NULL,           0, 1, records, NULL },
+        { "rate_limited",                   emit_limited,  &null_sink,     NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "span",                           emit_span,     &null_sink,     NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "span_args",                      emit_span_args, &null_sink,    NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "ring_sink",                      emit_enabled,  &ring_sink,     NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "fd_sink",                        emit_enabled,  &fd_sink,       NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "buffered_fd_sink",               emit_enabled,  &buffered_sink, NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "mmap_file_sink",                 emit_enabled,  &mmap_sink,     NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "shm_sink",                       emit_enabled,  &shm_sink,      NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "dedup_fd_sink",                  emit_enabled,  &dedup_sink,    NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "fd_sink_burst",                  emit_burst,    &fd_sink,       NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "dedup_fd_sink_burst",            emit_burst,    &dedup_sink,    NULL,                   NULL,               NULL,           0, 1, records, NULL },
+        { "null_sink_default_formatter",    emit_enabled,  &null_sink,     default_formatter,      NULL,               NULL,           0, 1, records, NULL },
+        { "null_sink_message_formatter",    emit_enabled,  &null_sink,     message_only_formatter, NULL,               NULL,           0, 1, records, NULL },
+        { "null_sink_timestamp_formatter",  emit_enabled,  &null_sink,     timestamp_formatter,    NULL,               NULL,           0, 1, records, NULL },
+        { "routes_fanout",                  emit_enabled,  NULL,           NULL,                   NULL,               fanout,         4, 1, records, NULL },
+        { "routes_raw_only",                emit_enabled,  NULL,           NULL,                   NULL,               raw_only,       1, 1, records, NULL },
+        { "routes_unmatched",               emit_enabled,  NULL,           NULL,                   NULL,               unmatched,      2, 1, records, NULL },
+        { "fd_sink_tmpfs",                  emit_enabled,  &file_sinks[0][0], NULL,                NULL,               NULL,           0, 1, records, NULL },
+        { "buffered_fd_sink_tmpfs",         emit_enabled,  &file_sinks[0][1], NULL,                NULL,               NULL,           0, 1, records, NULL },
+        { "uring_sink_tmpfs",               emit_enabled,  &file_sinks[0][2], NULL,                NULL,               NULL,           0, 1, records, &file_uring_states[0].syscalls },
+        { "compressed_sink_tmpfs",          emit_enabled,  &file_sinks[0][3], NULL,                NULL,               NULL,           0, 1, records, NULL },
+        { "indexed_sink_tmpfs",             emit_enabled,  &file_sinks[0][4], NULL,                NULL,               NULL,           0, 1, records, NULL },
+        { "fd_sink_disk",                   emit_enabled,  &file_sinks[1][0], NULL,                NULL,               NULL,           0, 1, records, NULL },
+        { "buffered_fd_sink_disk",          emit_enabled,  &file_sinks[1][1], NULL,                NULL,               NULL,           0, 1, records, NULL },
+        { "uring_sink_disk",                emit_enabled,  &file_sinks[1][2], NULL,                NULL,               NULL,           0, 1, records, &file_uring_states[1].syscalls },
+        { "compressed_sink_disk",           emit_enabled,  &file_sinks[1][3], NULL,                NULL,               NULL,           0, 1, records, NULL },
+        { "indexed_sink_disk",              emit_enabled,  &file_sinks[1][4], NULL,                NULL,               NULL,           0, 1, records, NULL },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+        run_case(&cases[i]);
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        bench_case_t contended[] = {
+            { "threads_null_sink",          emit_enabled,  &null_sink,     NULL,                   NULL,               NULL,           0, threads, records, NULL },
+            { "threads_ring_sink",          emit_enabled,  &ring_sink,     NULL,                   NULL,               NULL,           0, threads, records, NULL },
+            { "threads_fd_sink",            emit_enabled,  &fd_sink,       NULL,                   NULL,               NULL,           0, threads, records, NULL },
+            { "threads_buffered_fd_sink",   emit_enabled,  &buffered_sink, NULL,                   NULL,               NULL,           0, threads, records, NULL },
+            { "threads_mmap_file_sink",     emit_enabled,  &mmap_sink,     NULL,                   NULL,               NULL,           0, threads, records, NULL },
+            { "threads_uring_sink_disk",    emit_enabled,  &file_sinks[1][2], NULL,                NULL,               NULL,           0, threads, records, &file_uring_states[1].syscalls },
+            { "threads_shm_sink",           emit_enabled,  &shm_sink,      NULL,                   NULL,               NULL,           0, threads, records, NULL },
+        };
+        for (size_t i = 0; i < sizeof(contended) / sizeof(contended[0]); ++i)
+            run_case(&contended[i]);
+    }
+
+    log_sink_buffered_fd_close(&buffered_state);
+    log_sink_dedup_close(&dedup_state);
+    for (int d = 0; d < 2; ++d) {
+        log_sink_buffered_fd_close(&file_buffered_states[d]);
+        log_sink_uring_close(&file_uring_states[d]);
+        log_sink_compressed_close(&file_compressed_states[d]);
+        log_sink_indexed_close(&file_indexed_states[d]);
+        for (int k = 0; k < 5; ++k) {
+            if (file_fds[d][k] != devnull)
+                close(file_fds[d][k]);
+            unlink(file_paths[d][k]);
+        }
+    }
+
+    if (shm_drain > 0) {
+        kill(shm_drain, SIGKILL);
+        waitpid(shm_drain, NULL, 0);
+    }
+    if (shm_state.dropped > 0)
+        fprintf(stderr, "logger_bench: the shm cases dropped %zu records on a full ring\n", shm_state.dropped);
+    log_sink_shm_close(&shm_state);
+    shm_unlink(shm_name);
+
+    log_sink_mmap_file_close(&mmap_state);
+    for (unsigned i = 0; i < mmap_state.next_index; ++i) {
+        char segment[96];
+        snprintf(segment, sizeof(segment), "%s.%u", mmap_path, i);
+        unlink(segment);
+    }
+    close(devnull);
+    return 0;
+}
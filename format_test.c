@@ -0,0 +1,143 @@
+/*
+ * Checks `log_vformat` against `vsnprintf`: for every case both must return the same length
+ * and write the same bytes, whatever room the buffer has. Every format is run from a
+ * literal, so it goes through the cache of parsed formats, and from a copy in a buffer
+ * that's reused for other formats, which is parsed every time.
+ *
+ *     logger_format_test     (exits non-zero and names the cases that differ)
+ */
+#define LOGGER_IMPLEMENTATION
+#include "logger.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+
+static int failures = 0;
+static int cases = 0;
+
+// Room for the output, none at all, a single byte (the terminator only) and a few cut-offs.
+static const int sizes[] = { 256, 0, 1, 2, 5, 9 };
+
+__attribute__((format(printf, 3, 4)))
+static void check(int line, int literal, const char* format, ...) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        char expected[256];
+        char actual[256];
+        memset(expected, '#', sizeof(expected));
+        memset(actual, '#', sizeof(actual));
+
+        // Mark the format the way `logger_log_at` does for a literal, so the cache is used.
+        logger_literal_format = literal ? format : NULL;
+        va_list args;
+        va_start(args, format);
+        int expected_len = vsnprintf(expected, (size_t) sizes[i], format, args);
+        va_end(args);
+        va_start(args, format);
+        int actual_len = log_vformat(actual, sizes[i], format, args);
+        va_end(args);
+        logger_literal_format = NULL;
+
+        cases += 1;
+        if (expected_len != actual_len || memcmp(expected, actual, sizeof(expected)) != 0) {
+            failures += 1;
+            fprintf(stderr, "format_test.c:%d: \"%s\" %s, size %d: expected %d \"%.*s\", got %d \"%.*s\"\n",
+                    line, format, literal ? "cached" : "parsed", sizes[i],
+                    expected_len, sizes[i] ? (int) strnlen(expected, sizeof(expected)) : 0, expected,
+                    actual_len, sizes[i] ? (int) strnlen(actual, sizeof(actual)) : 0, actual);
+        }
+    }
+}
+
+// Runs the case from the literal and from a copy of it in a buffer that's reused for the next.
+#define CHECK(format, ...) do {                                                 \
+    check(__LINE__, 1, format, __VA_ARGS__);                                    \
+    static char _copy[64];                                                      \
+    strcpy(_copy, format);                                                      \
+    check(__LINE__, 0, _copy, __VA_ARGS__);                                     \
+} while (0)
+
+#define CHECK_PLAIN(format) do {                                                \
+    check(__LINE__, 1, "%s" format, "");                                        \
+    static char _copy[64];                                                      \
+    strcpy(_copy, format);                                                      \
+    check(__LINE__, 0, "%s", _copy);                                            \
+} while (0)
+
+
+int main(void) {
+    // Literals and %%.
+    CHECK_PLAIN("");
+    CHECK_PLAIN("plain text");
+    CHECK("%d%%", 100);
+    CHECK("%% %d %%", 5);
+    CHECK("%%%%%s", "x");
+
+    // Integers and their length modifiers.
+    CHECK("%d %i", 0, -1);
+    CHECK("%d %d", INT_MIN, INT_MAX);
+    CHECK("%u %x %X", 3000000000u, 0xdeadbeefu, 0xdeadbeefu);
+    CHECK("%hhd %hhu", -3, 300);
+    CHECK("%hd %hu", -40000, 70000);
+    CHECK("%ld %lu %lx", LONG_MIN, ULONG_MAX, 255ul);
+    CHECK("%lld %llu", LLONG_MIN, ULLONG_MAX);
+    CHECK("%zu %zd", (size_t) 12345, (ssize_t) -12345);
+    CHECK("%jd %ju", (intmax_t) -7, (uintmax_t) 7);
+    CHECK("%td", (ptrdiff_t) -99);
+
+    // Flags, width and precision.
+    CHECK("[%5d] [%-5d] [%05d] [%05u]", 42, 42, -42, 42u);
+    CHECK("[%+d] [% d] [%+d]", 42, 42, -42);
+    CHECK("[%#x] [%#X] [%#o] [%o]", 255u, 255u, 8u, 8u);
+    CHECK("[%.3d] [%8.3d] [%-8.3x] [%.0d]", 7, -7, 7u, 0);
+    CHECK("[%1d] [%20d]", 123456, INT_MIN);
+
+    // Widths and precisions from the arguments, negative ones included.
+    CHECK("[%*d] [%-*d]", 6, 1, 6, 1);
+    CHECK("[%*d]", -6, 1);
+    CHECK("[%.*d] [%.*s]", 4, 3, 2, "abcdef");
+    CHECK("[%*.*f]", 10, 2, 3.14159);
+    CHECK("[%.*s]", -1, "negative precision is ignored");
+
+    // Characters and strings, NULL too.
+    CHECK("[%c] [%3c] [%-3c]", 'a', 'b', 'c');
+    CHECK("[%s] [%8s] [%-8s] [%.2s]", "abc", "abc", "abc", "abc");
+    CHECK("[%s]", "");
+    const char* volatile null_string = NULL;
+    CHECK("[%s] [%10s] [%-10s]", null_string, null_string, null_string);
+
+    // Floating point.
+    CHECK("%f %f %f", 0.0, -0.0, 1.5);
+    CHECK("%.0f %.1f %.9f", 2.5, 0.05, 1.0 / 3);
+    CHECK("%f %f", 1e300, -1e-300);
+    CHECK("[%10.3f] [%-10.3f] [%010.3f] [%+.2f]", 3.14159, 3.14159, -3.14159, 2.0);
+    CHECK("%e %E %g %G %a", 12345.678, 12345.678, 0.0001234, 1e20, 1.0);
+    CHECK("%Lf", 1.25L);
+    CHECK("%f %f %f", 1.0 / 0.0, -1.0 / 0.0, 0.0 / 0.0);
+    CHECK("%F", 1.0 / 0.0);
+
+    // Pointers.
+    int anchor = 0;
+    CHECK("%p", (void*) &anchor);
+    CHECK("%p", (void*) NULL);
+    CHECK("[%20p] [%-20p]", (void*) &anchor, (void*) &anchor);
+
+    // Long outputs, so truncation happens inside conversions as well as literals.
+    CHECK("%s and %s", "a rather long string", "another long string");
+    CHECK("%d%d%d%d%d%d%d%d", 1, 22, 333, 4444, 55555, 666666, 7777777, 88888888);
+
+    // Formats the fast path leaves to vsnprintf.
+    CHECK("%o %5o", 511u, 8u);
+    CHECK("[%ls] [%lc]", L"wide", (wint_t) L'w');
+
+    if (failures) {
+        fprintf(stderr, "logger_format_test: %d of %d cases differ from vsnprintf\n", failures, cases);
+        return EXIT_FAILURE;
+    }
+    printf("logger_format_test: %d cases match vsnprintf\n", cases);
+    return EXIT_SUCCESS;
+}
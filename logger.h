@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 
 #ifdef assert
@@ -24,24 +25,39 @@ typedef enum log_level_t {
 const char* log_level_name(log_level_t level);
 
 
-#define trace(...)  do { if (LOG_TRACE >= log_current->level) { logger_log(log_current, LOG_TRACE, current_source_location(), __VA_ARGS__); }} while (0)
-#define debug(...)  do { if (LOG_DEBUG >= log_current->level) { logger_log(log_current, LOG_DEBUG, current_source_location(), __VA_ARGS__); }} while (0)
-#define info(...)   do { if (LOG_INFO  >= log_current->level) { logger_log(log_current, LOG_INFO,  current_source_location(), __VA_ARGS__); }} while (0)
-#define warn(...)   do { if (LOG_WARN  >= log_current->level) { logger_log(log_current, LOG_WARN,  current_source_location(), __VA_ARGS__); }} while (0)
-#define error(...)  do { if (LOG_ERROR >= log_current->level) { logger_log(log_current, LOG_ERROR, current_source_location(), __VA_ARGS__); }} while (0)
-#define panic(...)  do { if (LOG_PANIC >= log_current->level) { logger_log(log_current, LOG_PANIC, current_source_location(), __VA_ARGS__); terminate_with_backtrace(); }} while (0)
+// Statements below this level are compiled out (their arguments are still type checked).
+// `panic` is never compiled out.
+#ifndef LOG_COMPILE_MIN_LEVEL
+# define LOG_COMPILE_MIN_LEVEL LOG_TRACE
+#endif
+#define LOG_IS_COMPILED(level) ((level) >= LOG_COMPILE_MIN_LEVEL || (level) == LOG_PANIC)
+
+
+#define trace(...)  LOGGER__LOG(LOG_TRACE, __VA_ARGS__)
+#define debug(...)  LOGGER__LOG(LOG_DEBUG, __VA_ARGS__)
+#define info(...)   LOGGER__LOG(LOG_INFO,  __VA_ARGS__)
+#define warn(...)   LOGGER__LOG(LOG_WARN,  __VA_ARGS__)
+#define error(...)  LOGGER__LOG(LOG_ERROR, __VA_ARGS__)
+#define panic(...)  LOGGER__LOG_THEN(LOG_PANIC, terminate_with_backtrace(), __VA_ARGS__)
+
+// Limited statements for hot loops, e.g. `log_per_second(LOG_WARN, 10, "queue is full")`.
+// Each statement keeps its own count. When `log_per_second` lets a record through after
+// rejecting some, it first logs "suppressed N messages from file:line".
+#define log_every_n(level, n, ...)      LOGGER__LOG_LIMITED(level, LOG_LIMIT_EVERY_N,    n, __VA_ARGS__)
+#define log_first_n(level, n, ...)      LOGGER__LOG_LIMITED(level, LOG_LIMIT_FIRST_N,    n, __VA_ARGS__)
+#define log_per_second(level, n, ...)   LOGGER__LOG_LIMITED(level, LOG_LIMIT_PER_SECOND, n, __VA_ARGS__)
 
 #define assertc(cond)      do { if (logger_assert_is_enabled() && !(cond)) { logger_assert_log(log_current, current_source_location(), #cond, "");          terminate_with_backtrace(); }} while (0)
 #define assertf(cond, ...) do { if (logger_assert_is_enabled() && !(cond)) { logger_assert_log(log_current, current_source_location(), #cond, __VA_ARGS__); terminate_with_backtrace(); }} while (0)
 #define assert(...)        SELECT_FUNCTION(assert, VA_ARGS_DISPATCH(__VA_ARGS__))(__VA_ARGS__)
 
 
-#define trace_loc(loc, ...)  do { if (LOG_TRACE >= log_current->level) { logger_log(log_current, LOG_TRACE, loc, __VA_ARGS__); }} while (0)
-#define debug_loc(loc, ...)  do { if (LOG_DEBUG >= log_current->level) { logger_log(log_current, LOG_DEBUG, loc, __VA_ARGS__); }} while (0)
-#define info_loc(loc, ...)   do { if (LOG_INFO  >= log_current->level) { logger_log(log_current, LOG_INFO,  loc, __VA_ARGS__); }} while (0)
-#define warn_loc(loc, ...)   do { if (LOG_WARN  >= log_current->level) { logger_log(log_current, LOG_WARN,  loc, __VA_ARGS__); }} while (0)
-#define error_loc(loc, ...)  do { if (LOG_ERROR >= log_current->level) { logger_log(log_current, LOG_ERROR, loc, __VA_ARGS__); }} while (0)
-#define panic_loc(loc, ...)  do { if (LOG_PANIC >= log_current->level) { logger_log(log_current, LOG_PANIC, loc, __VA_ARGS__); terminate_with_backtrace(); }} while (0)
+#define trace_loc(loc, ...)  do { if (LOG_IS_COMPILED(LOG_TRACE)) { if (LOG_TRACE >= log_current->level) { logger_log(log_current, LOG_TRACE, loc, __VA_ARGS__); } else LOGGER__COUNT_FILTERED(LOG_TRACE); }} while (0)
+#define debug_loc(loc, ...)  do { if (LOG_IS_COMPILED(LOG_DEBUG)) { if (LOG_DEBUG >= log_current->level) { logger_log(log_current, LOG_DEBUG, loc, __VA_ARGS__); } else LOGGER__COUNT_FILTERED(LOG_DEBUG); }} while (0)
+#define info_loc(loc, ...)   do { if (LOG_IS_COMPILED(LOG_INFO))  { if (LOG_INFO  >= log_current->level) { logger_log(log_current, LOG_INFO,  loc, __VA_ARGS__); } else LOGGER__COUNT_FILTERED(LOG_INFO);  }} while (0)
+#define warn_loc(loc, ...)   do { if (LOG_IS_COMPILED(LOG_WARN))  { if (LOG_WARN  >= log_current->level) { logger_log(log_current, LOG_WARN,  loc, __VA_ARGS__); } else LOGGER__COUNT_FILTERED(LOG_WARN);  }} while (0)
+#define error_loc(loc, ...)  do { if (LOG_IS_COMPILED(LOG_ERROR)) { if (LOG_ERROR >= log_current->level) { logger_log(log_current, LOG_ERROR, loc, __VA_ARGS__); } else LOGGER__COUNT_FILTERED(LOG_ERROR); }} while (0)
+#define panic_loc(loc, ...)  do { if (LOG_IS_COMPILED(LOG_PANIC)) { if (LOG_PANIC >= log_current->level) { logger_log(log_current, LOG_PANIC, loc, __VA_ARGS__); } else LOGGER__COUNT_FILTERED(LOG_PANIC); terminate_with_backtrace(); }} while (0)
 
 #define assert_locc(loc, cond)      do { if (logger_assert_is_enabled() && !(cond)) { logger_assert_log(log_current, loc, #cond, "");          terminate_with_backtrace(); }} while (0)
 #define assert_locf(loc, cond, ...) do { if (logger_assert_is_enabled() && !(cond)) { logger_assert_log(log_current, loc, #cond, __VA_ARGS__); terminate_with_backtrace(); }} while (0)
@@ -58,33 +74,267 @@ typedef struct source_location_t {
 #define no_source_location()      ((source_location_t) { "", "", 0 })
 
 
+// How an argument travels through binary capture, classified at compile time by `LOG_ARG_TYPE`.
+typedef enum log_arg_type_t {
+    LOG_ARG_INT         = 'i',  /* Anything promoted to `int` */
+    LOG_ARG_INT64       = 'L',  /* `long`, `long long`, `size_t`, ... */
+    LOG_ARG_DOUBLE      = 'f',  /* `float` and `double` */
+    LOG_ARG_LONG_DOUBLE = 'F',  /* `long double`, captured as `double` */
+    LOG_ARG_POINTER     = 'p',  /* Any non-string pointer, captured by value */
+    LOG_ARG_STRING      = 's',  /* `char*` and `char[]`, captured by copy */
+} log_arg_type_t;
+
+#define LOG_MAX_ARGS 24     /* Including the format string */
+
+#define LOGGER__IS_STRING(x) (                                      \
+    __builtin_types_compatible_p(__typeof__(x), char*)          ||  \
+    __builtin_types_compatible_p(__typeof__(x), const char*)    ||  \
+    __builtin_types_compatible_p(__typeof__(x), char[])         ||  \
+    __builtin_types_compatible_p(__typeof__(x), const char[])       \
+)
+#define LOG_ARG_TYPE(x) (unsigned char) (                                                       \
+    LOGGER__IS_STRING(x)               ? LOG_ARG_STRING  :                                      \
+    __builtin_classify_type(x) == 8    ? (sizeof(x) > sizeof(double) ? LOG_ARG_LONG_DOUBLE : LOG_ARG_DOUBLE) : \
+    __builtin_classify_type(x) == 5    ? LOG_ARG_POINTER :                                      \
+    sizeof(x) > sizeof(int)            ? LOG_ARG_INT64   : LOG_ARG_INT                          \
+)
+
+#define LOGGER__NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, N, ...) N
+#define LOGGER__NARGS(...) LOGGER__NARGS_(__VA_ARGS__, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOGGER__FIRST(x, ...) x
+#define LOGGER__MAP_1(m, x)       m(x)
+#define LOGGER__MAP_2(m, x, ...)   m(x), LOGGER__MAP_1(m, __VA_ARGS__)
+#define LOGGER__MAP_3(m, x, ...)   m(x), LOGGER__MAP_2(m, __VA_ARGS__)
+#define LOGGER__MAP_4(m, x, ...)   m(x), LOGGER__MAP_3(m, __VA_ARGS__)
+#define LOGGER__MAP_5(m, x, ...)   m(x), LOGGER__MAP_4(m, __VA_ARGS__)
+#define LOGGER__MAP_6(m, x, ...)   m(x), LOGGER__MAP_5(m, __VA_ARGS__)
+#define LOGGER__MAP_7(m, x, ...)   m(x), LOGGER__MAP_6(m, __VA_ARGS__)
+#define LOGGER__MAP_8(m, x, ...)   m(x), LOGGER__MAP_7(m, __VA_ARGS__)
+#define LOGGER__MAP_9(m, x, ...)   m(x), LOGGER__MAP_8(m, __VA_ARGS__)
+#define LOGGER__MAP_10(m, x, ...)  m(x), LOGGER__MAP_9(m, __VA_ARGS__)
+#define LOGGER__MAP_11(m, x, ...)  m(x), LOGGER__MAP_10(m, __VA_ARGS__)
+#define LOGGER__MAP_12(m, x, ...)  m(x), LOGGER__MAP_11(m, __VA_ARGS__)
+#define LOGGER__MAP_13(m, x, ...)  m(x), LOGGER__MAP_12(m, __VA_ARGS__)
+#define LOGGER__MAP_14(m, x, ...)  m(x), LOGGER__MAP_13(m, __VA_ARGS__)
+#define LOGGER__MAP_15(m, x, ...)  m(x), LOGGER__MAP_14(m, __VA_ARGS__)
+#define LOGGER__MAP_16(m, x, ...)  m(x), LOGGER__MAP_15(m, __VA_ARGS__)
+#define LOGGER__MAP_17(m, x, ...)  m(x), LOGGER__MAP_16(m, __VA_ARGS__)
+#define LOGGER__MAP_18(m, x, ...)  m(x), LOGGER__MAP_17(m, __VA_ARGS__)
+#define LOGGER__MAP_19(m, x, ...)  m(x), LOGGER__MAP_18(m, __VA_ARGS__)
+#define LOGGER__MAP_20(m, x, ...)  m(x), LOGGER__MAP_19(m, __VA_ARGS__)
+#define LOGGER__MAP_21(m, x, ...)  m(x), LOGGER__MAP_20(m, __VA_ARGS__)
+#define LOGGER__MAP_22(m, x, ...)  m(x), LOGGER__MAP_21(m, __VA_ARGS__)
+#define LOGGER__MAP_23(m, x, ...)  m(x), LOGGER__MAP_22(m, __VA_ARGS__)
+#define LOGGER__MAP_24(m, x, ...)  m(x), LOGGER__MAP_23(m, __VA_ARGS__)
+#define LOGGER__ARG_TYPES(...) INTERNAL_CONCATENATE(LOGGER__MAP_, LOGGER__NARGS(__VA_ARGS__))(LOG_ARG_TYPE, __VA_ARGS__)
+
+
+typedef enum log_callsite_state_t {
+    LOG_CALLSITE_DEFAULT,   /* Log when the level of the current logger allows it */
+    LOG_CALLSITE_OFF,       /* Never log */
+    LOG_CALLSITE_ON,        /* Always log, regardless of level */
+} log_callsite_state_t;
+
+// Static, per call site description of a log statement. Its address doubles as the call site ID.
+// On ELF targets all of them are collected in the `log_callsites` section, see `log_callsite_set`.
+typedef struct log_callsite_t {
+    unsigned char     state;                        /* `log_callsite_state_t`, changed at runtime */
+    unsigned char     constant_format;              /* The format is a literal and can be referred to by ID */
+    unsigned char     registered;                   /* Described in the binary stream already */
+    unsigned char     args_checked;                 /* `arg_types` were matched against the format, see below */
+    unsigned char     arg_count;                    /* Including the format string */
+    log_level_t       level;
+    source_location_t location;
+    unsigned char     arg_types[LOG_MAX_ARGS];      /* `log_arg_type_t` of each argument, the format first. A
+                                                       `char*` that goes to a conversion other than %s becomes
+                                                       LOG_ARG_POINTER, any other pointer that goes to %s
+                                                       LOG_ARG_STRING, before they are first captured */
+} log_callsite_t;
+
+typedef enum log_limit_t {
+    LOG_LIMIT_EVERY_N,      /* The 1st, N+1th, 2N+1th, ... occurrence */
+    LOG_LIMIT_FIRST_N,      /* The first N occurrences, then nothing */
+    LOG_LIMIT_PER_SECOND,   /* At most N a second, in bursts of up to N */
+} log_limit_t;
+
+typedef struct log_limiter_t {
+    uint64_t count;         /* Occurrences, or for LOG_LIMIT_PER_SECOND when the next record is due in ns */
+    uint64_t suppressed;    /* LOG_LIMIT_PER_SECOND: rejected since the last record let through */
+} log_limiter_t;
+
+#if defined(__ELF__)
+# define LOGGER__CALLSITE_SECTION __attribute__((section("log_callsites"), aligned(8)))
+#else
+# define LOGGER__CALLSITE_SECTION
+#endif
+
+#define LOGGER__CALLSITE(lvl, ...)                                                                          \
+    static log_callsite_t _log_callsite LOGGER__CALLSITE_SECTION = {                                        \
+        LOG_CALLSITE_DEFAULT, __builtin_constant_p(LOGGER__FIRST(__VA_ARGS__, 0)), 0, 0,                    \
+        LOGGER__NARGS(__VA_ARGS__), lvl, { __FILE__, __func__, __LINE__ }, { LOGGER__ARG_TYPES(__VA_ARGS__) } \
+    };                                                                                                      \
+    unsigned char _log_state = __atomic_load_n(&_log_callsite.state, __ATOMIC_RELAXED)
+
+// The common case costs a single, predictable branch on `state` before the level check.
+#define LOGGER__CALLSITE_ENABLED(lvl) \
+    (__builtin_expect(_log_state, 0) ? _log_state == LOG_CALLSITE_ON : (lvl) >= log_current->level)
+
+// With the flight recorder on, every statement is kept whatever its level, see `log_init(.recorder = ...)`.
+// Only for statements that aren't logged: `logger_log_at` records the others from the arguments
+// it was given, so no argument is evaluated twice.
+#define LOGGER__RECORD(...) \
+    if (__builtin_expect(logger_recorder_enabled, 0)) logger_recorder_capture(&_log_callsite, __VA_ARGS__)
+
+// `then` runs whether or not the record was logged, so a `panic` whose call site was
+// switched off still terminates.
+#define LOGGER__LOG_THEN(lvl, then, ...) do { if (LOG_IS_COMPILED(lvl)) {                                     \
+    LOGGER__CALLSITE(lvl, __VA_ARGS__);                                                                     \
+    if (LOGGER__CALLSITE_ENABLED(lvl)) {                                                                    \
+        logger_log_at(&_log_callsite, log_current, __VA_ARGS__);                                            \
+    } else {                                                                                                \
+        LOGGER__COUNT_FILTERED(lvl);                                                                        \
+        LOGGER__RECORD(__VA_ARGS__);                                                                        \
+    }                                                                                                       \
+    then;                                                                                                   \
+}} while (0)
+
+// Rejected statements only touch the limiter; nothing is formatted.
+#define LOGGER__LOG_LIMITED(lvl, kind, n, ...) do { if (LOG_IS_COMPILED(lvl)) {                               \
+    LOGGER__CALLSITE(lvl, __VA_ARGS__);                                                                     \
+    static log_limiter_t _log_limiter;                                                                      \
+    if (!LOGGER__CALLSITE_ENABLED(lvl)) {                                                                   \
+        LOGGER__COUNT_FILTERED(lvl);                                                                        \
+        LOGGER__RECORD(__VA_ARGS__);                                                                        \
+    } else if (logger_limiter_admit(&_log_limiter, kind, (n), &_log_callsite)) {                            \
+        logger_log_at(&_log_callsite, log_current, __VA_ARGS__);                                            \
+    } else {                                                                                                \
+        LOGGER__RECORD(__VA_ARGS__);                                                                        \
+    }                                                                                                       \
+}} while (0)
+
+#define LOGGER__LOG(lvl, ...) LOGGER__LOG_THEN(lvl, (void) 0, __VA_ARGS__)
+
+
+
+typedef enum log_field_type_t {
+    LOG_FIELD_INT,
+    LOG_FIELD_UINT,
+    LOG_FIELD_DOUBLE,
+    LOG_FIELD_BOOL,
+    LOG_FIELD_STRING,
+} log_field_type_t;
+
+// A typed key/value pair attached to a record, see `log_fields`.
+typedef struct log_field_t {
+    const char*         key;
+    log_field_type_t    type;
+    union {
+        int64_t         i;
+        uint64_t        u;
+        double          d;
+        const char*     s;
+    } value;
+} log_field_t;
+
+#define log_int(key, v)     ((log_field_t) { key, LOG_FIELD_INT,    { .i = (int64_t) (v) } })
+#define log_uint(key, v)    ((log_field_t) { key, LOG_FIELD_UINT,   { .u = (uint64_t) (v) } })
+#define log_double(key, v)  ((log_field_t) { key, LOG_FIELD_DOUBLE, { .d = (double) (v) } })
+#define log_bool(key, v)    ((log_field_t) { key, LOG_FIELD_BOOL,   { .u = !!(v) } })
+#define log_str(key, v)     ((log_field_t) { key, LOG_FIELD_STRING, { .s = (v) } })
+
+// Structured statement, e.g. `log_fields(LOG_INFO, "request served", log_int("status", 200), log_str("path", path))`.
+// `message` is taken as is, not as a format.
+#define log_fields(level, message, ...) do { if (LOG_IS_COMPILED(level)) {                                    \
+    LOGGER__CALLSITE(level, message);                                                                       \
+    const char* _log_message = (message);                                                                   \
+    LOGGER__RECORD(_log_message);                                                                           \
+    if (LOGGER__CALLSITE_ENABLED(level)) {                                                                  \
+        const log_field_t _log_fields[] = { __VA_ARGS__ };                                                  \
+        logger_log_fields(log_current, level, _log_callsite.location, _log_message, _log_fields, sizeof(_log_fields) / sizeof(_log_fields[0])); \
+    }                                                                                                       \
+}} while (0)
+
 
 typedef struct log_record_t {
     const char*         logger_name;
     log_level_t         level;
     source_location_t   location;
-    const char*         message;
+    const char*         message;        /* The formatted text; NULL for filters and LOG_SINK_RAW sinks */
     size_t              message_len;
+    uint64_t            timestamp;      /* Nanoseconds since the Unix epoch, taken from `log_now` when the statement ran */
+    const log_field_t*  fields;         /* Only valid during the call; records queued by the async backend have none */
+    size_t              field_count;
+    const char*         format;         /* The statement's format, or its message for `log_fields` */
+    va_list*            args;           /* Its arguments, NULL for `log_fields`. Only valid during the call; `va_copy` before use */
 } log_record_t;
 
+// Messages longer than this are cut; anything shorter is passed to the sink whole.
+#ifndef LOG_MESSAGE_MAX_SIZE
+# define LOG_MESSAGE_MAX_SIZE (1 << 20)
+#endif
+
+// Counters and latency histograms of the logger itself, see `log_stats_snapshot`. Define as 0
+// (the same in every file) to compile them out.
+#ifndef LOG_STATS
+# define LOG_STATS 1
+#endif
+
 
 typedef void (*log_sink_write_fn)(void* data, const log_record_t* record);
+
+typedef enum log_sink_flags_t {
+    LOG_SINK_RAW = 1,       /* Wants `format` and `args` rather than text; written inline, never queued by the async backend */
+    LOG_SINK_INLINE = 2,    /* Gets text, but written inline like LOG_SINK_RAW, so `args` is valid too. Must be quick */
+} log_sink_flags_t;
+
 typedef struct log_sink_t {
     log_sink_write_fn write;
     void* data;
+    unsigned flags;         /* `log_sink_flags_t` */
+    const char* name;       /* Label in `log_stats_format`, NULL: the address of `data` */
 } log_sink_t;
 
+// Returns whether the record should go to the route's sink. Called before the record is formatted.
+typedef int (*log_filter_fn)(void* data, const log_record_t* record);
+
+// Sends records at or above `level` that pass `filter` to `sink`, in addition to the sink set
+// for the record's level, e.g.
+//     with_log(log_routes({ .sink = &stderr_sink, .level = LOG_WARN },
+//                         { .sink = &file_sink },
+//                         { .sink = &ring_sink, .filter = only_trace })) { ... }
+// A record is formatted at most once, and only when a sink it goes to wants text.
+typedef struct log_route_t {
+    log_sink_t*     sink;
+    log_level_t     level;          /* LOG_DEFAULT: any level */
+    log_filter_fn   filter;         /* NULL: every record at or above `level` */
+    void*           filter_data;
+} log_route_t;
+
+#define LOG_MAX_ROUTES 16           /* Routes past this many are ignored */
+
+// Sets `.routes` and `.route_count` of `with_log`, `log_init` or `log_reconfigure` from a list of routes.
+#define log_routes(...) .routes = (log_route_t[]) { __VA_ARGS__ }, .route_count = sizeof((log_route_t[]) { __VA_ARGS__ }) / sizeof(log_route_t)
+
 
 struct log_ctx_t;
 typedef int (*log_formatter_fn)(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args);
 
+// Turns a whole record, fields included, into the bytes handed to the sink. Returns the length
+// it needs like snprintf; a record that doesn't fit is encoded again into a larger buffer.
+typedef int (*log_encoder_fn)(char* buffer, int size, const struct log_record_t* record);
+
 typedef struct log_ctx_t {
     const char* name;
     log_level_t level;
     log_formatter_fn formatter;
+    log_encoder_fn encoder;
     struct log_sink_t* sinks[LOG_LEVEL_COUNT];
     struct log_ctx_t* parent;
     source_location_t declaration_location;
+    const log_route_t* routes;  /* See `log_routes`; used instead of the global routes */
+    size_t route_count;
+    uint64_t config_version;    /* Configuration `logger_push` filled the unset fields in from */
+    unsigned inherited;         /* Which fields `logger_push` filled in, one bit per sink then formatter, encoder and routes */
 } log_ctx_t;
 
 
@@ -109,9 +359,10 @@ typedef void (*logger_log_fn)(const struct log_ctx_t* logger, log_level_t level,
 void logger_log_impl(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args);
 void logger_log_init(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args);
 extern logger_log_fn logger_log_internal;
+void logger_log_fields(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, const log_field_t* fields, size_t field_count);
 
 
-__attribute__((format(printf, 4, 5), always_inline))
+__attribute__((format(printf, 4, 5)))
 static inline void logger_log(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, ...) {
     va_list args;
     va_start(args, message);
@@ -119,6 +370,66 @@ static inline void logger_log(const struct log_ctx_t* logger, log_level_t level,
     va_end(args);
 }
 
+// Statements below the level count towards `log_stats_t`, on the statement's thread and without a call.
+#if LOG_STATS
+extern THREAD_LOCAL uint64_t logger_stats_filtered[LOG_LEVEL_COUNT];
+void logger_stats_attach(void);
+# define LOGGER__COUNT_FILTERED(lvl) do {                                                                   \
+    uint64_t _log_filtered = __atomic_load_n(&logger_stats_filtered[lvl], __ATOMIC_RELAXED);               \
+    __atomic_store_n(&logger_stats_filtered[lvl], _log_filtered + 1, __ATOMIC_RELAXED);                    \
+    if (__builtin_expect(_log_filtered == 0, 0)) logger_stats_attach();                                    \
+} while (0)
+#else
+# define LOGGER__COUNT_FILTERED(lvl) ((void) 0)
+#endif
+
+extern int logger_recorder_enabled;
+void logger_recorder_capture(log_callsite_t* callsite, const char* message, ...);
+void logger_recorder_vcapture(log_callsite_t* callsite, const char* message, va_list args);
+
+// The format of the statement being logged on this thread, if it is a literal; only such
+// formats are parsed once and cached by address, see `log_vformat`.
+extern THREAD_LOCAL const char* logger_literal_format;
+
+extern int logger_binary_enabled;
+void logger_binary_capture(log_callsite_t* callsite, const struct log_ctx_t* logger, const char* message, va_list args);
+
+int logger_limiter_admit_rate(log_limiter_t* limiter, unsigned per_second, const log_callsite_t* callsite);
+
+static inline int logger_limiter_admit(log_limiter_t* limiter, log_limit_t kind, unsigned n, const log_callsite_t* callsite) {
+    if (kind == LOG_LIMIT_PER_SECOND)
+        return logger_limiter_admit_rate(limiter, n, callsite);
+    uint64_t count = __atomic_fetch_add(&limiter->count, 1, __ATOMIC_RELAXED);
+    if (kind == LOG_LIMIT_EVERY_N)
+        return n <= 1 || count % n == 0;
+    return count < n;
+}
+
+__attribute__((format(printf, 3, 4)))
+static inline void logger_log_at(log_callsite_t* callsite, const struct log_ctx_t* logger, const char* message, ...) {
+    va_list args;
+    va_start(args, message);
+    if (__builtin_expect(logger_recorder_enabled, 0)) {
+        logger_recorder_vcapture(callsite, message, args);
+        va_end(args);
+        va_start(args, message);
+    }
+    const char* outer_format = logger_literal_format;
+    logger_literal_format = callsite->constant_format ? message : NULL;
+    if (logger_binary_enabled && callsite->constant_format) {
+        logger_binary_capture(callsite, logger, message, args);
+        if (callsite->level == LOG_PANIC) {
+            va_end(args);
+            va_start(args, message);
+            logger_log_internal(logger, callsite->level, callsite->location, message, args);
+        }
+    } else {
+        logger_log_internal(logger, callsite->level, callsite->location, message, args);
+    }
+    logger_literal_format = outer_format;
+    va_end(args);
+}
+
 __attribute__((format(printf, 4, 5)))
 void logger_assert_log(const struct log_ctx_t* logger, source_location_t source_location, const char* condition, const char* message, ...);
 
@@ -155,15 +466,282 @@ void logger_pop(struct log_ctx_t* log, source_location_t location);
 extern log_sink_t stdout_sink;
 extern log_sink_t stderr_sink;
 
+// The formatter used unless `log_init` or a scope says otherwise: "<file>:<line> [<level>:<name>]: <message>".
+int default_formatter(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args);
+
+// Like `default_formatter`, prefixed with the local time of the record: "2024-05-01 13:37:00.123456 ".
+int timestamp_formatter(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args);
+
+// Encoders for `log_init(.encoder = ...)` and `with_log(.encoder = ...)`. Plain statements are
+// encoded too, with the formatted message as "msg".
+//   json:   {"ts":1714563420123456789,"level":"info","logger":"net","file":"main.c","line":12,"msg":"served","status":200}
+//   logfmt: ts=1714563420123456789 level=info logger=net file=main.c:12 msg=served status=200
+//   binary: u32 size of the rest, u64 ts, u8 level, u32 line, then logger, file and msg as u16 length
+//           and bytes, u8 field count and per field u8 `log_field_type_t`, key and an 8 byte value or
+//           a string. A NULL string has length 0xFFFF. Sinks that end records with '\n' still do.
+int log_encode_json(char* buffer, int size, const struct log_record_t* record);
+int log_encode_logfmt(char* buffer, int size, const struct log_record_t* record);
+int log_encode_binary(char* buffer, int size, const struct log_record_t* record);
+
+// Drop-in replacements for `vsnprintf` and `snprintf`, faster for the conversions log statements use.
+int log_vformat(char* buffer, int size, const char* format, va_list args);
+__attribute__((format(printf, 3, 4)))
+int log_format(char* buffer, int size, const char* format, ...);
+
+log_sink_t log_sink_from_fd(int fd);
+
 int logger_assert_is_enabled(void);
 
+// Keeps the most recent records in `buffer`, split into slots of `slot_size` bytes (default
+// LOG_RING_DEFAULT_SLOT_SIZE) each holding one record, truncated to fit. Any number of threads
+// may write and read concurrently; writers never wait and readers never block writers.
 struct ring_sink_state {
     char*  buffer;
     size_t size;
-    size_t head;
+    size_t slot_size;
+
+    size_t head;            /* Sequence number of the next record */
+    size_t slot_count;
+    char*  slots;           /* `buffer` aligned for the slot headers */
 };
 log_sink_t log_sink_ring_buffer(struct ring_sink_state* st);
 
+#define LOG_RING_DEFAULT_SLOT_SIZE 256
+
+// Calls `fn` with a consistent copy of each of the last `count` records (0: all that are kept),
+// oldest first. Records overwritten during the read are skipped. Returns the number of calls made.
+typedef void (*log_ring_record_fn)(size_t sequence, const char* message, size_t message_len, void* data);
+size_t log_sink_ring_buffer_read(struct ring_sink_state* st, size_t count, log_ring_record_fn fn, void* data);
+
+// Collects records in `buffer` and writes them with a single `writev` once it is full,
+// `flush_interval_ms` has passed since the last write, a record at or above `flush_level`
+// arrives or `log_flush` is called. When no later record arrives, a thread of the logger's own,
+// started by the first sink with an interval, writes them out instead; the coarse clock can make
+// that a few milliseconds late. The state must stay alive until `log_sink_buffered_fd_close`;
+// sinks still open at exit are flushed then. Setting up a state that is still open returns its
+// sink and changes nothing.
+struct buffered_sink_state {
+    int         fd;
+    char*       buffer;
+    size_t      size;
+    int         flush_interval_ms;  /* 0: no time based flushing */
+    log_level_t flush_level;        /* LOG_DEFAULT: no level based flushing */
+
+    size_t      used;
+    int         lock;
+    long long   last_flush_ms;
+    size_t      syscalls;           /* Writes issued so far */
+    size_t      records;            /* Records received so far */
+    struct buffered_sink_state* next;
+};
+log_sink_t log_sink_buffered_fd(struct buffered_sink_state* st);
+void log_sink_buffered_fd_close(struct buffered_sink_state* st);
+
+// Like the buffered sink, but full buffers are handed to io_uring instead of `writev`: the
+// logging thread queues the write and carries on with the next of `queue_depth` buffers, and
+// a buffer is reused once its write completes. Queued writes are submitted together, one
+// `io_uring_enter` for up to half of the buffers, and the thread only waits when every
+// buffer is in flight. `fd` must be a regular file; records are written at explicit offsets
+// from its end. Where io_uring isn't available (old kernel, seccomp, pipes) it falls back to
+// plain writes of a single buffer. The state must stay alive until `log_sink_uring_close`;
+// sinks still open at exit are flushed then. Setting up a state that is still open returns
+// its sink and changes nothing.
+struct uring_sink_state {
+    int         fd;
+    size_t      buffer_size;        /* Default LOG_URING_DEFAULT_BUFFER_SIZE */
+    unsigned    queue_depth;        /* Buffers, and so writes in flight at most. Default LOG_URING_DEFAULT_QUEUE_DEPTH */
+    log_level_t flush_level;        /* LOG_DEFAULT: no level based flushing */
+
+    struct logger__uring* uring;    /* NULL once closed or if the buffers couldn't be allocated */
+    int         lock;
+    size_t      syscalls;           /* `io_uring_enter` calls, or writes when falling back */
+    size_t      records;            /* Records received so far */
+    size_t      errors;             /* Writes that failed; their records are lost */
+    struct uring_sink_state* next;
+};
+log_sink_t log_sink_uring(struct uring_sink_state* st);
+void log_sink_uring_close(struct uring_sink_state* st);
+
+// Whether the sink submits through io_uring rather than falling back to plain writes.
+int log_sink_uring_is_native(const struct uring_sink_state* st);
+
+#define LOG_URING_DEFAULT_BUFFER_SIZE   (64 * 1024)
+#define LOG_URING_DEFAULT_QUEUE_DEPTH   8
+
+// Compresses records into frames that decode on their own, written to `fd` one after the
+// other. Records are copied into the frame being filled; full frames are compressed (LZ4
+// block format) and written by a thread of the sink's own, so a logging thread only waits
+// when that thread is LOG_COMPRESSED_FRAMES frames behind. A frame is also closed by a record
+// at or above `flush_level`, by `log_flush` and by `panic`. A frame only holds whole records,
+// unless a record is longer than `frame_size`. Decompress with `logger_decompress`. The state
+// must stay alive until `log_sink_compressed_close`; sinks still open at exit are flushed then.
+// Setting up a state that is still open returns its sink and changes nothing.
+struct compressed_sink_state {
+    int         fd;
+    size_t      frame_size;         /* Text per frame at most. Default LOG_COMPRESSED_DEFAULT_FRAME_SIZE */
+    log_level_t flush_level;        /* LOG_DEFAULT: no level based flushing */
+
+    struct logger__compressor* compressor;  /* NULL once closed or if the sink couldn't be set up */
+    int         lock;
+    size_t      records;            /* Records received so far */
+    size_t      frames;             /* Frames written so far */
+    size_t      bytes_in;           /* Text in the frames written so far */
+    size_t      bytes_out;          /* Bytes written so far, frame headers included */
+    struct compressed_sink_state* next;
+};
+log_sink_t log_sink_compressed(struct compressed_sink_state* st);
+void log_sink_compressed_close(struct compressed_sink_state* st);
+
+#define LOG_COMPRESSED_DEFAULT_FRAME_SIZE   (256 * 1024)
+#define LOG_COMPRESSED_FRAMES               4       /* Frames being filled or waiting for the thread */
+
+// Passes records on to `sink`, except that one with the same callsite and text as the record
+// passed on last, within `window_ms` of it, is only counted. The count goes out as a record
+// "previous message repeated N times" with the next record that is passed on, on `log_flush`
+// and at exit, so a burst costs at most two lines a window. Only the message and its fields
+// are compared, not what the formatter or encoder puts around them, such as the time, so
+// the message is formatted once more on its own; nothing is allocated unless it is long.
+// The sink runs on the logging thread even with `.async`, and what it passes on is queued.
+// The state must stay alive until `log_sink_dedup_close`. Setting up a state that is still
+// open returns its sink and changes nothing.
+struct dedup_sink_state {
+    log_sink_t*      sink;
+    int              window_ms;     /* Default LOG_DEDUP_DEFAULT_WINDOW_MS */
+    log_formatter_fn formatter;     /* For the "repeated" records, default `default_formatter` */
+    log_encoder_fn   encoder;       /* Or this, when the sink gets encoded records */
+
+    int              lock;
+    uint64_t         hash;          /* Of the record passed on last */
+    log_record_t     last;          /* Its level, location, logger name and timestamp */
+    uint64_t         last_ns;       /* Timestamp of the last duplicate */
+    size_t           repeated;      /* Duplicates since */
+    size_t           suppressed;    /* Duplicates so far */
+    struct dedup_sink_state* next;
+};
+log_sink_t log_sink_dedup(struct dedup_sink_state* st);
+void log_sink_dedup_close(struct dedup_sink_state* st);
+
+#define LOG_DEDUP_DEFAULT_WINDOW_MS 1000
+
+// Writes records in blocks of up to `block_size` bytes, each behind a header with the block's
+// time range, a bitmap of its levels and bloom filters of its logger names and callsites
+// (file name and line), so `logger_query` skips the blocks that can't match without reading
+// them. `log_sink_indexed_close` appends all the headers as an index at the end of the file;
+// a file without one, e.g. after a crash, is read by walking from header to header instead.
+// Records are stored as `log_encode_binary` writes them, the message formatted on its own,
+// without the formatter's prefix. A block is also written by a record at or above
+// `flush_level` and by `log_flush`. `fd` should be an empty file. The state must stay alive
+// until `log_sink_indexed_close`; sinks still open at exit are flushed then. Setting up a
+// state that is still open returns its sink and changes nothing.
+struct indexed_sink_state {
+    int         fd;
+    size_t      block_size;         /* Default LOG_INDEXED_DEFAULT_BLOCK_SIZE */
+    log_level_t flush_level;        /* LOG_DEFAULT: no level based flushing */
+
+    char*       block;              /* Header and records; NULL once closed or if it couldn't be allocated */
+    size_t      used;               /* Bytes of records */
+    struct logger__index_block* index;  /* Copies of the headers written; NULL if it couldn't grow */
+    size_t      index_capacity;
+    uint64_t    offset;             /* Of the next block in the file */
+    int         lock;
+    size_t      records;            /* Records received so far */
+    size_t      blocks;             /* Blocks written so far */
+    size_t      dropped;            /* Records larger than a block */
+    struct indexed_sink_state* next;
+};
+log_sink_t log_sink_indexed(struct indexed_sink_state* st);
+void log_sink_indexed_close(struct indexed_sink_state* st);
+
+#define LOG_INDEXED_DEFAULT_BLOCK_SIZE  (64 * 1024)
+#define LOG_INDEXED_MAX_MESSAGE         4096    /* Longer messages are cut */
+
+// Writes records into a ring in POSIX shared memory, for many processes at once, e.g. the
+// workers of a pre-forking server, drained by `logger_collect`. Each record takes one slot
+// of `slot_size` bytes (longer text is cut), reserved with a compare-and-swap, so processes
+// never wait on each other or the collector; when the ring is full the record is dropped
+// instead. Every record carries the writer's pid, a sequence number and its timestamp. A
+// writer that dies halfway through a record only loses that record: the collector skips
+// the slot once the pid is gone, or after a timeout. A writer given up on while only slow
+// may still tear the record a lap later in the same slot; that record fails its checksum
+// and the collector drops it rather than print it garbled. With `create` the ring is
+// created or reset, e.g. in the parent before it forks; without, an existing ring is
+// opened. Remove it with `shm_unlink(name)` or `logger_collect -u`.
+struct shm_sink_state {
+    const char* name;               /* Shared memory object name, e.g. "/myapp.log" */
+    int         create;
+    size_t      slot_count;         /* Rounded up to a power of two. Default LOG_SHM_DEFAULT_SLOT_COUNT */
+    size_t      slot_size;          /* Default LOG_SHM_DEFAULT_SLOT_SIZE */
+
+    struct logger__shm_ring* ring;  /* The mapping; NULL once closed or if it couldn't be set up */
+    size_t      mapped_size;        /* Of the ring as it was found, which may be larger than asked for */
+    size_t      records;            /* Records written by this process */
+    size_t      dropped;            /* Records of this process lost because the ring was full */
+    size_t      truncated;          /* Records of this process cut to fit a slot */
+};
+log_sink_t log_sink_shm(struct shm_sink_state* st);
+void log_sink_shm_close(struct shm_sink_state* st);
+
+#define LOG_SHM_DEFAULT_SLOT_COUNT  (64 * 1024)
+#define LOG_SHM_DEFAULT_SLOT_SIZE   512
+
+// Lets readers run concurrently with a writer that swaps out the data they use; the
+// writer waits for the readers that might still see the old data before freeing it.
+struct logger__epoch {
+    unsigned epoch;
+    size_t   active[2];
+};
+
+// Appends records to memory mapped segment files "<path>.<n>" without any syscall on
+// the hot path: writers reserve space with an atomic add and copy the record in. A new
+// segment is started once the current one is full or `rotate_interval_s` has passed.
+// Segments are allocated up front with `posix_fallocate`, so a full disk fails the rotation
+// rather than a write, and cut to their real length when they are rotated out or on
+// `log_sink_mmap_file_close`. Sinks still open at exit are closed then, so the state must
+// not live on the stack of `main` unless it is closed before returning.
+struct mmap_sink_state {
+    const char* path;
+    size_t      segment_size;       /* Default LOG_MMAP_DEFAULT_SEGMENT_SIZE */
+    int         rotate_interval_s;  /* 0: rotate on size only */
+    int         retention;          /* Segments of this sink kept on disk, its older ones are deleted. 0: keep all */
+
+    struct logger__mmap_segment* current;
+    struct logger__epoch readers;
+    unsigned    next_index;
+    unsigned*   created;            /* Indices of the last `retention` segments this sink created */
+    size_t      created_count;      /* Segments created so far */
+    int         lock;
+    struct mmap_sink_state* next;
+};
+
+#define LOG_MMAP_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+
+// Returns a sink without `write` if the first segment can't be created. Setting up a state
+// that is still open returns its sink and changes nothing.
+log_sink_t log_sink_mmap_file(struct mmap_sink_state* st);
+void log_sink_mmap_file_close(struct mmap_sink_state* st);
+
+
+typedef enum log_async_overflow_t {
+    LOG_ASYNC_BLOCK,        /* Wait until the background thread has made room */
+    LOG_ASYNC_DROP_NEWEST,  /* Discard the record being logged */
+    LOG_ASYNC_DROP_OLDEST,  /* Discard the oldest queued record to make room */
+} log_async_overflow_t;
+
+#define LOG_ASYNC_DEFAULT_CAPACITY  1024
+#define LOG_ASYNC_MESSAGE_SIZE      1024
+
+#define LOG_RECORDER_DEFAULT_SIZE   1024    /* Statements kept per thread */
+#define LOG_RECORDER_SLOT_SIZE      256     /* Bytes per statement; longer strings are cut */
+
+#define LOG_SPAN_MAX_ARGS           4       /* Further arguments of a span are left out */
+
+
+typedef enum log_clock_t {
+    LOG_CLOCK_DEFAULT,      /* LOG_CLOCK_TSC when the CPU has an invariant TSC, otherwise LOG_CLOCK_COARSE */
+    LOG_CLOCK_TSC,          /* rdtsc scaled against CLOCK_REALTIME, a few ns per read */
+    LOG_CLOCK_REALTIME,     /* clock_gettime(CLOCK_REALTIME) on every record */
+    LOG_CLOCK_COARSE,       /* clock_gettime(CLOCK_REALTIME_COARSE), cheap but only advances every few ms */
+} log_clock_t;
 
 typedef struct log_init_args_t {
     int _sentinel;
@@ -171,12 +749,187 @@ typedef struct log_init_args_t {
     log_level_t level;
     log_sink_t* sinks[LOG_LEVEL_COUNT];
     int disable_asserts;
+    log_encoder_fn encoder;                 /* Encode whole records, e.g. `log_encode_json`, instead of using `formatter` */
+    int async;                              /* Hand records to a background thread instead of writing them inline */
+    size_t async_capacity;                  /* Queued records, rounded up to a power of two (default LOG_ASYNC_DEFAULT_CAPACITY) */
+    log_async_overflow_t async_overflow;    /* What to do when the queue is full (default LOG_ASYNC_BLOCK) */
+    int binary;                             /* Capture `trace()`...`panic()` as raw arguments instead of text */
+    int binary_fd;                          /* Where binary capture is written, decode it with `logger_decode` */
+    int binary_dedup_ms;                    /* Count repeats of a thread's last record within this window instead of storing them */
+    log_clock_t clock;                      /* Source of record timestamps */
+    size_t recorder;                        /* Keep the last N statements of every thread, whatever their level, for crash dumps */
+    int recorder_fd;                        /* Where crash dumps go (default stderr), opened up front */
+    size_t spans;                           /* Keep the last N spans of every thread, rounded up to a power of two, see `log_span` */
+    const log_route_t* routes;              /* See `log_routes`. Levels without a sink in `sinks` then get none */
+    size_t route_count;
 } log_init_args_t;
 
 #define log_init(...) log_init_from_args((log_init_args_t){ 0, __VA_ARGS__ })
 
+// Only the first call, or the first record when there is none, takes effect; any thread may
+// make it. Use `log_reconfigure` to change things later. When the first record initializes,
+// it keeps what `log_reconfigure` and `log_set_level` changed before it; `log_init` replaces it.
 void log_init_from_args(log_init_args_t args);
 
+typedef struct log_config_args_t {
+    int _sentinel;
+    log_formatter_fn formatter;
+    log_level_t level;
+    log_sink_t* sinks[LOG_LEVEL_COUNT];
+    log_encoder_fn encoder;
+    int reset;                              /* Start from what `log_init` set up instead of the current configuration */
+    const log_route_t* routes;              /* Replace the routes. Levels without a sink in `sinks` then get none */
+    size_t route_count;
+} log_config_args_t;
+
+// Replaces the global level, formatter, encoder, sinks and routes while other threads keep logging,
+// e.g. `log_reconfigure(.level = LOG_DEBUG, .sinks[LOG_INFO] = &file_sink)`. Anything left out
+// stays as it is, unless `.reset` is set. Every record sees either the old configuration or
+// the new one, never a mix. Sinks that are replaced may still get records already underway.
+// `with_log` scopes fill in what they don't set when they are pushed; their level stays the
+// one they were pushed with. Not async-signal-safe, see `log_set_level`.
+#define log_reconfigure(...) log_reconfigure_from_args((log_config_args_t){ 0, __VA_ARGS__ })
+
+void log_reconfigure_from_args(log_config_args_t args);
+
+// Sets the global level only. Async-signal-safe, so it can be bound to e.g. SIGUSR1.
+void log_set_level(log_level_t level);
+
+// Sets the state of every call site matching all of the given filters and returns how many
+// matched. `file` and `function` are `fnmatch` patterns (NULL matches anything) and a `line`
+// of 0 matches any line, e.g. `log_callsite_set("*/net/*.c", NULL, 0, LOG_CALLSITE_ON)`.
+// A `panic` switched off loses its record, but still terminates.
+size_t log_callsite_set(const char* file, const char* function, int line, log_callsite_state_t state);
+
+typedef void (*log_callsite_fn)(log_callsite_t* callsite, void* data);
+void log_callsite_foreach(log_callsite_fn fn, void* data);
+
+// Current time in nanoseconds since the Unix epoch, from the clock chosen by `log_init`.
+// It follows the system clock but can step back slightly when it is adjusted.
+uint64_t log_now(void);
+
+// The timestamp of the record being formatted on this thread, for use in formatters.
+uint64_t log_timestamp(void);
+
+// Writes `timestamp` as local time, "2024-05-01 13:37:00.123456". Returns the length like snprintf.
+int log_format_timestamp(char* buffer, int size, uint64_t timestamp);
+
+// Writes the statements the flight recorder holds for every thread to `fd`, oldest first.
+// Async-signal-safe. With the recorder on this also happens on `panic`, a failed `assert`
+// and SIGSEGV, SIGABRT or SIGBUS, followed by the backtrace of the thread that crashed.
+void log_recorder_dump(int fd);
+
+// Records the time from here to the end of the enclosing block as a span named `name`, a
+// string literal, for `log_spans_export`:
+//     { log_span("handle_request"); ... }
+//     log_span_args("query", log_span_arg("rows", rows), log_span_arg("shard", shard));
+// Arguments are numbers taken when the span begins; a call site always passes the same keys.
+// Nothing is formatted: a span costs two reads of the clock and a 64 byte store into the
+// thread's ring, kept only with `log_init(.spans = N)`, otherwise it costs a branch. A thread
+// that exits leaves its spans for the next export.
+typedef struct log_span_site_t {
+    const char*       name;
+    source_location_t location;
+    const char*       keys[LOG_SPAN_MAX_ARGS];      /* Filled in by the first span with arguments */
+} log_span_site_t;
+
+typedef struct log_span_arg_t {
+    const char* key;
+    double      value;
+} log_span_arg_t;
+
+typedef struct log_span_t {
+    log_span_site_t* site;          /* NULL: not kept */
+    uint64_t         start;         /* TSC ticks, or nanoseconds without the TSC clock */
+    unsigned         arg_count;
+    double           args[LOG_SPAN_MAX_ARGS];
+} log_span_t;
+
+extern int logger_spans_enabled;
+void logger_span_begin(log_span_t* span, log_span_site_t* site, const log_span_arg_t* args, size_t count);
+void logger_span_end(log_span_t* span);
+
+#if (defined(__has_attribute) && __has_attribute(cleanup)) || (defined(__GNUC__) && !defined(__clang__))
+static inline void logger__span_cleanup(log_span_t* span) {
+    if (span->site) logger_span_end(span);
+}
+#  define LOGGER__SPAN(name, args, count)                                                                  \
+    static log_span_site_t INTERNAL_CONCATENATE(_log_span_site_, __LINE__) = { name, { __FILE__, __func__, __LINE__ }, { 0 } }; \
+    __attribute__((cleanup(logger__span_cleanup))) log_span_t INTERNAL_CONCATENATE(_log_span_, __LINE__) = { NULL, 0, 0, { 0 } }; \
+    if (__builtin_expect(logger_spans_enabled, 0))                                                          \
+        logger_span_begin(&INTERNAL_CONCATENATE(_log_span_, __LINE__), &INTERNAL_CONCATENATE(_log_span_site_, __LINE__), args, count)
+#else
+#  define LOGGER__SPAN(name, args, count) ((void) 0)
+#endif
+
+#define log_span(name)                  LOGGER__SPAN(name, NULL, 0)
+#define log_span_args(name, ...)        LOGGER__SPAN(name, ((const log_span_arg_t[]) { __VA_ARGS__ }), sizeof((const log_span_arg_t[]) { __VA_ARGS__ }) / sizeof(log_span_arg_t))
+#define log_span_arg(key, value)        ((log_span_arg_t) { key, (double) (value) })
+
+// Writes the spans kept for every thread to `fd` in the Chrome trace event format (JSON), for
+// chrome://tracing or ui.perfetto.dev. Times count from when recording began, which is given
+// as "origin_ns" (nanoseconds since the epoch) in "otherData". Threads may go on recording
+// meanwhile; a span they overwrite during the export is left out.
+void log_spans_export(int fd);
+
+// Blocks until every record logged before the call has reached its sink.
+void log_flush(void);
+
+// Number of records discarded because the async queue was full.
+size_t log_async_dropped(void);
+
+
+#define LOG_STATS_BUCKETS   32      /* Bucket i counts durations in [2^i, 2^(i+1)) ns, the last one anything longer */
+#define LOG_STATS_MAX_SINKS 32      /* Sinks past this many are counted together, as "other" */
+#ifndef LOG_STATS_SAMPLE
+# define LOG_STATS_SAMPLE   16      /* Each thread times one in this many statements and sink writes */
+#endif
+
+typedef struct log_histogram_t {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[LOG_STATS_BUCKETS];
+} log_histogram_t;
+
+typedef struct log_level_stats_t {
+    uint64_t        emitted;        /* Statements that passed the level, binary capture included */
+    uint64_t        filtered;       /* Statements below the level or with their callsite off */
+    uint64_t        unrouted;       /* Emitted, but no sink took them */
+    uint64_t        truncated;      /* Messages cut at LOG_MESSAGE_MAX_SIZE */
+    log_histogram_t latency;        /* Time in the logger per sampled statement, formatting and sinks included */
+} log_level_stats_t;
+
+typedef struct log_sink_stats_t {
+    log_sink_write_fn write;        /* `sink->write`; sinks alike in all three share an entry */
+    const void*     data;           /* `sink->data`, it may be gone by now */
+    const char*     name;           /* `sink->name` */
+    uint64_t        records;
+    uint64_t        bytes;          /* Text written; LOG_SINK_RAW sinks get none */
+    log_histogram_t latency;        /* Time in `sink->write` per sampled write, on the async thread when there is one */
+} log_sink_stats_t;
+
+typedef struct log_stats_t {
+    log_level_stats_t levels[LOG_LEVEL_COUNT];
+    log_sink_stats_t  sinks[LOG_STATS_MAX_SINKS];
+    size_t            sink_count;
+    uint64_t          async_dropped;
+} log_stats_t;
+
+// Adds up the counters every thread keeps for itself, those of threads that have exited
+// included. Threads carry on logging meanwhile, so the totals are not from a single instant.
+void log_stats_snapshot(log_stats_t* stats);
+
+typedef enum log_stats_format_t {
+    LOG_STATS_PROMETHEUS,   /* Text exposition format, metrics prefixed with "logger_" */
+    LOG_STATS_JSON,
+} log_stats_format_t;
+
+// Writes `stats` out in `format`. Returns the length it needs like snprintf.
+int log_stats_format(char* buffer, int size, const log_stats_t* stats, log_stats_format_t format);
+
+// Takes a snapshot and writes it to `fd`.
+void log_stats_dump(int fd, log_stats_format_t format);
+
 #endif  // _LOGGER_H
 
 
@@ -187,266 +940,5432 @@ void log_init_from_args(log_init_args_t args);
 #include <stdlib.h>     // free, exit, EXIT_FAILURE
 #include <stdio.h>      // fprintf, stderr
 #include <execinfo.h>   // backtrace, backtrace_symbols
-#include <signal.h>     // signal, SIGTRAP
+#include <signal.h>     // sigaction, raise
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>     // uintptr_t
+#include <pthread.h>    // pthread_create, pthread_cond_t
+#include <sched.h>      // sched_yield
+#include <time.h>       // clock_gettime
+#include <sys/uio.h>    // writev
+#include <fnmatch.h>    // fnmatch
+#include <fcntl.h>      // open
+#include <sys/mman.h>   // mmap
+#include <sys/stat.h>   // fstat
+#include <sys/syscall.h> // SYS_gettid
+#if defined(__SSE2__)
+# include <emmintrin.h> // _mm_cmpeq_epi8
+#endif
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>   // io_uring_setup, io_uring_enter; no liburing needed
+#  define LOGGER__HAS_URING 1
+# endif
+#endif
+#ifndef LOGGER__HAS_URING
+# define LOGGER__HAS_URING 0
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>     // __get_cpuid
+# define LOGGER__HAS_TSC 1
+#else
+# define LOGGER__HAS_TSC 0
+#endif
 
 
-static void fd_sink_write(void* data, const struct log_record_t* rec) {
-    int fd = (int)(uintptr_t)data;
-    if (fd < 0) return;
+#define LOGGER_CACHE_LINE 64
 
-    // best-effort write, ignore errors for now
-    (void) write(fd, rec->message, rec->message_len);
-    (void) write(fd, "\n", 1);
+static inline void logger__spin_lock(int* lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
 }
 
-log_sink_t log_sink_from_fd(int fd) {
-    log_sink_t sink = {
-            .write = fd_sink_write,
-            .data = (void*) (uintptr_t) fd
-    };
-    return sink;
+static inline void logger__spin_unlock(int* lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
 }
 
-static void ring_sink_write(void* data, const struct log_record_t* record) {
-    struct log_record_t rec = *record;
-    struct ring_sink_state* st = data;
+static inline unsigned logger__epoch_enter(struct logger__epoch* e) {
+    for (;;) {
+        unsigned epoch = __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&e->active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch(&e->active[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
 
-    if (!st || !st->buffer || st->size == 0) return;
+static inline void logger__epoch_exit(struct logger__epoch* e, unsigned epoch) {
+    __atomic_sub_fetch(&e->active[epoch & 1], 1, __ATOMIC_RELEASE);
+}
 
-    size_t want = rec.message_len + 2; // + '\n' + '\0'
-    if (want > st->size) {
-        // Truncate: keep last size-1 chars
-        rec.message += want - (st->size - 1);
-        rec.message_len = st->size - 1;
-        want = st->size;
-    }
+// Returns once every reader that entered before the call has exited. Writers must be serialized.
+static void logger__epoch_synchronize(struct logger__epoch* e) {
+    unsigned epoch = __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&e->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&e->active[epoch & 1], __ATOMIC_ACQUIRE) != 0)
+        sched_yield();
+}
 
-    if (st->head + want > st->size) {
-        st->head = 0;
+// Best-effort; gives up on the first error. Returns the number of syscalls made.
+static size_t logger__writev_all(int fd, struct iovec* iov, int count) {
+    size_t calls = 0;
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        calls += 1;
+        if (n <= 0)
+            break;
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= (ssize_t) iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
     }
+    return calls;
+}
 
-    if (st->head > 0) {
-        st->head -= 1;  // Remove '\0' from previous message.
-    }
+static void logger__write_all(int fd, const char* data, size_t size) {
+    struct iovec iov = { (void*) data, size };
+    logger__writev_all(fd, &iov, 1);
+}
 
-    memcpy(st->buffer + st->head, rec.message, rec.message_len);
-    st->head += rec.message_len;
-    st->buffer[st->head++] = '\n';
-    st->buffer[st->head++] = '\0';
-    if (st->head >= st->size) {
-        st->head = 0;
+// Tells records apart, a word at a time. Not meant for input chosen to collide.
+static inline uint64_t logger__hash(const void* data, size_t n, uint64_t seed) {
+    const unsigned char* p = data;
+    uint64_t h = seed ^ (n * 0x9E3779B97F4A7C15ull);
+    uint64_t w;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ (w * 0xFF51AFD7ED558CCDull)) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 32;
+    }
+    if (n > 0) {
+        w = 0;
+        memcpy(&w, p, n);
+        h = (h ^ (w * 0xFF51AFD7ED558CCDull)) * 0x9E3779B97F4A7C15ull;
     }
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 33);
 }
 
-log_sink_t log_sink_ring_buffer(struct ring_sink_state* st) {
-    log_sink_t sink = {
-        .write = ring_sink_write,
-        .data  = st
-    };
-    return sink;
-}
+// ---- Clock ----
+// With LOG_CLOCK_TSC a timestamp is one rdtsc scaled onto an anchor taken from
+// CLOCK_REALTIME. The scale is measured over a millisecond when the clock is set up, and
+// about once a second whichever thread notices re-anchors it and refines the scale over
+// the elapsed second, so the TSC never drifts far from the system clock.
 
+__extension__ typedef unsigned __int128 logger__u128;
 
+static struct {
+    unsigned    sequence;       // Odd while the anchor is being replaced
+    int         lock;
+    log_clock_t source;         // LOG_CLOCK_DEFAULT until set up
+    uint64_t    tsc;
+    uint64_t    ns;
+    uint64_t    mult;           // Nanoseconds per tick as 32.32 fixed point
+    uint64_t    next_refresh;   // TSC value after which the anchor is replaced
+} logger__clock;
 
+static pthread_once_t logger__clock_once = PTHREAD_ONCE_INIT;
 
+static inline uint64_t logger__timespec_ns(struct timespec ts) {
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
 
-__attribute__((noinline, noreturn, cold))
-void terminate_with_backtrace(void) {
-    void* callstack[128] = { 0 };
-    int frames = backtrace(callstack, 128);
-    char** strs = backtrace_symbols(callstack, frames);
-    for (int i = 0; i < frames-1; ++i) {
-        fprintf(stderr, "%s\n", strs[i]);
-    }
-    free(strs);
-    abort();
+#if LOGGER__HAS_TSC
+static inline uint64_t logger__rdtsc(void) {
+    return __builtin_ia32_rdtsc();
 }
 
-// INVARIANT: log_current is never NULL. Do not assign to it directly.
-static struct log_ctx_t log_default = {
-        .name = "",
-        .level = LOG_DEFAULT,
-        .formatter = NULL,
-        .sinks = { 0 },
-        .parent = NULL,
-        .declaration_location = { 0 },
-};
-THREAD_LOCAL struct log_ctx_t* log_current = &log_default;
+static int logger__tsc_is_invariant(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (edx >> 8) & 1;
+}
 
+// Callers hold `logger__clock.lock`. The next refresh is due `refresh_ns` later.
+static void logger__clock_anchor(uint64_t mult, uint64_t refresh_ns) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t tsc = logger__rdtsc();
 
+    __atomic_store_n(&logger__clock.sequence, logger__clock.sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&logger__clock.tsc,  tsc,  __ATOMIC_RELAXED);
+    __atomic_store_n(&logger__clock.ns,   logger__timespec_ns(now), __ATOMIC_RELAXED);
+    __atomic_store_n(&logger__clock.mult, mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&logger__clock.next_refresh, tsc + (uint64_t) (((logger__u128) refresh_ns << 32) / mult), __ATOMIC_RELAXED);
+    __atomic_store_n(&logger__clock.sequence, logger__clock.sequence + 1, __ATOMIC_RELEASE);
+}
 
-void logger_push(struct log_ctx_t* log, source_location_t location) {
-    log->parent = log_current;
-    log->level  = (log->level == LOG_DEFAULT) ? get_global_log_level() : log->level;
+static int logger__tsc_calibrate(void) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    uint64_t tsc_start = logger__rdtsc();
+    uint64_t tsc_now, elapsed;
+    do {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        tsc_now = logger__rdtsc();
+        elapsed = logger__timespec_ns(now) - logger__timespec_ns(start);
+    } while (elapsed < 1000000);
 
-    log_current = log;
-    source_location_t loc = log->declaration_location;
-    trace_loc(location, "Pushed log declared at %s:%d", loc.file, loc.line);
+    if (tsc_now <= tsc_start)
+        return 0;
+    logger__spin_lock(&logger__clock.lock);
+    // Refreshed early the first time, a millisecond is too short to get the scale exact.
+    logger__clock_anchor((uint64_t) (((logger__u128) elapsed << 32) / (tsc_now - tsc_start)), 100000000ull);
+    logger__spin_unlock(&logger__clock.lock);
+    return 1;
 }
 
-void logger_pop(struct log_ctx_t* log, source_location_t location) {
-    if (log_current != log) {
-        panic_loc(location, "Cannot pop log!");
-    }
+__attribute__((noinline, cold))
+static void logger__clock_refresh(void) {
+    if (__atomic_exchange_n(&logger__clock.lock, 1, __ATOMIC_ACQUIRE))
+        return;     // Someone else is on it
 
-    source_location_t loc = log->declaration_location;
-    trace_loc(location, "Popped log declared at %s:%d", loc.file, loc.line);
+    uint64_t tsc  = __atomic_load_n(&logger__clock.tsc,  __ATOMIC_RELAXED);
+    uint64_t ns   = __atomic_load_n(&logger__clock.ns,   __ATOMIC_RELAXED);
+    uint64_t mult = __atomic_load_n(&logger__clock.mult, __ATOMIC_RELAXED);
 
-    log_current = log_current->parent;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t tsc_now = logger__rdtsc();
+    uint64_t ns_now  = logger__timespec_ns(now);
 
-    log->name = "";
-    log->level = LOG_DEFAULT;
-    log->parent = NULL;
-    log->declaration_location = no_source_location();
-}
+    // A step of the system clock shows up as a wildly different rate; keep the old one then.
+    if (tsc_now > tsc && ns_now > ns) {
+        uint64_t measured = (uint64_t) (((logger__u128) (ns_now - ns) << 32) / (tsc_now - tsc));
+        if (measured > mult - mult / 100 && measured < mult + mult / 100)
+            mult = measured;
+    }
+    logger__clock_anchor(mult, 1000000000ull);
 
-void logger_assert_log(const struct log_ctx_t* logger, source_location_t source_location, const char* condition, const char* message, ...) {
-    char buffer[1024];
-    int len = snprintf(buffer, sizeof buffer, "'%s' failed.", condition);
-    if (len < 0) len = 0;
-    if (len >= (int)sizeof buffer) len = (int)sizeof buffer - 1;
+    __atomic_store_n(&logger__clock.lock, 0, __ATOMIC_RELEASE);
+}
+#endif
 
-    if (message && message[0] != '\0') {
-        if (len < (int)sizeof(buffer)) {
-            buffer[len++] = ' ';
+static void logger__clock_setup(log_clock_t source) {
+#if LOGGER__HAS_TSC
+    if (source == LOG_CLOCK_DEFAULT || source == LOG_CLOCK_TSC) {
+        if (logger__tsc_is_invariant() && logger__tsc_calibrate()) {
+            __atomic_store_n(&logger__clock.source, LOG_CLOCK_TSC, __ATOMIC_RELEASE);
+            return;
         }
-        va_list args;
-        va_start(args, message);
-        vsnprintf(buffer + len, sizeof(buffer) - len, message, args);
-        va_end(args);
     }
-
-    logger_log(logger, LOG_PANIC, source_location, "%s", buffer);
+#endif
+    if (source == LOG_CLOCK_DEFAULT || source == LOG_CLOCK_TSC)
+        source = LOG_CLOCK_COARSE;
+    __atomic_store_n(&logger__clock.source, source, __ATOMIC_RELEASE);
 }
 
-
-static const char* LOG_LEVEL_NAMES[LOG_LEVEL_COUNT] = {
-        [LOG_DEFAULT] = "default",
-        [LOG_TRACE]   = "trace",
-        [LOG_DEBUG]   = "debug",
-        [LOG_INFO]    = "info",
-        [LOG_WARN]    = "warn",
-        [LOG_ERROR]   = "error",
-        [LOG_PANIC]   = "panic",
-};
-
-const char* log_level_name(log_level_t level) {
-    return LOG_LEVEL_NAMES[level];
+static void logger__clock_setup_default(void) {
+    if (__atomic_load_n(&logger__clock.source, __ATOMIC_ACQUIRE) == LOG_CLOCK_DEFAULT)
+        logger__clock_setup(LOG_CLOCK_DEFAULT);
 }
 
+static inline log_clock_t logger__clock_source(void) {
+    log_clock_t source = __atomic_load_n(&logger__clock.source, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(source == LOG_CLOCK_DEFAULT, 0)) {
+        pthread_once(&logger__clock_once, logger__clock_setup_default);
+        source = __atomic_load_n(&logger__clock.source, __ATOMIC_ACQUIRE);
+    }
+    return source;
+}
 
+static inline uint64_t logger__now(void) {
+    log_clock_t source = logger__clock_source();
 
-int default_formatter(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args) {
-    const char* file = source_location.file ? source_location.file : "?";
-    const char* name = logger->name ? logger->name : "";
-
-    int len = 0;
-    size -= 1;
+#if LOGGER__HAS_TSC
+    if (__builtin_expect(source == LOG_CLOCK_TSC, 1)) {
+        uint64_t tsc = logger__rdtsc();
+        for (;;) {
+            unsigned sequence = __atomic_load_n(&logger__clock.sequence, __ATOMIC_ACQUIRE);
+            uint64_t base     = __atomic_load_n(&logger__clock.tsc,  __ATOMIC_RELAXED);
+            uint64_t ns       = __atomic_load_n(&logger__clock.ns,   __ATOMIC_RELAXED);
+            uint64_t mult     = __atomic_load_n(&logger__clock.mult, __ATOMIC_RELAXED);
+            uint64_t refresh  = __atomic_load_n(&logger__clock.next_refresh, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if ((sequence & 1) || sequence != __atomic_load_n(&logger__clock.sequence, __ATOMIC_RELAXED))
+                continue;
 
-    if (*source_location.file) {
-        len += snprintf(buffer+len, size, "%s:%-3d ", file, source_location.line);
-        size -= len;
+            if (__builtin_expect(tsc >= refresh, 0))
+                logger__clock_refresh();
+            // Read before the anchor moved past it; clamp rather than wrap.
+            if (tsc <= base)
+                return ns;
+            return ns + (uint64_t) (((logger__u128) (tsc - base) * mult) >> 32);
+        }
     }
+#endif
 
-    if (*name) {
-        len += snprintf(buffer+len, size, "[%s:%s]: ", LOG_LEVEL_NAMES[level], name);
-        size -= len;
-    } else {
-        len += snprintf(buffer+len, size, "[%s]: ", LOG_LEVEL_NAMES[level]);
-        size -= len;
-    }
+    struct timespec now;
+    clock_gettime((source == LOG_CLOCK_COARSE) ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &now);
+    return logger__timespec_ns(now);
+}
 
-    len += vsnprintf(buffer + len, size, message, args);
-    return len;
+uint64_t log_now(void) {
+    return logger__now();
 }
 
+// ---- Stats ----
+// Every thread counts into a block of its own, so the counters are plain loads and stores
+// without any sharing; `log_stats_snapshot` adds the blocks up under the registry lock,
+// which threads only take when they start and stop counting. An exiting thread folds its
+// counts into `logger__stats_retired`. Reading the clock costs as much as a cheap record, so
+// only one in LOG_STATS_SAMPLE calls is timed; the TSC is used when it is the clock.
 
-logger_log_fn logger_log_internal = logger_log_init;
+#if LOG_STATS
+struct logger__stats {
+    log_stats_t           stats;
+    uint64_t*             filtered;     // The thread's `logger_stats_filtered`
+    unsigned              countdown[2]; // Statements, sink writes until the next one that is timed
+    struct logger__stats* prev;
+    struct logger__stats* next;
+} __attribute__((aligned(LOGGER_CACHE_LINE)));
 
-static int assert_is_enabled = 1;
-static log_formatter_fn global_log_formatter;
-static log_level_t global_log_level;
-static log_sink_t* global_sinks[LOG_LEVEL_COUNT];
+THREAD_LOCAL uint64_t logger_stats_filtered[LOG_LEVEL_COUNT];
 
-log_sink_t stdout_sink;
-log_sink_t stderr_sink;
+static pthread_mutex_t logger__stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct logger__stats* logger__stats_registry = NULL;
+static log_stats_t logger__stats_retired;
+static pthread_key_t logger__stats_key;
+static pthread_once_t logger__stats_once = PTHREAD_ONCE_INIT;
+static THREAD_LOCAL struct logger__stats* logger__stats_thread;
 
-int logger_assert_is_enabled(void) {
-    return assert_is_enabled;
+static inline void logger__stats_add(uint64_t* counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
 }
 
-static inline log_level_t       get_global_log_level(void)              { return global_log_level; }
-static inline log_formatter_fn  get_global_log_formatter(void)          { return global_log_formatter; }
-static inline log_sink_t*       get_global_sink(log_level_t level)      { return global_sinks[level]; }
+static inline void logger__histogram_add(log_histogram_t* h, uint64_t ns) {
+    unsigned bucket = 63u - (unsigned) __builtin_clzll(ns | 1);
+    if (bucket >= LOG_STATS_BUCKETS)
+        bucket = LOG_STATS_BUCKETS - 1;
+    logger__stats_add(&h->count, 1);
+    logger__stats_add(&h->sum_ns, ns);
+    logger__stats_add(&h->buckets[bucket], 1);
+}
 
+static void logger__histogram_merge(log_histogram_t* into, const log_histogram_t* from) {
+    into->count  += __atomic_load_n(&from->count,  __ATOMIC_RELAXED);
+    into->sum_ns += __atomic_load_n(&from->sum_ns, __ATOMIC_RELAXED);
+    for (int i = 0; i < LOG_STATS_BUCKETS; ++i)
+        into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+}
 
-void log_init_from_args(log_init_args_t args) {
-    static int initialized = 0;
-    if (initialized) {
+// The entry of the sink writing with `write` to `data` in `stats`, added if need be. Keyed by
+// what the sink writes to rather than the `log_sink_t`, which is often a copy on the stack.
+// Past LOG_STATS_MAX_SINKS - 1 sinks the last entry, "other", takes the rest.
+static log_sink_stats_t* logger__stats_sink_entry(log_stats_t* stats, log_sink_write_fn write, const void* data, const char* name) {
+    size_t count = __atomic_load_n(&stats->sink_count, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < count; ++i) {
+        log_sink_stats_t* entry = &stats->sinks[i];
+        if (entry->write == write && entry->data == data
+            && (entry->name == name || (entry->name && name && strcmp(entry->name, name) == 0)))
+            return entry;
+    }
+
+    log_sink_stats_t* entry = &stats->sinks[count];
+    if (count == LOG_STATS_MAX_SINKS - 1) {
+        write = NULL;
+        data = NULL;
+        name = "other";
+    } else if (count == LOG_STATS_MAX_SINKS) {
+        return &stats->sinks[count - 1];
+    }
+    entry->write = write;
+    entry->data = data;
+    entry->name = name;
+    __atomic_store_n(&stats->sink_count, count + 1, __ATOMIC_RELEASE);
+    return entry;
+}
+
+// Adds the counts of `from`, which may still be counting, to `into`. Must hold `logger__stats_lock`.
+static void logger__stats_merge(log_stats_t* into, const log_stats_t* from, const uint64_t* filtered) {
+    for (int level = 0; level < LOG_LEVEL_COUNT; ++level) {
+        log_level_stats_t* to = &into->levels[level];
+        const log_level_stats_t* add = &from->levels[level];
+        to->emitted   += __atomic_load_n(&add->emitted,   __ATOMIC_RELAXED);
+        to->filtered  += __atomic_load_n(&add->filtered,  __ATOMIC_RELAXED);
+        to->unrouted  += __atomic_load_n(&add->unrouted,  __ATOMIC_RELAXED);
+        to->truncated += __atomic_load_n(&add->truncated, __ATOMIC_RELAXED);
+        if (filtered)
+            to->filtered += __atomic_load_n(&filtered[level], __ATOMIC_RELAXED);
+        logger__histogram_merge(&to->latency, &add->latency);
+    }
+
+    size_t count = __atomic_load_n(&from->sink_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; ++i) {
+        const log_sink_stats_t* add = &from->sinks[i];
+        log_sink_stats_t* to = logger__stats_sink_entry(into, add->write, add->data, add->name);
+        to->records += __atomic_load_n(&add->records, __ATOMIC_RELAXED);
+        to->bytes   += __atomic_load_n(&add->bytes,   __ATOMIC_RELAXED);
+        logger__histogram_merge(&to->latency, &add->latency);
+    }
+}
+
+static void logger__stats_thread_exit(void* data) {
+    struct logger__stats* local = data;
+    pthread_mutex_lock(&logger__stats_lock);
+    logger__stats_merge(&logger__stats_retired, &local->stats, local->filtered);
+    if (local->prev)
+        local->prev->next = local->next;
+    else
+        logger__stats_registry = local->next;
+    if (local->next)
+        local->next->prev = local->prev;
+    memset(logger_stats_filtered, 0, sizeof(logger_stats_filtered));
+    logger__stats_thread = NULL;
+    pthread_mutex_unlock(&logger__stats_lock);
+    free(local);
+}
+
+static void logger__stats_key_create(void) {
+    pthread_key_create(&logger__stats_key, logger__stats_thread_exit);
+}
+
+__attribute__((noinline, cold))
+static struct logger__stats* logger__stats_register(void) {
+    pthread_once(&logger__stats_once, logger__stats_key_create);
+    struct logger__stats* local;
+    if (posix_memalign((void**) &local, LOGGER_CACHE_LINE, sizeof(*local)) != 0)
+        return NULL;
+    memset(local, 0, sizeof(*local));
+    local->filtered = logger_stats_filtered;
+    local->countdown[0] = 1;
+    local->countdown[1] = 1;
+
+    pthread_mutex_lock(&logger__stats_lock);
+    local->next = logger__stats_registry;
+    if (local->next)
+        local->next->prev = local;
+    logger__stats_registry = local;
+    logger__stats_thread = local;
+    pthread_mutex_unlock(&logger__stats_lock);
+    pthread_setspecific(logger__stats_key, local);
+    return local;
+}
+
+// This thread's block, NULL if it couldn't be allocated.
+static inline struct logger__stats* logger__stats_local(void) {
+    struct logger__stats* local = logger__stats_thread;
+    return __builtin_expect(local != NULL, 1) ? local : logger__stats_register();
+}
+
+void logger_stats_attach(void) {
+    logger__stats_local();
+}
+
+static inline uint64_t logger__stats_ticks(void) {
+#if LOGGER__HAS_TSC
+    if (__builtin_expect(logger__clock_source() == LOG_CLOCK_TSC, 1))
+        return logger__rdtsc();
+#endif
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return logger__timespec_ns(now);
+}
+
+// The time to measure a statement (0) or a sink write (1) from, or 0 when it isn't sampled.
+static inline uint64_t logger__stats_start(int kind) {
+    struct logger__stats* local = logger__stats_local();
+    if (!local || __builtin_expect(--local->countdown[kind] != 0, 1))
+        return 0;
+    local->countdown[kind] = LOG_STATS_SAMPLE;
+    return logger__stats_ticks();
+}
+
+static inline uint64_t logger__stats_elapsed_ns(uint64_t start) {
+    uint64_t ticks = logger__stats_ticks() - start;
+#if LOGGER__HAS_TSC
+    if (__builtin_expect(logger__clock_source() == LOG_CLOCK_TSC, 1))
+        return (uint64_t) (((logger__u128) ticks * __atomic_load_n(&logger__clock.mult, __ATOMIC_RELAXED)) >> 32);
+#endif
+    return ticks;
+}
+
+static inline void logger__stats_count_emitted(log_level_t level) {
+    struct logger__stats* local = logger__stats_local();
+    if (local)
+        logger__stats_add(&local->stats.levels[level].emitted, 1);
+}
+
+// Counts a statement that went through the logger, which it entered at `start` if it was sampled.
+static inline void logger__stats_count_logged(log_level_t level, uint64_t start, int unrouted) {
+    struct logger__stats* local = logger__stats_local();
+    if (!local)
+        return;
+    log_level_stats_t* stats = &local->stats.levels[level];
+    logger__stats_add(&stats->emitted, 1);
+    if (unrouted)
+        logger__stats_add(&stats->unrouted, 1);
+    if (start)
+        logger__histogram_add(&stats->latency, logger__stats_elapsed_ns(start));
+}
+
+static inline void logger__stats_count_truncated(log_level_t level) {
+    struct logger__stats* local = logger__stats_local();
+    if (local)
+        logger__stats_add(&local->stats.levels[level].truncated, 1);
+}
+
+// Calls the sink, counting the record, its text and the time the sink took.
+static inline void logger__sink_write(log_sink_t* sink, const log_record_t* record) {
+    struct logger__stats* local = logger__stats_local();
+    if (!local) {
+        sink->write(sink->data, record);
+        return;
+    }
+    uint64_t start = logger__stats_start(1);
+    sink->write(sink->data, record);
+
+    log_sink_stats_t* entry = logger__stats_sink_entry(&local->stats, sink->write, sink->data, sink->name);
+    logger__stats_add(&entry->records, 1);
+    logger__stats_add(&entry->bytes, record->message ? record->message_len : 0);
+    if (start)
+        logger__histogram_add(&entry->latency, logger__stats_elapsed_ns(start));
+}
+
+void log_stats_snapshot(log_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&logger__stats_lock);
+    logger__stats_merge(stats, &logger__stats_retired, NULL);
+    for (struct logger__stats* local = logger__stats_registry; local; local = local->next)
+        logger__stats_merge(stats, &local->stats, local->filtered);
+    pthread_mutex_unlock(&logger__stats_lock);
+    stats->async_dropped = log_async_dropped();
+}
+#else
+static inline uint64_t logger__stats_start(int kind)                    { (void) kind; return 0; }
+static inline void logger__stats_count_emitted(log_level_t level)       { (void) level; }
+static inline void logger__stats_count_logged(log_level_t level, uint64_t start, int unrouted) { (void) level; (void) start; (void) unrouted; }
+static inline void logger__stats_count_truncated(log_level_t level)     { (void) level; }
+
+static inline void logger__sink_write(log_sink_t* sink, const log_record_t* record) {
+    sink->write(sink->data, record);
+}
+
+void log_stats_snapshot(log_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->async_dropped = log_async_dropped();
+}
+#endif
+
+
+
+static void fd_sink_write(void* data, const struct log_record_t* rec) {
+    int fd = (int)(uintptr_t)data;
+    if (fd < 0) return;
+
+    // One syscall per record, so lines from different threads don't interleave.
+    struct iovec iov[2] = {
+        { (void*) rec->message, rec->message_len },
+        { (void*) "\n", 1 },
+    };
+    logger__writev_all(fd, iov, 2);
+}
+
+log_sink_t log_sink_from_fd(int fd) {
+    log_sink_t sink = {
+            .write = fd_sink_write,
+            .data = (void*) (uintptr_t) fd
+    };
+    return sink;
+}
+
+
+// ---- Sink registries ----
+static void logger__exit_hook(void);
+
+// The sinks `log_flush` and the exit hook reach are kept on one intrusive list per kind,
+// linked through the states' `next` and guarded by the list's own mutex. This defines the
+// list with its `_add`, `_contains` and `_remove`. Adding a state that is on the list
+// already does nothing, as pushing it again would loop the list.
+#define LOGGER__REGISTRY(type, name)                                            \
+    static pthread_mutex_t name##_lock = PTHREAD_MUTEX_INITIALIZER;             \
+    static type* name = NULL;                                                   \
+                                                                                \
+    /* Must hold the list's lock. */                                            \
+    static type** name##_find(type* st) {                                      \
+        type** link = &name;                                                    \
+        while (*link && *link != st)                                            \
+            link = &(*link)->next;                                              \
+        return link;                                                            \
+    }                                                                           \
+                                                                                \
+    __attribute__((unused))                                                     \
+    static int name##_contains(type* st) {                                     \
+        pthread_mutex_lock(&name##_lock);                                       \
+        int found = *name##_find(st) != NULL;                                   \
+        pthread_mutex_unlock(&name##_lock);                                     \
+        return found;                                                           \
+    }                                                                           \
+                                                                                \
+    static void name##_add(type* st) {                                         \
+        pthread_mutex_lock(&name##_lock);                                       \
+        if (!*name##_find(st)) {                                                \
+            st->next = name;                                                    \
+            name = st;                                                          \
+        }                                                                       \
+        pthread_mutex_unlock(&name##_lock);                                     \
+        logger__exit_hook();                                                    \
+    }                                                                           \
+                                                                                \
+    static int name##_remove(type* st) {                                       \
+        pthread_mutex_lock(&name##_lock);                                       \
+        type** link = name##_find(st);                                          \
+        int found = *link != NULL;                                              \
+        if (found)                                                              \
+            *link = st->next;                                                   \
+        pthread_mutex_unlock(&name##_lock);                                     \
+        return found;                                                           \
+    }
+
+
+LOGGER__REGISTRY(struct buffered_sink_state, logger__buffered_sinks)
+
+static long long logger__coarse_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Must hold the sink's lock.
+static void logger__buffered_sink_write_out(struct buffered_sink_state* st, const char* extra, size_t extra_len) {
+    struct iovec iov[3] = {
+        { st->buffer, st->used },
+        { (void*) extra, extra_len },
+        { (void*) "\n", extra ? 1 : 0 },
+    };
+    if (st->used + iov[2].iov_len + extra_len > 0)
+        st->syscalls += logger__writev_all(st->fd, iov, 3);
+    st->used = 0;
+    st->last_flush_ms = logger__coarse_ms();
+}
+
+static void buffered_sink_write(void* data, const struct log_record_t* record) {
+    struct buffered_sink_state* st = data;
+    size_t need = record->message_len + 1;
+
+    logger__spin_lock(&st->lock);
+    st->records += 1;
+
+    if (st->used + need > st->size) {
+        // Whatever is buffered goes out together with this record.
+        logger__buffered_sink_write_out(st, record->message, record->message_len);
+    } else {
+        memcpy(st->buffer + st->used, record->message, record->message_len);
+        st->used += record->message_len;
+        st->buffer[st->used++] = '\n';
+
+        int flush = st->flush_level != LOG_DEFAULT && record->level >= st->flush_level;
+        if (!flush && st->flush_interval_ms > 0)
+            flush = logger__coarse_ms() - st->last_flush_ms >= st->flush_interval_ms;
+        if (flush)
+            logger__buffered_sink_write_out(st, NULL, 0);
+    }
+
+    logger__spin_unlock(&st->lock);
+}
+
+static void logger__buffered_sinks_flush(void) {
+    pthread_mutex_lock(&logger__buffered_sinks_lock);
+    for (struct buffered_sink_state* st = logger__buffered_sinks; st; st = st->next) {
+        logger__spin_lock(&st->lock);
+        logger__buffered_sink_write_out(st, NULL, 0);
+        logger__spin_unlock(&st->lock);
+    }
+    pthread_mutex_unlock(&logger__buffered_sinks_lock);
+}
+
+// Writes out the records of a burst once its sink's interval has passed, as no later record
+// may come to do it. Sleeps until the earliest such deadline, or a second while none is due.
+static pthread_once_t logger__buffered_flusher_once = PTHREAD_ONCE_INIT;
+
+static void* logger__buffered_flusher_main(void* arg) {
+    (void) arg;
+    for (;;) {
+        long long now = logger__coarse_ms();
+        long long wait_ms = 1000;
+
+        pthread_mutex_lock(&logger__buffered_sinks_lock);
+        for (struct buffered_sink_state* st = logger__buffered_sinks; st; st = st->next) {
+            if (st->flush_interval_ms <= 0)
+                continue;
+            logger__spin_lock(&st->lock);
+            long long due = st->last_flush_ms + st->flush_interval_ms;
+            if (now >= due) {
+                // An empty buffer is left alone: its next record is written right away.
+                if (st->used > 0)
+                    logger__buffered_sink_write_out(st, NULL, 0);
+                due = now + st->flush_interval_ms;
+            }
+            logger__spin_unlock(&st->lock);
+            if (due - now < wait_ms)
+                wait_ms = due - now;
+        }
+        pthread_mutex_unlock(&logger__buffered_sinks_lock);
+
+        struct timespec wait = { wait_ms / 1000, (wait_ms % 1000) * 1000000 };
+        nanosleep(&wait, NULL);
+    }
+    return NULL;
+}
+
+static void logger__buffered_flusher_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, logger__buffered_flusher_main, NULL) == 0)
+        pthread_detach(thread);
+}
+
+log_sink_t log_sink_buffered_fd(struct buffered_sink_state* st) {
+    log_sink_t sink = {
+        .write = buffered_sink_write,
+        .data  = st
+    };
+    // Starting over would drop what is buffered.
+    if (logger__buffered_sinks_contains(st))
+        return sink;
+
+    st->used = 0;
+    st->lock = 0;
+    st->syscalls = 0;
+    st->records = 0;
+    st->last_flush_ms = logger__coarse_ms();
+
+    logger__buffered_sinks_add(st);
+    if (st->flush_interval_ms > 0)
+        pthread_once(&logger__buffered_flusher_once, logger__buffered_flusher_start);
+    return sink;
+}
+
+void log_sink_buffered_fd_close(struct buffered_sink_state* st) {
+    logger__buffered_sinks_remove(st);
+
+    logger__spin_lock(&st->lock);
+    logger__buffered_sink_write_out(st, NULL, 0);
+    logger__spin_unlock(&st->lock);
+}
+
+// Each slot starts with a header. `state` is 0 while the slot has never been written,
+// 2*seq + 1 while record `seq` is being copied in and 2*seq + 2 once it is complete.
+// Readers copy a slot and keep it only if `state` was complete and unchanged around the copy.
+struct logger__ring_slot {
+    size_t state;
+    size_t len;
+    char   data[];
+};
+
+static inline struct logger__ring_slot* logger__ring_slot(struct ring_sink_state* st, size_t seq) {
+    return (struct logger__ring_slot*) (st->slots + (seq % st->slot_count) * st->slot_size);
+}
+
+static void ring_sink_write(void* data, const struct log_record_t* record) {
+    struct ring_sink_state* st = data;
+    if (!st || st->slot_count == 0) return;
+
+    size_t seq = __atomic_fetch_add(&st->head, 1, __ATOMIC_RELAXED);
+    struct logger__ring_slot* slot = logger__ring_slot(st, seq);
+
+    // Claim the slot unless a writer that lapped us got there first; it holds newer data.
+    size_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+    do {
+        if ((state & 1) || state >= 2 * seq + 2)
+            return;
+    } while (!__atomic_compare_exchange_n(&slot->state, &state, 2 * seq + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    size_t capacity = st->slot_size - sizeof(struct logger__ring_slot);
+    size_t len = (record->message_len < capacity) ? record->message_len : capacity;
+    memcpy(slot->data, record->message, len);
+    __atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->state, 2 * seq + 2, __ATOMIC_RELEASE);
+}
+
+size_t log_sink_ring_buffer_read(struct ring_sink_state* st, size_t count, log_ring_record_fn fn, void* data) {
+    if (!st || st->slot_count == 0) return 0;
+
+    size_t head = __atomic_load_n(&st->head, __ATOMIC_ACQUIRE);
+    size_t kept = (head < st->slot_count) ? head : st->slot_count;
+    if (count == 0 || count > kept)
+        count = kept;
+
+    char* copy = malloc(st->slot_size);
+    if (!copy) return 0;
+
+    size_t calls = 0;
+    for (size_t seq = head - count; seq < head; ++seq) {
+        struct logger__ring_slot* slot = logger__ring_slot(st, seq);
+        size_t before = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (before != 2 * seq + 2)
+            continue;
+
+        size_t len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+        memcpy(copy, slot->data, len);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) != before)
+            continue;
+
+        fn(seq, copy, len, data);
+        calls += 1;
+    }
+
+    free(copy);
+    return calls;
+}
+
+log_sink_t log_sink_ring_buffer(struct ring_sink_state* st) {
+    size_t align = sizeof(size_t);
+    size_t slot_size = st->slot_size ? st->slot_size : LOG_RING_DEFAULT_SLOT_SIZE;
+    slot_size = (slot_size + align - 1) / align * align;
+    if (slot_size <= sizeof(struct logger__ring_slot))
+        slot_size = sizeof(struct logger__ring_slot) + align;
+
+    size_t skip = (align - (uintptr_t) st->buffer % align) % align;
+    st->slot_size  = slot_size;
+    st->slots      = st->buffer + skip;
+    st->slot_count = (st->buffer && st->size > skip) ? (st->size - skip) / slot_size : 0;
+    st->head       = 0;
+    if (st->slot_count)
+        memset(st->slots, 0, st->slot_count * slot_size);
+
+    log_sink_t sink = {
+        .write = ring_sink_write,
+        .data  = st
+    };
+    return sink;
+}
+
+
+
+
+// ---- Memory mapped file sink ----
+
+struct logger__mmap_segment {
+    char*    base;
+    size_t   size;
+    size_t   reserved;      // Bytes handed out; may overshoot `size` once the segment is full.
+    size_t   committed;     // Bytes copied in. Reservations that fit form a prefix, so this is the final length.
+    unsigned index;
+    int      fd;
+    long long opened_s;
+};
+
+LOGGER__REGISTRY(struct mmap_sink_state, logger__mmap_sinks)
+
+static long long logger__coarse_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long) now.tv_sec;
+}
+
+static void logger__mmap_segment_path(char* out, size_t size, const char* path, unsigned index) {
+    snprintf(out, size, "%s.%u", path, index);
+}
+
+// Must hold the sink's lock.
+static struct logger__mmap_segment* logger__mmap_segment_open(struct mmap_sink_state* st) {
+    char path[4096];
+    int fd = -1;
+    unsigned index = st->next_index;
+
+    // Never clobber segments left behind by an earlier run.
+    for (int attempts = 0; fd < 0 && attempts < 100000; ++attempts, ++index) {
+        logger__mmap_segment_path(path, sizeof(path), st->path, index);
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0 && errno != EEXIST)
+            break;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "logger: cannot create log segment '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    // Unlike `ftruncate`, which leaves a hole, a full disk fails here rather than as SIGBUS in a write.
+    struct logger__mmap_segment* seg = calloc(1, sizeof(*seg));
+    int error = seg ? posix_fallocate(fd, 0, (off_t) st->segment_size) : ENOMEM;
+    if (error != 0) {
+        fprintf(stderr, "logger: cannot allocate log segment '%s': %s\n", path, strerror(error));
+        free(seg);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    seg->base = mmap(NULL, st->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (seg->base == MAP_FAILED) {
+        fprintf(stderr, "logger: cannot map log segment '%s': %s\n", path, strerror(errno));
+        free(seg);
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    seg->size     = st->segment_size;
+    seg->index    = index - 1;
+    seg->fd       = fd;
+    seg->opened_s = logger__coarse_seconds();
+    st->next_index = index;
+
+    // Only segments this sink created are deleted, whatever indices were skipped in between.
+    if (st->created) {
+        unsigned* oldest = &st->created[st->created_count % (size_t) st->retention];
+        if (st->created_count >= (size_t) st->retention) {
+            logger__mmap_segment_path(path, sizeof(path), st->path, *oldest);
+            unlink(path);
+        }
+        *oldest = seg->index;
+        st->created_count += 1;
+    }
+    return seg;
+}
+
+// Only call once no writer can reach the segment any more.
+static void logger__mmap_segment_close(struct logger__mmap_segment* seg) {
+    size_t length = __atomic_load_n(&seg->committed, __ATOMIC_ACQUIRE);
+    munmap(seg->base, seg->size);
+    if (ftruncate(seg->fd, (off_t) length) != 0)
+        fprintf(stderr, "logger: cannot truncate log segment %u: %s\n", seg->index, strerror(errno));
+    close(seg->fd);
+    free(seg);
+}
+
+static void logger__mmap_rotate(struct mmap_sink_state* st, unsigned full_index) {
+    logger__spin_lock(&st->lock);
+    struct logger__mmap_segment* old = st->current;
+    if (old && old->index == full_index) {
+        struct logger__mmap_segment* seg = logger__mmap_segment_open(st);
+        // If the next segment can't be created, keep appending to nothing rather than failing every write.
+        __atomic_store_n(&st->current, seg, __ATOMIC_SEQ_CST);
+        logger__epoch_synchronize(&st->readers);
+        logger__mmap_segment_close(old);
+    }
+    logger__spin_unlock(&st->lock);
+}
+
+static void mmap_sink_write(void* data, const struct log_record_t* record) {
+    struct mmap_sink_state* st = data;
+    size_t len = record->message_len;
+    if (len + 1 > st->segment_size)
+        len = st->segment_size - 1;
+    size_t need = len + 1;
+
+    for (;;) {
+        unsigned epoch = logger__epoch_enter(&st->readers);
+        struct logger__mmap_segment* seg = __atomic_load_n(&st->current, __ATOMIC_SEQ_CST);
+        if (!seg) {
+            logger__epoch_exit(&st->readers, epoch);
+            return;
+        }
+
+        unsigned index = seg->index;
+        if (st->rotate_interval_s > 0 && logger__coarse_seconds() - seg->opened_s >= st->rotate_interval_s) {
+            logger__epoch_exit(&st->readers, epoch);
+            logger__mmap_rotate(st, index);
+            continue;
+        }
+
+        size_t offset = __atomic_fetch_add(&seg->reserved, need, __ATOMIC_RELAXED);
+        if (offset + need <= seg->size) {
+            memcpy(seg->base + offset, record->message, len);
+            seg->base[offset + len] = '\n';
+            __atomic_add_fetch(&seg->committed, need, __ATOMIC_RELEASE);
+            logger__epoch_exit(&st->readers, epoch);
+            return;
+        }
+
+        logger__epoch_exit(&st->readers, epoch);
+        logger__mmap_rotate(st, index);
+    }
+}
+
+static void logger__mmap_sinks_close(void) {
+    while (logger__mmap_sinks)
+        log_sink_mmap_file_close(logger__mmap_sinks);
+}
+
+log_sink_t log_sink_mmap_file(struct mmap_sink_state* st) {
+    log_sink_t sink = { .write = NULL, .data = st };
+
+    // Starting over would leak the segment being written.
+    if (logger__mmap_sinks_contains(st)) {
+        sink.write = mmap_sink_write;
+        return sink;
+    }
+
+    if (st->segment_size == 0)
+        st->segment_size = LOG_MMAP_DEFAULT_SEGMENT_SIZE;
+    st->lock = 0;
+    st->next_index = 0;
+    st->readers = (struct logger__epoch) { 0, { 0, 0 } };
+    st->created = NULL;
+    st->created_count = 0;
+    if (st->retention > 0 && (st->created = calloc((size_t) st->retention, sizeof(*st->created))) == NULL)
+        return sink;
+
+    st->current = logger__mmap_segment_open(st);
+    if (!st->current) {
+        free(st->created);
+        st->created = NULL;
+        return sink;
+    }
+
+    logger__mmap_sinks_add(st);
+
+    sink.write = mmap_sink_write;
+    return sink;
+}
+
+void log_sink_mmap_file_close(struct mmap_sink_state* st) {
+    if (!logger__mmap_sinks_remove(st))
+        return;
+
+    logger__spin_lock(&st->lock);
+    struct logger__mmap_segment* seg = st->current;
+    __atomic_store_n(&st->current, NULL, __ATOMIC_SEQ_CST);
+    logger__epoch_synchronize(&st->readers);
+    if (seg)
+        logger__mmap_segment_close(seg);
+    free(st->created);
+    st->created = NULL;
+    logger__spin_unlock(&st->lock);
+}
+
+
+
+// ---- io_uring sink ----
+// The rings are set up with the raw syscalls. Everything happens under the sink's lock, so
+// the submission ring has a single producer and the completion ring a single consumer; the
+// only ordering that matters is against the kernel's side of the rings.
+
+struct logger__uring_buffer {
+    char*    data;
+    size_t   used;          // Bytes filled, then the length of the write
+    size_t   done;          // Bytes the kernel has written so far, after short writes
+    uint64_t offset;        // File offset of `data[0]`
+};
+
+struct logger__uring {
+    int       ring_fd;      // -1: plain writes of buffer 0
+    unsigned  sqe_flags;    // IOSQE_IO_DRAIN for O_APPEND files, which ignore the offsets
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void*     sqes;
+    void*     cqes;
+    void*     sq_map;
+    size_t    sq_map_size;
+    void*     cq_map;       // `sq_map` too when the kernel maps both rings at once
+    size_t    cq_map_size;
+    size_t    sqes_size;
+
+    unsigned  pending;      // In the submission ring, not yet submitted
+    unsigned  in_flight;    // Submitted, not yet completed
+    uint64_t  offset;       // Where the next buffer goes in the file
+    unsigned  count;
+    unsigned  current;      // Buffer being filled, `count` if none
+    unsigned  free_count;
+    unsigned* free_list;
+    struct logger__uring_buffer* buffers;
+    char*     memory;
+};
+
+LOGGER__REGISTRY(struct uring_sink_state, logger__uring_sinks)
+
+// The kernel cancels the writes a thread submitted that are still queued when it exits,
+// so a thread that submitted any waits for the sinks to drain on its way out.
+static pthread_key_t logger__uring_thread_key;
+static pthread_once_t logger__uring_thread_once = PTHREAD_ONCE_INIT;
+static THREAD_LOCAL int logger__uring_thread_submitted;
+
+static void logger__uring_sinks_flush(void);
+
+static void logger__uring_thread_exit(void* data) {
+    (void) data;
+    logger__uring_sinks_flush();
+}
+
+static void logger__uring_thread_key_create(void) {
+    pthread_key_create(&logger__uring_thread_key, logger__uring_thread_exit);
+}
+
+#if LOGGER__HAS_URING
+// IORING_OP_WRITE came with the probe in Linux 5.6. The rings of 5.1 to 5.5 fail every write
+// with -EINVAL, and a probe that fails tells those apart.
+static int logger__uring_can_write(int fd) {
+    unsigned ops = IORING_OP_WRITE + 1;
+    struct io_uring_probe* probe = calloc(1, sizeof(*probe) + ops * sizeof(probe->ops[0]));
+    if (!probe)
+        return 0;
+    int can = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, ops) == 0
+           && probe->ops_len > IORING_OP_WRITE
+           && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return can;
+}
+
+static int logger__uring_setup(struct logger__uring* u, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return -1;
+    if (!logger__uring_can_write(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    u->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (single && u->cq_map_size > u->sq_map_size)
+        u->sq_map_size = u->cq_map_size;
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_map = single ? u->sq_map : mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->sqes   = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->sqes != MAP_FAILED)
+            munmap(u->sqes, u->sqes_size);
+        if (!single && u->cq_map != MAP_FAILED)
+            munmap(u->cq_map, u->cq_map_size);
+        if (u->sq_map != MAP_FAILED)
+            munmap(u->sq_map, u->sq_map_size);
+        close(fd);
+        return -1;
+    }
+
+    char* sq = u->sq_map;
+    char* cq = u->cq_map;
+    u->sq_tail  = (unsigned*) (sq + params.sq_off.tail);
+    u->sq_mask  = (unsigned*) (sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (sq + params.sq_off.array);
+    u->cq_head  = (unsigned*) (cq + params.cq_off.head);
+    u->cq_tail  = (unsigned*) (cq + params.cq_off.tail);
+    u->cq_mask  = (unsigned*) (cq + params.cq_off.ring_mask);
+    u->cqes     = cq + params.cq_off.cqes;
+    u->ring_fd  = fd;
+    return 0;
+}
+
+static void logger__uring_teardown(struct logger__uring* u) {
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_size);
+    munmap(u->sq_map, u->sq_map_size);
+    close(u->ring_fd);
+}
+
+// Puts the rest of buffer `index` in the submission ring; it goes out with the next enter.
+static void logger__uring_push(struct uring_sink_state* st, unsigned index) {
+    struct logger__uring* u = st->uring;
+    struct logger__uring_buffer* b = &u->buffers[index];
+    unsigned tail = *u->sq_tail;
+    unsigned slot = tail & *u->sq_mask;
+
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*) u->sqes + slot;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->flags     = (unsigned char) u->sqe_flags;
+    sqe->fd        = st->fd;
+    sqe->addr      = (uint64_t) (uintptr_t) (b->data + b->done);
+    sqe->len       = (unsigned) (b->used - b->done);
+    sqe->off       = b->offset + b->done;
+    sqe->user_data = index;
+
+    u->sq_array[slot] = slot;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending += 1;
+}
+
+// Submits what is pending and waits for `min_complete` completions. Returns -1 on failure.
+static int logger__uring_enter(struct uring_sink_state* st, unsigned min_complete) {
+    struct logger__uring* u = st->uring;
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, u->ring_fd, u->pending, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        st->syscalls += 1;
+        if (n >= 0) {
+            u->pending   -= (unsigned) n;
+            u->in_flight += (unsigned) n;
+            if (n > 0 && !logger__uring_thread_submitted) {
+                logger__uring_thread_submitted = 1;
+                pthread_once(&logger__uring_thread_once, logger__uring_thread_key_create);
+                pthread_setspecific(logger__uring_thread_key, (void*) 1);
+            }
+            return 0;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+// Returns the buffers whose writes completed to the free list and requeues short writes.
+static void logger__uring_reap(struct uring_sink_state* st) {
+    struct logger__uring* u = st->uring;
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe* cqe = (const struct io_uring_cqe*) u->cqes + (head & *u->cq_mask);
+        unsigned index = (unsigned) cqe->user_data;
+        int res = cqe->res;
+        struct logger__uring_buffer* b = &u->buffers[index];
+        u->in_flight -= 1;
+
+        if (res == -EINTR || res == -EAGAIN || (res > 0 && b->done + (size_t) res < b->used)) {
+            if (res > 0)
+                b->done += (size_t) res;
+            logger__uring_push(st, index);
+            continue;
+        }
+        if (res < 0 || (size_t) res < b->used - b->done)
+            st->errors += 1;
+        b->used = 0;
+        b->done = 0;
+        u->free_list[u->free_count++] = index;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+#else
+static int  logger__uring_setup(struct logger__uring* u, unsigned entries)       { (void) u; (void) entries; return -1; }
+static void logger__uring_teardown(struct logger__uring* u)                      { (void) u; }
+static void logger__uring_push(struct uring_sink_state* st, unsigned index)      { (void) st; (void) index; }
+static int  logger__uring_enter(struct uring_sink_state* st, unsigned min)       { (void) st; (void) min; return -1; }
+static void logger__uring_reap(struct uring_sink_state* st)                      { (void) st; }
+#endif
+
+static void logger__pwrite_all(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, (off_t) offset);
+        if (n <= 0 && errno != EINTR)
+            return;
+        if (n > 0) {
+            data   += n;
+            size   -= (size_t) n;
+            offset += (uint64_t) n;
+        }
+    }
+}
+
+// Hands the buffer being filled over to the kernel, submitting once half the buffers are
+// queued. When falling back, writes it out instead. Must hold the sink's lock.
+static void logger__uring_queue_current(struct uring_sink_state* st) {
+    struct logger__uring* u = st->uring;
+    if (u->current == u->count || u->buffers[u->current].used == 0)
+        return;
+
+    struct logger__uring_buffer* b = &u->buffers[u->current];
+    if (u->ring_fd < 0) {
+        struct iovec iov = { b->data, b->used };
+        st->syscalls += logger__writev_all(st->fd, &iov, 1);
+        b->used = 0;
+        return;
+    }
+
+    b->offset = u->offset;
+    b->done   = 0;
+    u->offset += b->used;
+    logger__uring_push(st, u->current);
+    u->current = u->count;
+    if (u->pending >= (u->count + 1) / 2 && logger__uring_enter(st, 0) != 0)
+        st->errors += 1;
+}
+
+// Makes sure there is a buffer to fill, waiting for a write to complete if all are in flight.
+static int logger__uring_take_buffer(struct uring_sink_state* st) {
+    struct logger__uring* u = st->uring;
+    if (u->current != u->count)
+        return 1;
+
+    logger__uring_reap(st);
+    while (u->free_count == 0) {
+        if (logger__uring_enter(st, 1) != 0)
+            return 0;
+        logger__uring_reap(st);
+    }
+    u->current = u->free_list[--u->free_count];
+    return 1;
+}
+
+// Submits everything and waits until it is written. Must hold the sink's lock.
+static void logger__uring_drain(struct uring_sink_state* st) {
+    struct logger__uring* u = st->uring;
+    logger__uring_queue_current(st);
+    while (u->ring_fd >= 0 && (u->pending || u->in_flight)) {
+        if (logger__uring_enter(st, 1) != 0) {
+            st->errors += 1;
+            break;
+        }
+        logger__uring_reap(st);
+    }
+}
+
+static void uring_sink_write(void* data, const struct log_record_t* record) {
+    struct uring_sink_state* st = data;
+    size_t need = record->message_len + 1;
+
+    logger__spin_lock(&st->lock);
+    struct logger__uring* u = st->uring;
+    st->records += 1;
+    if (!u) {
+        logger__spin_unlock(&st->lock);
+        return;
+    }
+
+    if (need > st->buffer_size) {
+        // Doesn't fit any buffer; written in place, right after what is queued already.
+        logger__uring_queue_current(st);
+        if (u->ring_fd < 0) {
+            struct iovec iov[2] = { { (void*) record->message, record->message_len }, { (void*) "\n", 1 } };
+            st->syscalls += logger__writev_all(st->fd, iov, 2);
+        } else {
+            if (u->sqe_flags)
+                logger__uring_drain(st);    // O_APPEND ignores the offset, so the order has to come from waiting
+            logger__pwrite_all(st->fd, record->message, record->message_len, u->offset);
+            logger__pwrite_all(st->fd, "\n", 1, u->offset + record->message_len);
+            u->offset += need;
+            st->syscalls += 2;
+        }
+        logger__spin_unlock(&st->lock);
+        return;
+    }
+
+    if (u->current != u->count && u->buffers[u->current].used + need > st->buffer_size)
+        logger__uring_queue_current(st);
+    if (!logger__uring_take_buffer(st)) {
+        st->errors += 1;
+        logger__spin_unlock(&st->lock);
+        return;
+    }
+
+    struct logger__uring_buffer* b = &u->buffers[u->current];
+    memcpy(b->data + b->used, record->message, record->message_len);
+    b->used += record->message_len;
+    b->data[b->used++] = '\n';
+
+    if (st->flush_level != LOG_DEFAULT && record->level >= st->flush_level) {
+        logger__uring_queue_current(st);
+        if (u->pending && logger__uring_enter(st, 0) != 0)
+            st->errors += 1;
+    }
+    logger__spin_unlock(&st->lock);
+}
+
+static void logger__uring_sinks_flush(void) {
+    pthread_mutex_lock(&logger__uring_sinks_lock);
+    for (struct uring_sink_state* st = logger__uring_sinks; st; st = st->next) {
+        logger__spin_lock(&st->lock);
+        if (st->uring)
+            logger__uring_drain(st);
+        logger__spin_unlock(&st->lock);
+    }
+    pthread_mutex_unlock(&logger__uring_sinks_lock);
+}
+
+static void logger__uring_free(struct logger__uring* u) {
+    if (u->ring_fd >= 0)
+        logger__uring_teardown(u);
+    free(u->memory);
+    free(u->buffers);
+    free(u->free_list);
+    free(u);
+}
+
+log_sink_t log_sink_uring(struct uring_sink_state* st) {
+    log_sink_t sink = { .write = NULL, .data = st, .flags = 0 };
+
+    // Starting over would lose the ring and the buffers still in flight.
+    if (logger__uring_sinks_contains(st)) {
+        sink.write = uring_sink_write;
+        return sink;
+    }
+
+    if (st->buffer_size == 0)
+        st->buffer_size = LOG_URING_DEFAULT_BUFFER_SIZE;
+    if (st->queue_depth == 0)
+        st->queue_depth = LOG_URING_DEFAULT_QUEUE_DEPTH;
+    st->lock = 0;
+    st->syscalls = 0;
+    st->records = 0;
+    st->errors = 0;
+
+    struct logger__uring* u = calloc(1, sizeof(*u));
+    if (!u)
+        return sink;
+    u->ring_fd = -1;
+
+    // Offsets are only meaningful for regular files.
+    struct stat info;
+    off_t end = -1;
+    if (fstat(st->fd, &info) == 0 && S_ISREG(info.st_mode))
+        end = lseek(st->fd, 0, SEEK_END);
+    if (end >= 0 && logger__uring_setup(u, st->queue_depth) == 0) {
+        u->offset = (uint64_t) end;
+        int flags = fcntl(st->fd, F_GETFL);
+#if LOGGER__HAS_URING
+        if (flags >= 0 && (flags & O_APPEND))
+            u->sqe_flags = IOSQE_IO_DRAIN;
+#else
+        (void) flags;
+#endif
+    }
+
+    u->count      = (u->ring_fd >= 0) ? st->queue_depth : 1;
+    u->memory     = malloc(u->count * st->buffer_size);
+    u->buffers    = calloc(u->count, sizeof(*u->buffers));
+    u->free_list  = malloc(u->count * sizeof(*u->free_list));
+    if (!u->memory || !u->buffers || !u->free_list) {
+        logger__uring_free(u);
+        return sink;
+    }
+    for (unsigned i = 0; i < u->count; ++i) {
+        u->buffers[i].data = u->memory + i * st->buffer_size;
+        u->free_list[i] = u->count - 1 - i;
+    }
+    u->free_count = u->count;
+    u->current    = u->count;
+    if (u->ring_fd < 0) {
+        u->current    = 0;
+        u->free_count = 0;
+    }
+    st->uring = u;
+
+    logger__uring_sinks_add(st);
+
+    sink.write = uring_sink_write;
+    return sink;
+}
+
+void log_sink_uring_close(struct uring_sink_state* st) {
+    logger__uring_sinks_remove(st);
+
+    logger__spin_lock(&st->lock);
+    struct logger__uring* u = st->uring;
+    if (u) {
+        logger__uring_drain(st);
+        st->uring = NULL;
+        logger__uring_free(u);
+    }
+    logger__spin_unlock(&st->lock);
+}
+
+int log_sink_uring_is_native(const struct uring_sink_state* st) {
+    return st->uring && st->uring->ring_fd >= 0;
+}
+
+
+// ---- Compressed sink ----
+// The codec is LZ4's block format: a greedy compressor with a single hash table of the last
+// position each 4-byte sequence was seen at, and a decompressor that checks every length and
+// offset against its buffers. A frame is
+//
+//   frame      := LOGGER_COMPRESSED_MAGIC, u32 text_size, u32 payload_size, u32 check, u8 payload[payload_size]
+//
+// in native byte order, like the binary stream. `check` is `logger__lz_checksum` of the text.
+// A payload as large as the text is the text itself, stored when it doesn't compress.
+
+#define LOGGER_COMPRESSED_MAGIC         "LOGLZ1"    /* Written with its terminating '\0' */
+#define LOGGER_COMPRESSED_HEADER_SIZE   (sizeof(LOGGER_COMPRESSED_MAGIC) + 3 * sizeof(uint32_t))
+#define LOGGER_COMPRESSED_MAX_FRAME     (1u << 30)
+
+#define LOGGER__LZ_HASH_BITS        14
+#define LOGGER__LZ_MIN_MATCH        4
+#define LOGGER__LZ_LAST_LITERALS    5       // The block always ends with this many literals
+#define LOGGER__LZ_MATCH_LIMIT      12      // and no match starts this close to its end
+#define LOGGER__LZ_MAX_OFFSET       65535
+#define LOGGER__LZ_BOUND(n)         ((n) + (n) / 255 + 16)
+
+static inline uint32_t logger__lz_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t logger__lz_read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t logger__lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LOGGER__LZ_HASH_BITS);
+}
+
+static uint32_t logger__lz_checksum(const unsigned char* p, size_t n) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (; n >= 8; p += 8, n -= 8)
+        h = (h ^ logger__lz_read64(p)) * 0x100000001B3ull;
+    for (; n > 0; ++p, --n)
+        h = (h ^ *p) * 0x100000001B3ull;
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+static unsigned char* logger__lz_put_length(unsigned char* op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+static unsigned char* logger__lz_put_sequence(unsigned char* op, const unsigned char* literals, size_t literal_len, size_t offset, size_t match_len) {
+    unsigned char* token = op++;
+    *token = (unsigned char) ((literal_len < 15 ? literal_len : 15) << 4);
+    if (literal_len >= 15)
+        op = logger__lz_put_length(op, literal_len - 15);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (offset == 0)
+        return op;
+
+    match_len -= LOGGER__LZ_MIN_MATCH;
+    *token |= (unsigned char) (match_len < 15 ? match_len : 15);
+    *op++ = (unsigned char) offset;
+    *op++ = (unsigned char) (offset >> 8);
+    if (match_len >= 15)
+        op = logger__lz_put_length(op, match_len - 15);
+    return op;
+}
+
+// Compresses `n` bytes of `src` into `dst`, which must hold LOGGER__LZ_BOUND(n) bytes. `table`
+// holds 1 << LOGGER__LZ_HASH_BITS entries; whatever it contains, candidates are verified.
+static size_t logger__lz_compress(const unsigned char* src, size_t n, unsigned char* dst, uint32_t* table) {
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;      // First literal not yet written
+    const unsigned char* end = src + n;
+    unsigned char* op = dst;
+
+    if (n > LOGGER__LZ_MATCH_LIMIT) {
+        const unsigned char* match_limit = end - LOGGER__LZ_MATCH_LIMIT;
+        const unsigned char* extend_limit = end - LOGGER__LZ_LAST_LITERALS;
+
+        while (ip < match_limit) {
+            uint32_t sequence = logger__lz_read32(ip);
+            uint32_t* slot = &table[logger__lz_hash(sequence)];
+            size_t pos = (size_t) (ip - src);
+            size_t candidate = *slot;
+            *slot = (uint32_t) pos;
+            if (candidate >= pos || pos - candidate > LOGGER__LZ_MAX_OFFSET || logger__lz_read32(src + candidate) != sequence) {
+                ip += 1 + ((size_t) (ip - anchor) >> 6);    // Skip faster through text that doesn't compress
+                continue;
+            }
+
+            const unsigned char* match = src + candidate;
+            while (ip > anchor && match > src && ip[-1] == match[-1]) {
+                --ip;
+                --match;
+            }
+
+            const unsigned char* p = ip + LOGGER__LZ_MIN_MATCH;
+            const unsigned char* q = match + LOGGER__LZ_MIN_MATCH;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            while (p + 8 <= extend_limit) {
+                uint64_t diff = logger__lz_read64(p) ^ logger__lz_read64(q);
+                if (diff) {
+                    p += __builtin_ctzll(diff) >> 3;
+                    goto matched;
+                }
+                p += 8;
+                q += 8;
+            }
+#endif
+            while (p < extend_limit && *p == *q) {
+                ++p;
+                ++q;
+            }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        matched:
+#endif
+            op = logger__lz_put_sequence(op, anchor, (size_t) (ip - anchor), (size_t) (ip - match), (size_t) (p - ip));
+            ip = anchor = p;
+            if (ip - 2 >= src && ip < match_limit)
+                table[logger__lz_hash(logger__lz_read32(ip - 2))] = (uint32_t) (ip - 2 - src);
+        }
+    }
+
+    return (size_t) (logger__lz_put_sequence(op, anchor, (size_t) (end - anchor), 0, 0) - dst);
+}
+
+static int logger__lz_get_length(const unsigned char** ip, const unsigned char* end, size_t* len) {
+    unsigned char byte;
+    do {
+        if (*ip >= end)
+            return 0;
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+// Returns the decompressed size, or -1 when `src` is corrupt or decompresses to more than `capacity`.
+// Only `logger_decompress` calls it, hence not static.
+ptrdiff_t logger__lz_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t capacity) {
+    const unsigned char* ip = src;
+    const unsigned char* end = src + n;
+    unsigned char* op = dst;
+    unsigned char* op_end = dst + capacity;
+
+    for (;;) {
+        if (ip >= end)
+            return -1;
+        unsigned token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !logger__lz_get_length(&ip, end, &literal_len))
+            return -1;
+        if ((size_t) (end - ip) < literal_len || (size_t) (op_end - op) < literal_len)
+            return -1;
+        memcpy(op, ip, literal_len);
+        op += literal_len;
+        ip += literal_len;
+        if (ip == end)
+            break;      // The last sequence has no match
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = (size_t) ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst))
+            return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !logger__lz_get_length(&ip, end, &match_len))
+            return -1;
+        match_len += LOGGER__LZ_MIN_MATCH;
+        if ((size_t) (op_end - op) < match_len)
+            return -1;
+
+        // Byte by byte, so a match overlapping its own output repeats it.
+        const unsigned char* match = op - offset;
+        while (match_len--)
+            *op++ = *match++;
+    }
+    return op - dst;
+}
+
+
+// Frame `i` of the ring is `text + (i % LOG_COMPRESSED_FRAMES) * frame_size`. Logging threads fill
+// frame `filled` under the sink's lock; frames `written` up to `filled` belong to the thread.
+struct logger__compressor {
+    struct compressed_sink_state* sink;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  full;           // A frame was handed over, or the sink is closing
+    pthread_cond_t  written;        // A frame was written
+    size_t          filled;         // Frames handed over so far
+    size_t          written_count;  // Frames written so far
+    int             closing;
+
+    size_t          used[LOG_COMPRESSED_FRAMES];
+    unsigned char*  text;
+    unsigned char*  out;            // Header and payload of the frame being written
+    uint32_t*       table;
+};
+
+LOGGER__REGISTRY(struct compressed_sink_state, logger__compressed_sinks)
+
+static void* logger__compressor_main(void* arg) {
+    struct logger__compressor* c = arg;
+    struct compressed_sink_state* st = c->sink;
+
+    pthread_mutex_lock(&c->mutex);
+    for (;;) {
+        while (c->written_count == c->filled && !c->closing)
+            pthread_cond_wait(&c->full, &c->mutex);
+        if (c->written_count == c->filled)
+            break;
+        size_t index = c->written_count % LOG_COMPRESSED_FRAMES;
+        pthread_mutex_unlock(&c->mutex);
+
+        const unsigned char* text = c->text + index * st->frame_size;
+        uint32_t header[3];
+        header[0] = (uint32_t) c->used[index];
+        header[2] = logger__lz_checksum(text, c->used[index]);
+        unsigned char* payload = c->out + LOGGER_COMPRESSED_HEADER_SIZE;
+        size_t payload_size = logger__lz_compress(text, c->used[index], payload, c->table);
+        if (payload_size >= c->used[index]) {
+            payload_size = c->used[index];
+            memcpy(payload, text, payload_size);
+        }
+        header[1] = (uint32_t) payload_size;
+        memcpy(c->out, LOGGER_COMPRESSED_MAGIC, sizeof(LOGGER_COMPRESSED_MAGIC));
+        memcpy(c->out + sizeof(LOGGER_COMPRESSED_MAGIC), header, sizeof(header));
+        logger__write_all(st->fd, (const char*) c->out, LOGGER_COMPRESSED_HEADER_SIZE + payload_size);
+
+        pthread_mutex_lock(&c->mutex);
+        st->frames += 1;
+        st->bytes_in += c->used[index];
+        st->bytes_out += LOGGER_COMPRESSED_HEADER_SIZE + payload_size;
+        c->written_count += 1;
+        pthread_cond_broadcast(&c->written);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return NULL;
+}
+
+// Hands the frame being filled to the thread and waits until the next one is free. Must hold the sink's lock.
+static void logger__compressed_hand_over(struct compressed_sink_state* st) {
+    struct logger__compressor* c = st->compressor;
+    if (c->used[c->filled % LOG_COMPRESSED_FRAMES] == 0)
+        return;
+
+    pthread_mutex_lock(&c->mutex);
+    c->filled += 1;
+    pthread_cond_signal(&c->full);
+    while (c->filled - c->written_count >= LOG_COMPRESSED_FRAMES)
+        pthread_cond_wait(&c->written, &c->mutex);
+    pthread_mutex_unlock(&c->mutex);
+    c->used[c->filled % LOG_COMPRESSED_FRAMES] = 0;
+}
+
+// Must hold the sink's lock.
+static void logger__compressed_append(struct compressed_sink_state* st, const char* data, size_t len) {
+    struct logger__compressor* c = st->compressor;
+    while (len > 0) {
+        size_t index = c->filled % LOG_COMPRESSED_FRAMES;
+        size_t n = st->frame_size - c->used[index];
+        if (n > len)
+            n = len;
+        memcpy(c->text + index * st->frame_size + c->used[index], data, n);
+        c->used[index] += n;
+        data += n;
+        len -= n;
+        if (c->used[index] == st->frame_size)
+            logger__compressed_hand_over(st);
+    }
+}
+
+static void compressed_sink_write(void* data, const struct log_record_t* record) {
+    struct compressed_sink_state* st = data;
+
+    logger__spin_lock(&st->lock);
+    struct logger__compressor* c = st->compressor;
+    st->records += 1;
+    if (!c) {
+        logger__spin_unlock(&st->lock);
+        return;
+    }
+
+    if (c->used[c->filled % LOG_COMPRESSED_FRAMES] + record->message_len + 1 > st->frame_size)
+        logger__compressed_hand_over(st);
+    logger__compressed_append(st, record->message, record->message_len);
+    logger__compressed_append(st, "\n", 1);
+
+    if (st->flush_level != LOG_DEFAULT && record->level >= st->flush_level)
+        logger__compressed_hand_over(st);
+    logger__spin_unlock(&st->lock);
+}
+
+// Hands over the frame being filled and waits until it is written.
+static void logger__compressed_flush(struct compressed_sink_state* st) {
+    logger__spin_lock(&st->lock);
+    struct logger__compressor* c = st->compressor;
+    if (!c) {
+        logger__spin_unlock(&st->lock);
+        return;
+    }
+    logger__compressed_hand_over(st);
+    size_t target = c->filled;
+    logger__spin_unlock(&st->lock);
+
+    pthread_mutex_lock(&c->mutex);
+    while (c->written_count < target)
+        pthread_cond_wait(&c->written, &c->mutex);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static void logger__compressed_sinks_flush(void) {
+    pthread_mutex_lock(&logger__compressed_sinks_lock);
+    for (struct compressed_sink_state* st = logger__compressed_sinks; st; st = st->next)
+        logger__compressed_flush(st);
+    pthread_mutex_unlock(&logger__compressed_sinks_lock);
+}
+
+static void logger__compressor_free(struct logger__compressor* c) {
+    free(c->text);
+    free(c->out);
+    free(c->table);
+    free(c);
+}
+
+log_sink_t log_sink_compressed(struct compressed_sink_state* st) {
+    log_sink_t sink = { .write = NULL, .data = st, .flags = 0 };
+
+    // Starting over would lose the running compressor and the frames it holds.
+    if (logger__compressed_sinks_contains(st)) {
+        sink.write = compressed_sink_write;
+        return sink;
+    }
+
+    if (st->frame_size == 0)
+        st->frame_size = LOG_COMPRESSED_DEFAULT_FRAME_SIZE;
+    if (st->frame_size > LOGGER_COMPRESSED_MAX_FRAME)
+        st->frame_size = LOGGER_COMPRESSED_MAX_FRAME;
+    st->compressor = NULL;
+    st->lock = 0;
+    st->records = 0;
+    st->frames = 0;
+    st->bytes_in = 0;
+    st->bytes_out = 0;
+
+    struct logger__compressor* c = calloc(1, sizeof(*c));
+    if (!c)
+        return sink;
+    c->text  = malloc(LOG_COMPRESSED_FRAMES * st->frame_size);
+    c->out   = malloc(LOGGER_COMPRESSED_HEADER_SIZE + LOGGER__LZ_BOUND(st->frame_size));
+    c->table = calloc((size_t) 1 << LOGGER__LZ_HASH_BITS, sizeof(*c->table));
+    if (!c->text || !c->out || !c->table) {
+        logger__compressor_free(c);
+        return sink;
+    }
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->full, NULL);
+    pthread_cond_init(&c->written, NULL);
+
+    c->sink = st;
+    if (pthread_create(&c->thread, NULL, logger__compressor_main, c) != 0) {
+        logger__compressor_free(c);
+        return sink;
+    }
+    st->compressor = c;
+
+    logger__compressed_sinks_add(st);
+
+    sink.write = compressed_sink_write;
+    return sink;
+}
+
+void log_sink_compressed_close(struct compressed_sink_state* st) {
+    logger__compressed_sinks_remove(st);
+
+    logger__spin_lock(&st->lock);
+    struct logger__compressor* c = st->compressor;
+    if (c) {
+        logger__compressed_hand_over(st);
+        st->compressor = NULL;
+    }
+    logger__spin_unlock(&st->lock);
+    if (!c)
+        return;
+
+    pthread_mutex_lock(&c->mutex);
+    c->closing = 1;
+    pthread_cond_signal(&c->full);
+    pthread_mutex_unlock(&c->mutex);
+    pthread_join(c->thread, NULL);
+
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->full);
+    pthread_cond_destroy(&c->written);
+    logger__compressor_free(c);
+}
+
+
+// ---- Indexed sink ----
+// A file is
+//
+//   file       := LOGGER_INDEXED_MAGIC block* [index]
+//   block      := header, record[header.size bytes]        (records as `log_encode_binary` writes them)
+//   index      := header[count], u64 count, u64 index_offset, LOGGER_INDEXED_MAGIC
+//
+// in native byte order. A header's `offset` is its own position, which tells a block apart
+// from the copies in the index when the index is incomplete. The callsite filter holds both
+// "file name:line" and the file name alone, so a query for a whole file can use it too.
+
+#define LOGGER_INDEXED_MAGIC            "LOGIDX1"   /* Written with its terminating '\0' */
+#define LOGGER_INDEXED_BLOCK_MAGIC      0x4B4C4249u
+#define LOGGER_INDEXED_LOGGER_BITS      256
+#define LOGGER_INDEXED_CALLSITE_BITS    1024
+
+struct logger__index_block {
+    uint32_t magic;
+    uint32_t size;          // Bytes of records following the header
+    uint64_t offset;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint32_t count;
+    uint32_t levels;        // Bit `1 << level` for each level present
+    uint64_t loggers[LOGGER_INDEXED_LOGGER_BITS / 64];
+    uint64_t callsites[LOGGER_INDEXED_CALLSITE_BITS / 64];
+};
+
+struct logger__index_trailer {
+    uint64_t count;
+    uint64_t index_offset;
+    char     magic[sizeof(LOGGER_INDEXED_MAGIC)];
+};
+
+// Three bits out of one hash.
+static inline void logger__bloom_add(uint64_t* bits, size_t count, uint64_t hash) {
+    for (int i = 0; i < 3; ++i, hash >>= 20)
+        bits[(hash % count) / 64] |= 1ull << (hash % 64);
+}
+
+static inline int logger__bloom_test(const uint64_t* bits, size_t count, uint64_t hash) {
+    for (int i = 0; i < 3; ++i, hash >>= 20)
+        if (!(bits[(hash % count) / 64] & (1ull << (hash % 64))))
+            return 0;
+    return 1;
+}
+
+static inline uint64_t logger__index_logger_key(const char* name, size_t len) {
+    return logger__hash(name ? name : "", name ? len : 0, 0x6C6F6767);
+}
+
+// The directory is left out, queries name the file as it appears in the default format.
+static inline uint64_t logger__index_callsite_key(const char* file, size_t len, int line) {
+    const char* base = file ? file : "";
+    len = file ? len : 0;
+    for (size_t i = len; i > 0; --i) {
+        if (base[i - 1] == '/') {
+            base += i;
+            len -= i;
+            break;
+        }
+    }
+    return logger__hash(base, len, (uint64_t) (unsigned) line);
+}
+
+LOGGER__REGISTRY(struct indexed_sink_state, logger__indexed_sinks)
+
+static void logger__indexed_reset(struct indexed_sink_state* st) {
+    struct logger__index_block* header = (struct logger__index_block*) st->block;
+    memset(header, 0, sizeof(*header));
+    header->magic  = LOGGER_INDEXED_BLOCK_MAGIC;
+    header->min_ns = UINT64_MAX;
+    st->used = 0;
+}
+
+// Must hold the sink's lock.
+static void logger__indexed_write_out(struct indexed_sink_state* st) {
+    if (st->used == 0)
+        return;
+
+    struct logger__index_block* header = (struct logger__index_block*) st->block;
+    header->size   = (uint32_t) st->used;
+    header->offset = st->offset;
+    logger__write_all(st->fd, st->block, sizeof(*header) + st->used);
+    st->offset += sizeof(*header) + st->used;
+
+    if (st->index && st->blocks == st->index_capacity) {
+        size_t capacity = st->index_capacity ? st->index_capacity * 2 : 64;
+        struct logger__index_block* index = realloc(st->index, capacity * sizeof(*index));
+        if (!index)
+            free(st->index);
+        st->index = index;
+        st->index_capacity = capacity;
+    }
+    if (st->index)
+        st->index[st->blocks] = *header;
+    st->blocks += 1;
+    logger__indexed_reset(st);
+}
+
+static void indexed_sink_write(void* data, const struct log_record_t* record) {
+    struct indexed_sink_state* st = data;
+
+    // Raw sink: only the message is formatted, outside of the lock.
+    char message[LOG_INDEXED_MAX_MESSAGE];
+    log_record_t stored = *record;
+    if (!record->message && record->args) {
+        va_list args;
+        va_copy(args, *record->args);
+        int len = log_vformat(message, (int) sizeof(message), record->format, args);
+        va_end(args);
+        stored.message     = message;
+        stored.message_len = (len < 0) ? 0 : ((size_t) len < sizeof(message)) ? (size_t) len : sizeof(message) - 1;
+    } else if (!record->message) {
+        stored.message     = record->format;
+        stored.message_len = record->format ? strlen(record->format) : 0;
+    }
+    stored.timestamp = record->timestamp ? record->timestamp : log_now();
+
+    uint64_t logger_key = logger__index_logger_key(record->logger_name, record->logger_name ? strlen(record->logger_name) : 0);
+    size_t file_len = record->location.file ? strlen(record->location.file) : 0;
+    uint64_t line_key = logger__index_callsite_key(record->location.file, file_len, record->location.line);
+    uint64_t file_key = logger__index_callsite_key(record->location.file, file_len, 0);
+
+    logger__spin_lock(&st->lock);
+    if (!st->block) {
+        logger__spin_unlock(&st->lock);
+        return;
+    }
+    st->records += 1;
+
+    struct logger__index_block* header = (struct logger__index_block*) st->block;
+    char* records = st->block + sizeof(*header);
+    size_t room = st->block_size - st->used;
+    int len = log_encode_binary(records + st->used, (int) room, &stored);
+    if ((size_t) len > room) {
+        logger__indexed_write_out(st);
+        len = log_encode_binary(records, (int) st->block_size, &stored);
+        if ((size_t) len > st->block_size) {
+            st->dropped += 1;
+            logger__spin_unlock(&st->lock);
+            return;
+        }
+    }
+
+    st->used += (size_t) len;
+    header->count  += 1;
+    header->levels |= 1u << record->level;
+    if (stored.timestamp < header->min_ns) header->min_ns = stored.timestamp;
+    if (stored.timestamp > header->max_ns) header->max_ns = stored.timestamp;
+    logger__bloom_add(header->loggers,   LOGGER_INDEXED_LOGGER_BITS,   logger_key);
+    logger__bloom_add(header->callsites, LOGGER_INDEXED_CALLSITE_BITS, line_key);
+    logger__bloom_add(header->callsites, LOGGER_INDEXED_CALLSITE_BITS, file_key);
+
+    if (st->flush_level != LOG_DEFAULT && record->level >= st->flush_level)
+        logger__indexed_write_out(st);
+    logger__spin_unlock(&st->lock);
+}
+
+static void logger__indexed_sinks_flush(void) {
+    pthread_mutex_lock(&logger__indexed_sinks_lock);
+    for (struct indexed_sink_state* st = logger__indexed_sinks; st; st = st->next) {
+        logger__spin_lock(&st->lock);
+        if (st->block)
+            logger__indexed_write_out(st);
+        logger__spin_unlock(&st->lock);
+    }
+    pthread_mutex_unlock(&logger__indexed_sinks_lock);
+}
+
+log_sink_t log_sink_indexed(struct indexed_sink_state* st) {
+    log_sink_t sink = { .write = NULL, .data = st, .flags = LOG_SINK_RAW };
+
+    // Starting over would lose the pending block and the index, and put a magic mid-file.
+    if (logger__indexed_sinks_contains(st)) {
+        sink.write = indexed_sink_write;
+        return sink;
+    }
+
+    if (st->block_size == 0)
+        st->block_size = LOG_INDEXED_DEFAULT_BLOCK_SIZE;
+    if (st->block_size > UINT32_MAX)
+        st->block_size = UINT32_MAX;
+    st->lock = 0;
+    st->records = 0;
+    st->blocks = 0;
+    st->dropped = 0;
+    st->index_capacity = 0;
+    st->offset = sizeof(LOGGER_INDEXED_MAGIC);
+    st->block = malloc(sizeof(struct logger__index_block) + st->block_size);
+    st->index = malloc(64 * sizeof(*st->index));
+    if (!st->block || !st->index) {
+        free(st->block);
+        free(st->index);
+        st->block = NULL;
+        st->index = NULL;
+        return sink;
+    }
+    st->index_capacity = 64;
+    logger__indexed_reset(st);
+    logger__write_all(st->fd, LOGGER_INDEXED_MAGIC, sizeof(LOGGER_INDEXED_MAGIC));
+
+    logger__indexed_sinks_add(st);
+
+    sink.write = indexed_sink_write;
+    return sink;
+}
+
+void log_sink_indexed_close(struct indexed_sink_state* st) {
+    logger__indexed_sinks_remove(st);
+
+    logger__spin_lock(&st->lock);
+    if (st->block) {
+        logger__indexed_write_out(st);
+        if (st->index) {
+            struct logger__index_trailer trailer = { st->blocks, st->offset, LOGGER_INDEXED_MAGIC };
+            struct iovec iov[2] = {
+                { st->index, st->blocks * sizeof(*st->index) },
+                { &trailer, sizeof(trailer) },
+            };
+            logger__writev_all(st->fd, iov, 2);
+        }
+        free(st->block);
+        free(st->index);
+        st->block = NULL;
+        st->index = NULL;
+    }
+    logger__spin_unlock(&st->lock);
+}
+
+// ---- Shared memory sink ----
+// The ring is a header and `slot_count` slots. Writers take sequence numbers from `head`, at
+// most `slot_count` ahead of `tail`, the next sequence the collector reads. A slot's `state`
+// is 4 * sequence + phase and only ever moves forward by compare-and-swap:
+//
+//   previous lap done (COMPLETE or ABANDONED) -> WRITING     writer, once it owns the sequence
+//   WRITING  -> COMPLETE                                     writer, when the record is in
+//   anything older -> ABANDONED                              collector, for a writer that died
+//
+// so a writer that was given up on can neither finish its record nor take the slot of a later
+// lap. It may still be copying, though, if it was only slow: its bytes can land in the record
+// of the writer that has the slot a lap later. So every record carries a checksum of its
+// sequence, pid, length, timestamp and text, and the collector drops a record that doesn't
+// match it. `pid` is stored before the slot turns WRITING, which is what lets the collector
+// check whether the writer still exists, but only when the slot is free to take: a writer
+// that stalled since may still overwrite the pid of a later lap, and that record is then
+// dropped as torn. Everything is in native byte order.
+
+#define LOGGER_SHM_MAGIC        "LOGSHM1"   /* With its terminating '\0' */
+#define LOGGER_SHM_WRITING      1
+#define LOGGER_SHM_COMPLETE     2
+#define LOGGER_SHM_ABANDONED    3
+
+struct logger__shm_ring {
+    char     magic[sizeof(LOGGER_SHM_MAGIC)];
+    uint64_t slot_count;
+    uint64_t slot_size;
+    uint64_t dropped;                               // By every process, when the ring was full
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+};
+
+struct logger__shm_slot {
+    uint64_t state;
+    int32_t  pid;
+    uint32_t len;
+    uint64_t timestamp;
+    uint64_t check;         // `logger__shm_check` of the record
+    char     text[];
+};
+
+#define LOGGER_SHM_HEADER_SIZE  ((sizeof(struct logger__shm_ring) + 63) & ~(size_t) 63)
+
+static inline struct logger__shm_slot* logger__shm_slot(struct logger__shm_ring* ring, uint64_t sequence) {
+    char* slots = (char*) ring + LOGGER_SHM_HEADER_SIZE;
+    return (struct logger__shm_slot*) (slots + (sequence & (ring->slot_count - 1)) * ring->slot_size);
+}
+
+static inline uint64_t logger__shm_check(uint64_t sequence, int32_t pid, uint32_t len, uint64_t timestamp, const char* text) {
+    uint64_t seed = (sequence ^ timestamp) + (((uint64_t) (uint32_t) pid << 32) | len) * 0x9E3779B97F4A7C15ull;
+    return logger__hash(text, len, seed);
+}
+
+static void shm_sink_write(void* data, const struct log_record_t* record) {
+    struct shm_sink_state* st = data;
+    struct logger__shm_ring* ring = st->ring;
+    if (!ring)
+        return;
+
+    uint64_t sequence = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    do {
+        if (sequence - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->slot_count) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&st->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->head, &sequence, sequence + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    // The previous lap is done with the slot unless its writer was given up on while this
+    // one stalled; either way the sequence is lost.
+    struct logger__shm_slot* slot = logger__shm_slot(ring, sequence);
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    int reusable = (sequence < ring->slot_count) ? state == 0
+                                                 : state == 4 * (sequence - ring->slot_count) + LOGGER_SHM_COMPLETE
+                                                || state == 4 * (sequence - ring->slot_count) + LOGGER_SHM_ABANDONED;
+    int32_t pid = (int32_t) getpid();
+    if (reusable)
+        __atomic_store_n(&slot->pid, pid, __ATOMIC_RELAXED);
+    if (!reusable || !__atomic_compare_exchange_n(&slot->state, &state, 4 * sequence + LOGGER_SHM_WRITING, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&st->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t room = ring->slot_size - sizeof(*slot);
+    size_t len = record->message_len;
+    if (len > room) {
+        len = room;
+        __atomic_add_fetch(&st->truncated, 1, __ATOMIC_RELAXED);
+    }
+    // Everything again, after the slot is ours; a writer that was given up on may have been in here.
+    memcpy(slot->text, record->message, len);
+    __atomic_store_n(&slot->pid, pid, __ATOMIC_RELAXED);
+    slot->len = (uint32_t) len;
+    slot->timestamp = record->timestamp;
+    slot->check = logger__shm_check(sequence, pid, (uint32_t) len, record->timestamp, record->message);
+
+    state = 4 * sequence + LOGGER_SHM_WRITING;
+    if (__atomic_compare_exchange_n(&slot->state, &state, 4 * sequence + LOGGER_SHM_COMPLETE, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        __atomic_add_fetch(&st->records, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&st->dropped, 1, __ATOMIC_RELAXED);
+}
+
+// Maps the ring `name`, creating or resetting it with `create`. Returns NULL on failure.
+static struct logger__shm_ring* logger__shm_map(const char* name, int create, size_t slot_count, size_t slot_size, size_t* out_size) {
+    int fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    size_t size = LOGGER_SHM_HEADER_SIZE + slot_count * slot_size;
+    if (create ? ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t) size) != 0
+               : fstat(fd, &info) != 0 || (size = (size_t) info.st_size) < LOGGER_SHM_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    struct logger__shm_ring* ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+        return NULL;
+
+    if (create) {
+        ring->slot_count = slot_count;
+        ring->slot_size  = slot_size;
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->tail, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(ring->magic, LOGGER_SHM_MAGIC, sizeof(LOGGER_SHM_MAGIC));
+    } else if (memcmp(ring->magic, LOGGER_SHM_MAGIC, sizeof(LOGGER_SHM_MAGIC)) != 0
+               || ring->slot_count == 0 || (ring->slot_count & (ring->slot_count - 1)) != 0
+               || ring->slot_size < sizeof(struct logger__shm_slot) + 8 || ring->slot_size % 8 != 0
+               || (size - LOGGER_SHM_HEADER_SIZE) / ring->slot_size < ring->slot_count) {
+        munmap(ring, size);
+        return NULL;
+    }
+    *out_size = size;
+    return ring;
+}
+
+log_sink_t log_sink_shm(struct shm_sink_state* st) {
+    log_sink_t sink = { .write = NULL, .data = st, .flags = 0 };
+
+    size_t slot_count = 1;
+    while (slot_count < (st->slot_count ? st->slot_count : LOG_SHM_DEFAULT_SLOT_COUNT))
+        slot_count *= 2;
+    size_t slot_size = st->slot_size ? st->slot_size : LOG_SHM_DEFAULT_SLOT_SIZE;
+    if (slot_size < sizeof(struct logger__shm_slot) + 8)
+        slot_size = sizeof(struct logger__shm_slot) + 8;
+    slot_size = (slot_size + 7) & ~(size_t) 7;
+
+    st->records = 0;
+    st->dropped = 0;
+    st->truncated = 0;
+    st->ring = logger__shm_map(st->name, st->create, slot_count, slot_size, &st->mapped_size);
+    if (!st->ring)
+        return sink;
+    st->slot_count = st->ring->slot_count;
+    st->slot_size  = st->ring->slot_size;
+
+    sink.write = shm_sink_write;
+    return sink;
+}
+
+void log_sink_shm_close(struct shm_sink_state* st) {
+    struct logger__shm_ring* ring = st->ring;
+    if (!ring)
+        return;
+    st->ring = NULL;
+    munmap(ring, st->mapped_size);
+}
+
+
+
+
+// ---- Async backend ----
+// Bounded MPMC queue (Vyukov). Producers are the logging threads; the consumer
+// is a single background thread, but producers using LOG_ASYNC_DROP_OLDEST also
+// dequeue, so both ends are claimed with a CAS.
+// Each slot carries an already formatted message together with the sink it was
+// resolved to, so the logging thread never blocks on the sink's I/O.
+
+struct logger__async_slot {
+    size_t       sequence;
+    log_sink_t*  sink;
+    log_record_t record;
+    char*        overflow;      // Heap copy of a message longer than `text`
+    char         text[LOG_ASYNC_MESSAGE_SIZE];
+};
+
+static struct {
+    struct logger__async_slot* slots;
+    size_t mask;
+    log_async_overflow_t overflow;
+    int enabled;
+
+    __attribute__((aligned(LOGGER_CACHE_LINE))) size_t enqueue_pos;
+    __attribute__((aligned(LOGGER_CACHE_LINE))) size_t dequeue_pos;
+    __attribute__((aligned(LOGGER_CACHE_LINE))) size_t completed;   // Records dispatched or dropped from the queue.
+    size_t dropped;
+    int sleeping;
+    int running;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t drained;
+} logger__async = {
+    .lock    = PTHREAD_MUTEX_INITIALIZER,
+    .wake    = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+static THREAD_LOCAL int logger__is_async_thread = 0;
+
+
+static void logger__deadline_after(struct timespec* ts, long ns) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += ns;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec  += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void logger__async_wake(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logger__async.sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&logger__async.lock);
+        pthread_cond_signal(&logger__async.wake);
+        pthread_mutex_unlock(&logger__async.lock);
+    }
+}
+
+static int logger__async_try_push(log_sink_t* sink, const log_record_t* record) {
+    struct logger__async_slot* slot;
+    size_t pos = __atomic_load_n(&logger__async.enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &logger__async.slots[pos & logger__async.mask];
+        size_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&logger__async.enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&logger__async.enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    size_t len = record->message_len;
+    slot->overflow = (len > sizeof(slot->text)) ? malloc(len) : NULL;
+    if (slot->overflow) {
+        memcpy(slot->overflow, record->message, len);
+    } else {
+        if (len > sizeof(slot->text))
+            len = sizeof(slot->text);
+        memcpy(slot->text, record->message, len);
+    }
+
+    slot->sink = sink;
+    slot->record = *record;
+    slot->record.message_len = len;
+    slot->record.fields = NULL;
+    slot->record.field_count = 0;
+    slot->record.args = NULL;
+
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Claims the oldest slot. The caller must hand it back with `logger__async_release`.
+static struct logger__async_slot* logger__async_try_pop(size_t* out_pos) {
+    struct logger__async_slot* slot;
+    size_t pos = __atomic_load_n(&logger__async.dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &logger__async.slots[pos & logger__async.mask];
+        size_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&logger__async.dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&logger__async.dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    *out_pos = pos;
+    return slot;
+}
+
+static void logger__async_release(struct logger__async_slot* slot, size_t pos) {
+    free(slot->overflow);
+    slot->overflow = NULL;
+    __atomic_store_n(&slot->sequence, pos + logger__async.mask + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&logger__async.completed, 1, __ATOMIC_RELEASE);
+}
+
+static void logger__async_push(log_sink_t* sink, const log_record_t* record) {
+    while (!logger__async_try_push(sink, record)) {
+        switch (logger__async.overflow) {
+            case LOG_ASYNC_DROP_NEWEST:
+                __atomic_add_fetch(&logger__async.dropped, 1, __ATOMIC_RELAXED);
+                return;
+            case LOG_ASYNC_DROP_OLDEST: {
+                size_t pos;
+                struct logger__async_slot* oldest = logger__async_try_pop(&pos);
+                if (oldest) {
+                    logger__async_release(oldest, pos);
+                    __atomic_add_fetch(&logger__async.dropped, 1, __ATOMIC_RELAXED);
+                }
+            } break;
+            case LOG_ASYNC_BLOCK:
+            default:
+                logger__async_wake();
+                sched_yield();
+                break;
+        }
+    }
+    logger__async_wake();
+}
+
+static void* logger__async_main(void* arg) {
+    (void) arg;
+    logger__is_async_thread = 1;
+
+    for (;;) {
+        size_t pos;
+        struct logger__async_slot* slot = logger__async_try_pop(&pos);
+        if (slot) {
+            slot->record.message = slot->overflow ? slot->overflow : slot->text;
+            if (slot->sink && slot->sink->write)
+                logger__sink_write(slot->sink, &slot->record);
+            logger__async_release(slot, pos);
+            continue;
+        }
+
+        pthread_mutex_lock(&logger__async.lock);
+        pthread_cond_broadcast(&logger__async.drained);
+        if (!__atomic_load_n(&logger__async.running, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&logger__async.lock);
+            break;
+        }
+
+        __atomic_store_n(&logger__async.sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&logger__async.dequeue_pos, __ATOMIC_RELAXED) == __atomic_load_n(&logger__async.enqueue_pos, __ATOMIC_RELAXED)) {
+            // The timeout only bounds the latency of a wake-up lost to a producer that is still filling its slot.
+            struct timespec deadline;
+            logger__deadline_after(&deadline, 10 * 1000 * 1000);
+            pthread_cond_timedwait(&logger__async.wake, &logger__async.lock, &deadline);
+        }
+        __atomic_store_n(&logger__async.sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&logger__async.lock);
+    }
+    return NULL;
+}
+
+static void logger__async_flush(void) {
+    if (!__atomic_load_n(&logger__async.enabled, __ATOMIC_ACQUIRE) || logger__is_async_thread)
+        return;
+
+    size_t target = __atomic_load_n(&logger__async.enqueue_pos, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&logger__async.completed, __ATOMIC_ACQUIRE) < target) {
+        pthread_mutex_lock(&logger__async.lock);
+        pthread_cond_signal(&logger__async.wake);
+        struct timespec deadline;
+        logger__deadline_after(&deadline, 1000 * 1000);
+        pthread_cond_timedwait(&logger__async.drained, &logger__async.lock, &deadline);
+        pthread_mutex_unlock(&logger__async.lock);
+    }
+}
+
+static void logger__async_shutdown(void) {
+    if (!__atomic_load_n(&logger__async.enabled, __ATOMIC_ACQUIRE))
+        return;
+
+    logger__async_flush();
+    __atomic_store_n(&logger__async.enabled, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&logger__async.lock);
+    __atomic_store_n(&logger__async.running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&logger__async.wake);
+    pthread_mutex_unlock(&logger__async.lock);
+    pthread_join(logger__async.thread, NULL);
+
+    // A producer may have raced past the `enabled` check; drain whatever it left behind.
+    size_t pos;
+    struct logger__async_slot* slot;
+    while ((slot = logger__async_try_pop(&pos)) != NULL) {
+        slot->record.message = slot->overflow ? slot->overflow : slot->text;
+        if (slot->sink && slot->sink->write)
+            logger__sink_write(slot->sink, &slot->record);
+        logger__async_release(slot, pos);
+    }
+}
+
+static void logger__async_start(size_t capacity, log_async_overflow_t overflow) {
+    size_t n = 1;
+    while (n < capacity)
+        n <<= 1;
+
+    logger__async.slots = calloc(n, sizeof(*logger__async.slots));
+    if (!logger__async.slots) {
+        fprintf(stderr, "logger: failed to allocate async queue of %zu records, logging synchronously\n", n);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+        logger__async.slots[i].sequence = i;
+
+    logger__async.mask = n - 1;
+    logger__async.overflow = overflow;
+    logger__async.running = 1;
+
+    if (pthread_create(&logger__async.thread, NULL, logger__async_main, NULL) != 0) {
+        fprintf(stderr, "logger: failed to start async thread, logging synchronously\n");
+        free(logger__async.slots);
+        logger__async.slots = NULL;
+        return;
+    }
+
+    __atomic_store_n(&logger__async.enabled, 1, __ATOMIC_RELEASE);
+    logger__exit_hook();
+}
+
+// Hands the record to its sink, either inline or through the async queue.
+static inline void logger__dispatch(log_sink_t* sink, const log_record_t* record) {
+    if (__atomic_load_n(&logger__async.enabled, __ATOMIC_RELAXED) && !logger__is_async_thread && !(sink->flags & LOG_SINK_INLINE)) {
+        logger__async_push(sink, record);
+    } else {
+        logger__sink_write(sink, record);
+    }
+}
+
+
+
+// ---- Binary capture ----
+// Instead of formatting, a callsite only stores its ID (the address of its static
+// `log_callsite_t`), a timestamp, the logger name and its raw arguments. The callsite
+// itself (location, level, format and argument types) is described once, the first
+// time it is hit. The stream is in native byte order:
+//
+//   stream     := LOGGER_BINARY_MAGIC entry*
+//   entry      := 'D' u64 id, u8 level, u32 line, str file, str function, str format, u8 count, u8 types[count]
+//               | 'R' u32 size, u64 id, u64 timestamp_ns, str logger_name, arg*     (size counts the bytes after itself)
+//               | 'N' u64 id, u64 timestamp_ns, u32 count                      (the last record was repeated `count` times)
+//   str        := u16 length, u8 bytes[length]                 (length is LOGGER_BINARY_NULL_STRING for NULL)
+//   arg        := i32 | i64 | f64 | u64 pointer | str       (as given by the types of the callsite)
+//
+// Every thread encodes into its own buffer which is written out in one `write`
+// when full and on `log_flush`, so entries from different threads arrive out of
+// order. The decoder orders records by timestamp.
+//
+// With `.binary_dedup_ms` a record whose callsite and bytes (logger name and arguments)
+// equal those of the thread's previous record within the window is not stored; an 'N'
+// entry, stamped with the last of them, counts them once the run ends.
+
+#define LOGGER_BINARY_MAGIC         "LOGBIN1"   /* Written with its terminating '\0' */
+#define LOGGER_BINARY_BUFFER_SIZE   (64 * 1024)
+#define LOGGER_BINARY_MAX_STRING    1024        /* Longer string arguments are cut */
+#define LOGGER_BINARY_NULL_STRING   0xFFFF
+
+struct logger__binary_buffer {
+    int lock;
+    size_t used;
+    const log_callsite_t* last_site;    /* Of the last record stored, for `.binary_dedup_ms` */
+    uint64_t last_hash;
+    uint64_t last_ns;
+    uint64_t repeated_ns;
+    uint32_t repeated;
+    struct logger__binary_buffer* prev;
+    struct logger__binary_buffer* next;
+    char data[LOGGER_BINARY_BUFFER_SIZE];
+};
+
+int logger_binary_enabled = 0;
+static int logger__binary_fd = -1;
+static uint64_t logger__binary_dedup_ns = 0;
+static pthread_mutex_t logger__binary_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct logger__binary_buffer* logger__binary_registry = NULL;
+static pthread_key_t logger__binary_key;
+static THREAD_LOCAL struct logger__binary_buffer* logger__binary_local = NULL;
+
+
+#define LOGGER__PUT(p, value) do { __typeof__(value) _v = (value); memcpy(p, &_v, sizeof(_v)); p += sizeof(_v); } while (0)
+
+#define LOGGER__BINARY_REPEATS_SIZE (1 + 2 * sizeof(uint64_t) + sizeof(uint32_t))
+
+// Must hold the buffer's lock.
+static void logger__binary_write_out(struct logger__binary_buffer* b) {
+    if (b->used > 0) {
+        logger__write_all(logger__binary_fd, b->data, b->used);
+        b->used = 0;
+    }
+}
+
+// Ends a run of repeated records with an 'N' entry. Must hold the buffer's lock.
+static void logger__binary_put_repeats(struct logger__binary_buffer* b) {
+    if (b->repeated == 0)
+        return;
+    if (LOGGER_BINARY_BUFFER_SIZE - b->used < LOGGER__BINARY_REPEATS_SIZE)
+        logger__binary_write_out(b);
+
+    char* p = b->data + b->used;
+    *p++ = 'N';
+    LOGGER__PUT(p, (uint64_t) (uintptr_t) b->last_site);
+    LOGGER__PUT(p, b->repeated_ns);
+    LOGGER__PUT(p, b->repeated);
+    b->used = (size_t) (p - b->data);
+    b->repeated = 0;
+}
+
+static void logger__binary_thread_exit(void* data) {
+    struct logger__binary_buffer* b = data;
+
+    pthread_mutex_lock(&logger__binary_registry_lock);
+    if (b->prev) b->prev->next = b->next;
+    else         logger__binary_registry = b->next;
+    if (b->next) b->next->prev = b->prev;
+    pthread_mutex_unlock(&logger__binary_registry_lock);
+
+    logger__spin_lock(&b->lock);
+    logger__binary_put_repeats(b);
+    logger__binary_write_out(b);
+    logger__spin_unlock(&b->lock);
+    free(b);
+}
+
+static struct logger__binary_buffer* logger__binary_thread_buffer(void) {
+    struct logger__binary_buffer* b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+
+    pthread_mutex_lock(&logger__binary_registry_lock);
+    b->next = logger__binary_registry;
+    if (b->next)
+        b->next->prev = b;
+    logger__binary_registry = b;
+    pthread_mutex_unlock(&logger__binary_registry_lock);
+
+    pthread_setspecific(logger__binary_key, b);
+    logger__binary_local = b;
+    return b;
+}
+
+static void logger__binary_flush(void) {
+    if (!logger_binary_enabled)
+        return;
+
+    pthread_mutex_lock(&logger__binary_registry_lock);
+    for (struct logger__binary_buffer* b = logger__binary_registry; b; b = b->next) {
+        logger__spin_lock(&b->lock);
+        logger__binary_put_repeats(b);
+        logger__binary_write_out(b);
+        logger__spin_unlock(&b->lock);
+    }
+    pthread_mutex_unlock(&logger__binary_registry_lock);
+}
+
+static void logger__binary_start(int fd, int dedup_ms) {
+    if (pthread_key_create(&logger__binary_key, logger__binary_thread_exit) != 0) {
+        fprintf(stderr, "logger: failed to set up binary capture, logging as text\n");
+        return;
+    }
+    logger__binary_fd = fd;
+    logger__binary_dedup_ns = (dedup_ms > 0) ? (uint64_t) dedup_ms * 1000000u : 0;
+    logger__write_all(fd, LOGGER_BINARY_MAGIC, sizeof(LOGGER_BINARY_MAGIC));
+    logger_binary_enabled = 1;
+    logger__exit_hook();
+}
+
+
+static inline char* logger__binary_put_string(char* p, const char* str, size_t max) {
+    if (!str) {
+        LOGGER__PUT(p, (uint16_t) LOGGER_BINARY_NULL_STRING);
+        return p;
+    }
+    size_t len = strlen(str);
+    if (len > max)
+        len = max;
+    LOGGER__PUT(p, (uint16_t) len);
+    memcpy(p, str, len);
+    return p + len;
+}
+
+__attribute__((noinline, cold))
+static char* logger__binary_define(char* p, const log_callsite_t* callsite, const char* message) {
+    *p++ = 'D';
+    LOGGER__PUT(p, (uint64_t) (uintptr_t) callsite);
+    LOGGER__PUT(p, (uint8_t) callsite->level);
+    LOGGER__PUT(p, (uint32_t) callsite->location.line);
+    p = logger__binary_put_string(p, callsite->location.file,     LOGGER_BINARY_MAX_STRING);
+    p = logger__binary_put_string(p, callsite->location.function, LOGGER_BINARY_MAX_STRING);
+    p = logger__binary_put_string(p, message,                     LOGGER_BINARY_MAX_STRING);
+    LOGGER__PUT(p, (uint8_t) callsite->arg_count);
+    memcpy(p, callsite->arg_types, callsite->arg_count);
+    return p + callsite->arg_count;
+}
+
+static void logger__callsite_check_args(log_callsite_t* callsite, const char* format);
+
+void logger_binary_capture(log_callsite_t* callsite, const struct log_ctx_t* logger, const char* message, va_list args) {
+    logger__stats_count_emitted(callsite->level);
+    if (__builtin_expect(__atomic_load_n(&callsite->args_checked, __ATOMIC_ACQUIRE) != 2, 0))
+        logger__callsite_check_args(callsite, message);
+    struct logger__binary_buffer* b = logger__binary_local;
+    if (__builtin_expect(!b, 0)) {
+        b = logger__binary_thread_buffer();
+        if (!b)
+            return;
+    }
+
+    // Upper bound of a definition followed by a record, so strings never have to be measured twice.
+    size_t worst = 64 + 4 * (2 + LOGGER_BINARY_MAX_STRING) + callsite->arg_count * (2 + LOGGER_BINARY_MAX_STRING + 8) + LOGGER__BINARY_REPEATS_SIZE;
+
+    uint64_t now = logger__now();
+
+    logger__spin_lock(&b->lock);
+    if (LOGGER_BINARY_BUFFER_SIZE - b->used < worst)
+        logger__binary_write_out(b);
+
+    char* p = b->data + b->used;
+    if (!__atomic_load_n(&callsite->registered, __ATOMIC_RELAXED) && !__atomic_exchange_n(&callsite->registered, 1, __ATOMIC_ACQ_REL))
+        p = logger__binary_define(p, callsite, message);
+
+    *p++ = 'R';
+    char* size = p;
+    p += sizeof(uint32_t);
+    LOGGER__PUT(p, (uint64_t) (uintptr_t) callsite);
+    LOGGER__PUT(p, now);
+    char* content = p;
+    p = logger__binary_put_string(p, logger->name, LOGGER_BINARY_MAX_STRING);
+
+    for (int i = 1; i < callsite->arg_count; ++i) {
+        switch (callsite->arg_types[i]) {
+            case LOG_ARG_INT:           LOGGER__PUT(p, (int32_t)  va_arg(args, int));                      break;
+            case LOG_ARG_INT64:         LOGGER__PUT(p, (int64_t)  va_arg(args, long long));                break;
+            case LOG_ARG_DOUBLE:        LOGGER__PUT(p, (double)   va_arg(args, double));                   break;
+            case LOG_ARG_LONG_DOUBLE:   LOGGER__PUT(p, (double)   va_arg(args, long double));              break;
+            case LOG_ARG_POINTER:       LOGGER__PUT(p, (uint64_t) (uintptr_t) va_arg(args, void*));        break;
+            case LOG_ARG_STRING:        p = logger__binary_put_string(p, va_arg(args, const char*), LOGGER_BINARY_MAX_STRING); break;
+            default:                    break;
+        }
+    }
+
+    uint32_t record_size = (uint32_t) (p - size - sizeof(uint32_t));
+    memcpy(size, &record_size, sizeof(record_size));
+
+    if (logger__binary_dedup_ns) {
+        uint64_t hash = logger__hash(content, (size_t) (p - content), (uint64_t) (uintptr_t) callsite);
+        if (callsite == b->last_site && hash == b->last_hash && now - b->last_ns < logger__binary_dedup_ns) {
+            // Leave the encoded record beyond `used`, to be overwritten.
+            b->repeated += 1;
+            b->repeated_ns = now;
+            logger__spin_unlock(&b->lock);
+            return;
+        }
+        if (b->repeated) {
+            // The run ends after the new record so the record itself stays where it was encoded.
+            b->used = (size_t) (p - b->data);
+            logger__binary_put_repeats(b);
+            p = b->data + b->used;
+        }
+        b->last_site = callsite;
+        b->last_hash = hash;
+        b->last_ns = now;
+    }
+
+    b->used = (size_t) (p - b->data);
+    logger__spin_unlock(&b->lock);
+}
+
+
+static void logger__dedup_sinks_flush(void);
+
+void log_flush(void) {
+    logger__async_flush();
+    logger__binary_flush();
+    logger__dedup_sinks_flush();
+    logger__buffered_sinks_flush();
+    logger__uring_sinks_flush();
+    logger__compressed_sinks_flush();
+    logger__indexed_sinks_flush();
+}
+
+// At exit the async queue is drained and its thread stopped first, so what it still holds
+// reaches the sinks before they are flushed, in the order `log_flush` uses, and closed.
+static void logger__exit(void) {
+    logger__async_shutdown();
+    logger__binary_flush();
+    logger__dedup_sinks_flush();
+    logger__buffered_sinks_flush();
+    logger__uring_sinks_flush();
+    logger__compressed_sinks_flush();
+    logger__indexed_sinks_flush();
+    logger__mmap_sinks_close();
+}
+
+static void logger__exit_register(void) {
+    atexit(logger__exit);
+}
+
+// The logger has a single exit hook, registered by whatever first needs it.
+static void logger__exit_hook(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, logger__exit_register);
+}
+
+size_t log_async_dropped(void) {
+    return __atomic_load_n(&logger__async.dropped, __ATOMIC_RELAXED);
+}
+
+
+
+
+
+static void logger__crash_report(void);
+
+__attribute__((noinline, noreturn, cold))
+void terminate_with_backtrace(void) {
+    log_flush();
+    logger__crash_report();
+    abort();
+}
+
+// ---- Configuration ----
+// What `log_init` and `log_reconfigure` set is kept in an immutable snapshot that is replaced
+// as a whole. Readers take it with a single acquire load and, once they are out of the logger,
+// publish the version they used (quiescent state based reclamation). A replaced snapshot is
+// freed by a later writer once every thread has moved past it; threads that stop logging
+// only hold that up, they never make the writer wait. The level is a word of its own in
+// `log_default`, which the statements read directly.
+
+#define LOGGER__INHERIT_SINKS       ((1u << LOG_LEVEL_COUNT) - 1)
+#define LOGGER__INHERIT_FORMATTER   (1u << LOG_LEVEL_COUNT)
+#define LOGGER__INHERIT_ENCODER     (1u << (LOG_LEVEL_COUNT + 1))
+#define LOGGER__INHERIT_ROUTES      (1u << (LOG_LEVEL_COUNT + 2))
+#define LOGGER__INHERIT_ALL         (LOGGER__INHERIT_SINKS | LOGGER__INHERIT_FORMATTER | LOGGER__INHERIT_ENCODER | LOGGER__INHERIT_ROUTES)
+
+#define LOGGER__READER_UNUSED       UINT64_MAX
+
+struct logger__config {
+    uint64_t                version;
+    log_formatter_fn        formatter;
+    log_encoder_fn          encoder;
+    log_sink_t*             sinks[LOG_LEVEL_COUNT];
+    struct logger__config*  retired_next;   // Replaced, waiting for the readers to move past it
+    size_t                  route_count;
+    log_route_t             routes[];       // Copied in, so the caller's array may go away
+};
+
+// Never freed: a thread that exits leaves its entry to the next new thread.
+struct logger__config_reader {
+    __attribute__((aligned(LOGGER_CACHE_LINE))) uint64_t seen;     // Every snapshot this thread loads from now on is at least this version
+    struct logger__config_reader* next;
+};
+
+log_sink_t stdout_sink = { fd_sink_write, (void*) (uintptr_t) STDOUT_FILENO, 0, "stdout" };
+log_sink_t stderr_sink = { fd_sink_write, (void*) (uintptr_t) STDERR_FILENO, 0, "stderr" };
+
+// What a program that never calls `log_init` gets.
+static struct logger__config logger__config_defaults = {
+        .version   = 1,
+        .formatter = default_formatter,
+        .encoder   = NULL,
+        .sinks     = {
+            [LOG_TRACE] = &stdout_sink,
+            [LOG_DEBUG] = &stdout_sink,
+            [LOG_INFO]  = &stdout_sink,
+            [LOG_WARN]  = &stderr_sink,
+            [LOG_ERROR] = &stderr_sink,
+            [LOG_PANIC] = &stderr_sink,
+        },
+        .retired_next = NULL,
+        .route_count  = 0,
+};
+
+static struct logger__config* logger__config = &logger__config_defaults;
+static struct logger__config* logger__config_initial = &logger__config_defaults;   // What `.reset` goes back to
+static log_level_t logger__config_initial_level = LOG_INFO;
+static struct logger__config* logger__config_retired;
+static int logger__config_pinned;                   // A reader couldn't register, so nothing is freed anymore
+static pthread_mutex_t logger__config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct logger__config_reader* logger__config_readers;
+static pthread_key_t logger__config_reader_key;
+static pthread_once_t logger__config_reader_once = PTHREAD_ONCE_INIT;
+static THREAD_LOCAL struct logger__config_reader* logger__config_reader_local;
+static THREAD_LOCAL int logger__config_depth;       // Nested uses, e.g. logging from a sink or a signal handler
+
+static void logger__config_reader_exit(void* data) {
+    struct logger__config_reader* r = data;
+    logger__config_reader_local = NULL;
+    __atomic_store_n(&r->seen, LOGGER__READER_UNUSED, __ATOMIC_RELEASE);
+}
+
+static void logger__config_reader_key_create(void) {
+    pthread_key_create(&logger__config_reader_key, logger__config_reader_exit);
+}
+
+// Must happen before the thread's first load, which the sequentially consistent CAS orders
+// against the store in `logger__config_publish`.
+__attribute__((noinline, cold))
+static void logger__config_reader_register(void) {
+    pthread_once(&logger__config_reader_once, logger__config_reader_key_create);
+
+    struct logger__config_reader* r;
+    for (r = __atomic_load_n(&logger__config_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t unused = LOGGER__READER_UNUSED;
+        if (__atomic_load_n(&r->seen, __ATOMIC_RELAXED) == unused && __atomic_compare_exchange_n(&r->seen, &unused, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!r) {
+        void* memory = NULL;
+        if (posix_memalign(&memory, LOGGER_CACHE_LINE, sizeof(*r)) != 0) {
+            __atomic_store_n(&logger__config_pinned, 1, __ATOMIC_SEQ_CST);
+            return;
+        }
+        r = memory;
+        r->seen = 0;
+        r->next = __atomic_load_n(&logger__config_readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&logger__config_readers, &r->next, r, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(logger__config_reader_key, r);
+    logger__config_reader_local = r;
+}
+
+// The snapshot stays valid until the matching `logger__config_exit`.
+static inline const struct logger__config* logger__config_enter(void) {
+    if (__builtin_expect(!logger__config_reader_local, 0))
+        logger__config_reader_register();
+    logger__config_depth += 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&logger__config, __ATOMIC_ACQUIRE);
+}
+
+static inline void logger__config_exit(const struct logger__config* config) {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    struct logger__config_reader* r = logger__config_reader_local;
+    if (logger__config_depth == 1 && r)
+        __atomic_store_n(&r->seen, config->version, __ATOMIC_RELEASE);
+    logger__config_depth -= 1;
+}
+
+// Must hold `logger__config_lock`.
+static void logger__config_reclaim(void) {
+    if (__atomic_load_n(&logger__config_pinned, __ATOMIC_SEQ_CST))
+        return;
+
+    uint64_t oldest = LOGGER__READER_UNUSED;
+    for (struct logger__config_reader* r = __atomic_load_n(&logger__config_readers, __ATOMIC_SEQ_CST); r; r = r->next) {
+        uint64_t seen = __atomic_load_n(&r->seen, __ATOMIC_ACQUIRE);
+        if (seen < oldest)
+            oldest = seen;
+    }
+
+    struct logger__config** link = &logger__config_retired;
+    while (*link) {
+        struct logger__config* config = *link;
+        if (config->version < oldest) {
+            *link = config->retired_next;
+            free(config);
+        } else {
+            link = &config->retired_next;
+        }
+    }
+}
+
+// Must hold `logger__config_lock`.
+static void logger__config_publish(struct logger__config* next) {
+    struct logger__config* previous = __atomic_load_n(&logger__config, __ATOMIC_RELAXED);
+    next->version = previous->version + 1;
+    next->retired_next = NULL;
+    __atomic_store_n(&logger__config, next, __ATOMIC_SEQ_CST);
+
+    if (previous != &logger__config_defaults) {
+        previous->retired_next = logger__config_retired;
+        logger__config_retired = previous;
+    }
+    logger__config_reclaim();
+}
+
+
+// INVARIANT: log_current is never NULL. Do not assign to it directly.
+static struct log_ctx_t log_default = {
+        .name = "",
+        .level = LOG_INFO,
+        .formatter = NULL,
+        .encoder = NULL,
+        .sinks = { 0 },
+        .parent = NULL,
+        .declaration_location = { 0 },
+        .config_version = 0,
+        .inherited = LOGGER__INHERIT_ALL,
+};
+THREAD_LOCAL struct log_ctx_t* log_current = &log_default;
+
+
+static inline log_level_t get_global_log_level(void) {
+    return __atomic_load_n(&log_default.level, __ATOMIC_RELAXED);
+}
+
+static inline log_formatter_fn get_global_log_formatter(void) {
+    const struct logger__config* config = logger__config_enter();
+    log_formatter_fn formatter = config->formatter;
+    logger__config_exit(config);
+    return formatter;
+}
+
+static inline log_sink_t* get_global_sink(log_level_t level) {
+    const struct logger__config* config = logger__config_enter();
+    log_sink_t* sink = config->sinks[level];
+    logger__config_exit(config);
+    return sink;
+}
+
+void log_set_level(log_level_t level) {
+    __atomic_store_n(&log_default.level, (level == LOG_DEFAULT) ? LOG_INFO : level, __ATOMIC_RELAXED);
+}
+
+void log_reconfigure_from_args(log_config_args_t args) {
+    pthread_mutex_lock(&logger__config_lock);
+    const struct logger__config* base = args.reset ? logger__config_initial : __atomic_load_n(&logger__config, __ATOMIC_RELAXED);
+    size_t route_count = args.route_count ? args.route_count : base->route_count;
+    if (route_count > LOG_MAX_ROUTES)
+        route_count = LOG_MAX_ROUTES;
+
+    struct logger__config* next = malloc(sizeof(*next) + route_count * sizeof(log_route_t));
+    if (!next) {
+        pthread_mutex_unlock(&logger__config_lock);
+        return;
+    }
+    next->formatter = args.formatter ? args.formatter : base->formatter;
+    next->encoder   = args.encoder   ? args.encoder   : base->encoder;
+    for (int i = 0; i < LOG_LEVEL_COUNT; ++i)
+        next->sinks[i] = args.sinks[i] ? args.sinks[i] : args.route_count ? NULL : base->sinks[i];
+    next->route_count = route_count;
+    if (route_count)
+        memcpy(next->routes, args.route_count ? args.routes : base->routes, route_count * sizeof(log_route_t));
+    logger__config_publish(next);
+
+    if (args.level != LOG_DEFAULT)
+        log_set_level(args.level);
+    else if (args.reset)
+        log_set_level(logger__config_initial_level);
+    pthread_mutex_unlock(&logger__config_lock);
+}
+
+// Keeps the configuration `log_init` set up for `log_reconfigure(.reset = 1)`. Never freed.
+static void logger__config_keep_initial(void) {
+    pthread_mutex_lock(&logger__config_lock);
+    const struct logger__config* current = __atomic_load_n(&logger__config, __ATOMIC_RELAXED);
+    size_t size = sizeof(*current) + current->route_count * sizeof(log_route_t);
+    struct logger__config* initial = malloc(size);
+    if (initial) {
+        memcpy(initial, current, size);
+        initial->retired_next = NULL;
+        logger__config_initial = initial;
+    }
+    logger__config_initial_level = get_global_log_level();
+    pthread_mutex_unlock(&logger__config_lock);
+}
+
+
+// Fills in what the scope doesn't set, so records logged through it don't have to.
+void logger_push(struct log_ctx_t* log, source_location_t location) {
+    log->parent = log_current;
+    log->level  = (log->level == LOG_DEFAULT) ? get_global_log_level() : log->level;
+
+    const struct logger__config* config = logger__config_enter();
+    log->inherited = 0;
+    if (!log->formatter) {
+        log->formatter = config->formatter;
+        log->inherited |= LOGGER__INHERIT_FORMATTER;
+    }
+    if (!log->encoder) {
+        log->encoder = config->encoder;
+        log->inherited |= LOGGER__INHERIT_ENCODER;
+    }
+    // A scope with routes of its own doesn't take the global sinks. Inherited routes point into
+    // the snapshot, which may go away; they are only used while its version is current.
+    if (!log->route_count) {
+        log->routes = config->routes;
+        log->route_count = config->route_count;
+        log->inherited |= LOGGER__INHERIT_ROUTES;
+        for (int i = 0; i < LOG_LEVEL_COUNT; ++i) {
+            if (!log->sinks[i]) {
+                log->sinks[i] = config->sinks[i];
+                log->inherited |= 1u << i;
+            }
+        }
+    } else if (log->route_count > LOG_MAX_ROUTES) {
+        log->route_count = LOG_MAX_ROUTES;
+    }
+    log->config_version = config->version;
+    logger__config_exit(config);
+
+    log_current = log;
+    source_location_t loc = log->declaration_location;
+    trace_loc(location, "Pushed log declared at %s:%d", loc.file, loc.line);
+}
+
+void logger_pop(struct log_ctx_t* log, source_location_t location) {
+    if (log_current != log) {
+        panic_loc(location, "Cannot pop log!");
+    }
+
+    source_location_t loc = log->declaration_location;
+    trace_loc(location, "Popped log declared at %s:%d", loc.file, loc.line);
+
+    log_current = log_current->parent;
+
+    // Sinks set on a scope usually live on the caller's stack; make sure nothing queued still refers to them.
+    int own_sinks = !(log->inherited & LOGGER__INHERIT_ROUTES);
+    for (int i = 0; i < LOG_LEVEL_COUNT; ++i)
+        own_sinks |= log->sinks[i] && !(log->inherited & (1u << i));
+    if (own_sinks)
+        log_flush();
+
+    if (log->inherited & LOGGER__INHERIT_FORMATTER)
+        log->formatter = NULL;
+    if (log->inherited & LOGGER__INHERIT_ENCODER)
+        log->encoder = NULL;
+    if (log->inherited & LOGGER__INHERIT_ROUTES) {
+        log->routes = NULL;
+        log->route_count = 0;
+    }
+    for (int i = 0; i < LOG_LEVEL_COUNT; ++i) {
+        if (log->inherited & (1u << i))
+            log->sinks[i] = NULL;
+    }
+
+    log->name = "";
+    log->level = LOG_DEFAULT;
+    log->parent = NULL;
+    log->declaration_location = no_source_location();
+    log->config_version = 0;
+    log->inherited = 0;
+}
+
+void logger_assert_log(const struct log_ctx_t* logger, source_location_t source_location, const char* condition, const char* message, ...) {
+    if (!message || message[0] == '\0') {
+        logger_log(logger, LOG_PANIC, source_location, "'%s' failed.", condition);
+        return;
+    }
+
+    // Measured first; an assertion is about to end the process, so the allocation doesn't matter.
+    va_list args;
+    va_start(args, message);
+    int len = log_vformat(NULL, 0, message, args);
+    va_end(args);
+    if (len < 0)
+        len = 0;
+
+    char* details = malloc((size_t) len + 1);
+    if (details) {
+        va_start(args, message);
+        log_vformat(details, len + 1, message, args);
+        va_end(args);
+    }
+
+    logger_log(logger, LOG_PANIC, source_location, "'%s' failed. %s", condition, details ? details : "");
+    free(details);
+}
+
+
+static const char* LOG_LEVEL_NAMES[LOG_LEVEL_COUNT] = {
+        [LOG_DEFAULT] = "default",
+        [LOG_TRACE]   = "trace",
+        [LOG_DEBUG]   = "debug",
+        [LOG_INFO]    = "info",
+        [LOG_WARN]    = "warn",
+        [LOG_ERROR]   = "error",
+        [LOG_PANIC]   = "panic",
+};
+
+const char* log_level_name(log_level_t level) {
+    return LOG_LEVEL_NAMES[level];
+}
+
+
+
+// ---- Formatting ----
+// A printf replacement for the subset log statements use. Literal formats are parsed once
+// and the parsed form is cached by the address of the format string; any other format may
+// change at the same address, so it is parsed every time. Conversions the fast
+// path doesn't cover (unusual flags, %e, %g, ...) are handed to snprintf one at a time,
+// so the output is always what vsnprintf would have produced.
+
+enum {
+    LOGGER__FMT_LEFT   = 1,     // '-'
+    LOGGER__FMT_ZERO   = 2,     // '0'
+    LOGGER__FMT_SLOW   = 4,     // Render with snprintf
+};
+
+enum { LOGGER__LEN_NONE, LOGGER__LEN_HH, LOGGER__LEN_H, LOGGER__LEN_L, LOGGER__LEN_LL, LOGGER__LEN_Z, LOGGER__LEN_J, LOGGER__LEN_T, LOGGER__LEN_BIG_L };
+
+#define LOGGER__FMT_STAR   (-2)
+#define LOGGER__FMT_UNSET  (-1)
+#define LOGGER__FMT_MAX_SPECS 32
+#define LOGGER__FMT_CACHE_SIZE 1024
+
+struct logger__fmt_spec {
+    unsigned short literal_len;     // Literal text right before the conversion
+    unsigned short spec_len;        // Length of the conversion text, e.g. 5 for "%-8ld"
+    unsigned       literal_start;
+    int            width;
+    int            precision;
+    unsigned char  flags;
+    unsigned char  length;
+    char           conversion;      // '\0' for the trailing literal
+};
+
+struct logger__fmt {
+    const char* format;
+    int count;
+    struct logger__fmt_spec specs[];
+};
+
+static struct logger__fmt* logger__fmt_cache[LOGGER__FMT_CACHE_SIZE];
+THREAD_LOCAL const char* logger_literal_format;
+
+// Returns the number of specs, or -1 when the format has to go to vsnprintf whole.
+static int logger__fmt_parse(const char* format, struct logger__fmt_spec* specs) {
+    int count = 0;
+    const char* literal = format;
+    const char* f = format;
+
+    for (;;) {
+        while (*f && *f != '%')
+            ++f;
+        if (*f == '%' && f[1] == '%') {
+            // Split the literal so "%%" becomes a plain '%'.
+            if (count + 1 >= LOGGER__FMT_MAX_SPECS) return -1;
+            specs[count++] = (struct logger__fmt_spec) { (unsigned short) (f + 1 - literal), 0, (unsigned) (literal - format), 0, 0, 0, 0, '%' };
+            f += 2;
+            literal = f;
+            continue;
+        }
+        if (count + 1 >= LOGGER__FMT_MAX_SPECS || f - literal > 0xFFFF) return -1;
+
+        struct logger__fmt_spec* spec = &specs[count++];
+        *spec = (struct logger__fmt_spec) { (unsigned short) (f - literal), 0, (unsigned) (literal - format), LOGGER__FMT_UNSET, LOGGER__FMT_UNSET, 0, LOGGER__LEN_NONE, '\0' };
+        if (!*f)
+            return count;
+
+        const char* start = f++;
+        for (;; ++f) {
+            if      (*f == '-') spec->flags |= LOGGER__FMT_LEFT;
+            else if (*f == '0') spec->flags |= LOGGER__FMT_ZERO;
+            else if (*f == '+' || *f == ' ' || *f == '#' || *f == '\'') spec->flags |= LOGGER__FMT_SLOW;
+            else break;
+        }
+        if (*f == '*') {
+            spec->width = LOGGER__FMT_STAR;
+            ++f;
+        } else if (*f >= '1' && *f <= '9') {
+            spec->width = 0;
+            while (*f >= '0' && *f <= '9' && spec->width < 100000)
+                spec->width = spec->width * 10 + (*f++ - '0');
+        }
+        if (*f == '.') {
+            ++f;
+            if (*f == '*') {
+                spec->precision = LOGGER__FMT_STAR;
+                ++f;
+            } else {
+                spec->precision = 0;
+                while (*f >= '0' && *f <= '9' && spec->precision < 100000)
+                    spec->precision = spec->precision * 10 + (*f++ - '0');
+            }
+        }
+        switch (*f) {
+            case 'h': ++f; if (*f == 'h') { ++f; spec->length = LOGGER__LEN_HH; } else { spec->length = LOGGER__LEN_H; } break;
+            case 'l': ++f; if (*f == 'l') { ++f; spec->length = LOGGER__LEN_LL; } else { spec->length = LOGGER__LEN_L; } break;
+            case 'q': ++f; spec->length = LOGGER__LEN_LL;    break;
+            case 'z': ++f; spec->length = LOGGER__LEN_Z;     break;
+            case 'j': ++f; spec->length = LOGGER__LEN_J;     break;
+            case 't': ++f; spec->length = LOGGER__LEN_T;     break;
+            case 'L': ++f; spec->length = LOGGER__LEN_BIG_L; break;
+            default: break;
+        }
+
+        switch (*f) {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'c': case 's': case 'p':
+                break;
+            case 'f': case 'F':
+                if (spec->length == LOGGER__LEN_BIG_L) spec->flags |= LOGGER__FMT_SLOW;
+                break;
+            case 'o': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                spec->flags |= LOGGER__FMT_SLOW;
+                break;
+            default:
+                return -1;  // %n, %ls, positional arguments and malformed formats.
+        }
+        // Integer precision and wide characters are rare enough to leave to snprintf.
+        if (*f == 'c' && spec->length != LOGGER__LEN_NONE) return -1;
+        if (*f == 's' && spec->length != LOGGER__LEN_NONE) return -1;
+        if (spec->precision != LOGGER__FMT_UNSET && strchr("diuxXp", *f)) spec->flags |= LOGGER__FMT_SLOW;
+
+        spec->conversion = *f++;
+        spec->spec_len = (unsigned short) (f - start);
+        literal = f;
+    }
+}
+
+static const struct logger__fmt* logger__fmt_lookup(const char* format) {
+    size_t hash = ((uintptr_t) format >> 3) * 0x9E3779B97F4A7C15ull;
+    size_t mask = LOGGER__FMT_CACHE_SIZE - 1;
+    size_t i = (hash >> 20) & mask;
+
+    for (size_t probe = 0; probe < 8; ++probe, i = (i + 1) & mask) {
+        struct logger__fmt* entry = __atomic_load_n(&logger__fmt_cache[i], __ATOMIC_ACQUIRE);
+        if (entry && entry->format == format)
+            return entry;
+        if (entry)
+            continue;
+
+        struct logger__fmt_spec specs[LOGGER__FMT_MAX_SPECS];
+        int count = logger__fmt_parse(format, specs);
+        struct logger__fmt* parsed = malloc(sizeof(*parsed) + (size_t) (count > 0 ? count : 0) * sizeof(specs[0]));
+        if (!parsed)
+            return NULL;
+        parsed->format = format;
+        parsed->count  = count;
+        if (count > 0)
+            memcpy(parsed->specs, specs, (size_t) count * sizeof(specs[0]));
+
+        struct logger__fmt* expected = NULL;
+        if (__atomic_compare_exchange_n(&logger__fmt_cache[i], &expected, parsed, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return parsed;
+        free(parsed);
+        if (expected->format == format)
+            return expected;
+    }
+    return NULL;    // Neighbourhood is full; the caller uses vsnprintf.
+}
+
+// The argument types come from the C types, so a `char*` printed with %p would be captured
+// as a string, read up to a terminator it may not have, and an `unsigned char*` or `void*`
+// printed with %s as an address, meaningless to the decoder. Done once per call site, before
+// its arguments are first captured, by the binary capture or the flight recorder; other
+// threads wait the few hundred nanoseconds it takes. Formats the parser turns down stay as
+// they are, and %ls keeps its pointer: its text isn't a `char` string.
+__attribute__((noinline, cold))
+static void logger__callsite_check_args(log_callsite_t* callsite, const char* format) {
+    unsigned char expected = 0;
+    if (!__atomic_compare_exchange_n(&callsite->args_checked, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&callsite->args_checked, __ATOMIC_ACQUIRE) != 2)
+            sched_yield();
+        return;
+    }
+
+    struct logger__fmt_spec specs[LOGGER__FMT_MAX_SPECS];
+    int count = logger__fmt_parse(format, specs);
+    int arg = 1;
+    for (int i = 0; i < count && arg < callsite->arg_count; ++i) {
+        char c = specs[i].conversion;
+        if (c == '\0' || c == '%')
+            continue;
+        arg += (specs[i].width == LOGGER__FMT_STAR) + (specs[i].precision == LOGGER__FMT_STAR);
+        unsigned char* type = (arg < callsite->arg_count) ? &callsite->arg_types[arg] : NULL;
+        if (type && c != 's' && *type == LOG_ARG_STRING)
+            *type = LOG_ARG_POINTER;
+        else if (type && c == 's' && specs[i].length == LOGGER__LEN_NONE && *type == LOG_ARG_POINTER)
+            *type = LOG_ARG_STRING;
+        arg += 1;
+    }
+    __atomic_store_n(&callsite->args_checked, 2, __ATOMIC_RELEASE);
+}
+
+
+// Like snprintf: writes what fits, always terminates, and counts what it would have written.
+struct logger__out {
+    char*  p;
+    size_t left;     // Excluding the terminator
+    size_t total;
+};
+
+static inline void logger__out_put(struct logger__out* out, const char* s, size_t n) {
+    size_t fit = (n < out->left) ? n : out->left;
+    if (fit)
+        memcpy(out->p, s, fit);
+    out->p += fit;
+    out->left -= fit;
+    out->total += n;
+}
+
+static inline void logger__out_fill(struct logger__out* out, char ch, size_t n) {
+    size_t fit = (n < out->left) ? n : out->left;
+    if (fit)
+        memset(out->p, ch, fit);
+    out->p += fit;
+    out->left -= fit;
+    out->total += n;
+}
+
+static void logger__out_padded(struct logger__out* out, const char* s, size_t n, int width, int flags) {
+    size_t pad = (width > 0 && (size_t) width > n) ? (size_t) width - n : 0;
+    if (!(flags & LOGGER__FMT_LEFT)) logger__out_fill(out, ' ', pad);
+    logger__out_put(out, s, n);
+    if (flags & LOGGER__FMT_LEFT)    logger__out_fill(out, ' ', pad);
+}
+
+static const char logger__digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes `value` right aligned ending at `end` and returns the first digit.
+static inline char* logger__utoa(char* end, unsigned long long value) {
+    while (value >= 100) {
+        unsigned pair = (unsigned) (value % 100) * 2;
+        value /= 100;
+        *--end = logger__digit_pairs[pair + 1];
+        *--end = logger__digit_pairs[pair];
+    }
+    if (value >= 10) {
+        unsigned pair = (unsigned) value * 2;
+        *--end = logger__digit_pairs[pair + 1];
+        *--end = logger__digit_pairs[pair];
+    } else {
+        *--end = (char) ('0' + value);
+    }
+    return end;
+}
+
+static inline char* logger__xtoa(char* end, unsigned long long value, int upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = digits[value & 0xF];
+        value >>= 4;
+    } while (value);
+    return end;
+}
+
+static void logger__out_number(struct logger__out* out, int negative, const char* digits, size_t n, int width, int flags) {
+    size_t len = n + (negative ? 1 : 0);
+    if ((flags & LOGGER__FMT_ZERO) && !(flags & LOGGER__FMT_LEFT) && width > 0 && (size_t) width > len) {
+        if (negative) logger__out_put(out, "-", 1);
+        logger__out_fill(out, '0', (size_t) width - len);
+        logger__out_put(out, digits, n);
+        return;
+    }
+    if (negative) {
+        char tmp[32];
+        tmp[0] = '-';
+        memcpy(tmp + 1, digits, n);
+        logger__out_padded(out, tmp, n + 1, width, flags);
+    } else {
+        logger__out_padded(out, digits, n, width, flags);
+    }
+}
+
+// Fixed notation for values where `value * 10^precision` is exact enough to round like
+// printf does. Returns 0 when the caller should fall back to snprintf. With `approximate`
+// near ties are rounded up instead, which may differ from printf in the last digit.
+static int logger__out_fixed(struct logger__out* out, double value, int precision, int width, int flags, int approximate) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    if (precision > 9 || !(value == value) || __builtin_isinf(value))
+        return 0;
+
+    int negative = __builtin_signbit(value) != 0;
+    double magnitude = negative ? -value : value;
+    double scaled = magnitude * powers[precision];
+    if (scaled >= 9.0e15)
+        return 0;
+
+    unsigned long long whole = (unsigned long long) scaled;
+    double fraction = scaled - (double) whole;
+    // Too close to a tie for the rounding error of the multiplication to be ruled out.
+    if (!approximate && fraction > 0.5 - 1e-6 && fraction < 0.5 + 1e-6)
+        return 0;
+    if (fraction >= 0.5)
+        whole += 1;
+
+    char buffer[48];
+    char* end = buffer + sizeof(buffer);
+    char* p = end;
+    unsigned long long unit = (unsigned long long) powers[precision];
+    if (precision > 0) {
+        char* fraction_end = p;
+        p = logger__utoa(p, whole % unit);
+        while (fraction_end - p < precision)
+            *--p = '0';
+        *--p = '.';
+    }
+    p = logger__utoa(p, whole / unit);
+
+    logger__out_number(out, negative, p, (size_t) (end - p), width, flags);
+    return 1;
+}
+
+// Renders one conversion with snprintf, using the conversion's own text from the format.
+static void logger__out_slow(struct logger__out* out, const char* format, const struct logger__fmt_spec* spec, int width, int precision, va_list* args) {
+    char fmt[64];
+    size_t n = 0;
+    fmt[n++] = '%';
+    if (spec->flags & LOGGER__FMT_LEFT) fmt[n++] = '-';
+    if (spec->flags & LOGGER__FMT_ZERO) fmt[n++] = '0';
+    for (const char* f = format + 1; n < 8 && (*f == '+' || *f == ' ' || *f == '#' || *f == '\'' || *f == '-' || *f == '0'); ++f)
+        if (*f != '-' && *f != '0') fmt[n++] = *f;
+    n += (size_t) snprintf(fmt + n, sizeof(fmt) - n, (width >= 0) ? "%d" : "", width);
+    if (precision >= 0)
+        n += (size_t) snprintf(fmt + n, sizeof(fmt) - n, ".%d", precision);
+    static const char* lengths[] = { "", "hh", "h", "l", "ll", "z", "j", "t", "L" };
+    n += (size_t) snprintf(fmt + n, sizeof(fmt) - n, "%s%c", lengths[spec->length], spec->conversion);
+
+    char small[128];
+    int len;
+    char c = spec->conversion;
+    #define LOGGER__SLOW(type) do {                                                     \
+        type _v = va_arg(*args, type);                                                  \
+        len = snprintf(small, sizeof(small), fmt, _v);                                  \
+        if (len >= (int) sizeof(small)) {                                               \
+            char* big = malloc((size_t) len + 1);                                       \
+            if (big) { snprintf(big, (size_t) len + 1, fmt, _v); logger__out_put(out, big, (size_t) len); free(big); } \
+            return;                                                                     \
+        }                                                                               \
+    } while (0)
+
+    if (c == 's')                                           LOGGER__SLOW(const char*);
+    else if (c == 'p')                                      LOGGER__SLOW(void*);
+    else if (strchr("fFeEgGaA", c))                         { if (spec->length == LOGGER__LEN_BIG_L) LOGGER__SLOW(long double); else LOGGER__SLOW(double); }
+    else if (spec->length == LOGGER__LEN_L)                 LOGGER__SLOW(long);
+    else if (spec->length == LOGGER__LEN_LL)                LOGGER__SLOW(long long);
+    else if (spec->length == LOGGER__LEN_Z)                 LOGGER__SLOW(size_t);
+    else if (spec->length == LOGGER__LEN_J)                 LOGGER__SLOW(intmax_t);
+    else if (spec->length == LOGGER__LEN_T)                 LOGGER__SLOW(ptrdiff_t);
+    else                                                    LOGGER__SLOW(int);
+    #undef LOGGER__SLOW
+
+    if (len > 0)
+        logger__out_put(out, small, (size_t) len);
+}
+
+static void logger__out_format(struct logger__out* out, const char* format, const struct logger__fmt_spec* specs, int count, va_list* args) {
+    for (int i = 0; i < count; ++i) {
+        const struct logger__fmt_spec* spec = &specs[i];
+        logger__out_put(out, format + spec->literal_start, spec->literal_len);
+
+        char c = spec->conversion;
+        if (c == '\0' || c == '%')
+            continue;
+
+        const char* text = format + spec->literal_start + spec->literal_len;
+        int flags = spec->flags;
+        int width = spec->width;
+        if (width == LOGGER__FMT_STAR) {
+            width = va_arg(*args, int);
+            if (width < 0) {
+                flags |= LOGGER__FMT_LEFT;
+                width = -width;
+            }
+        }
+        int precision = spec->precision;
+        if (precision == LOGGER__FMT_STAR) {
+            precision = va_arg(*args, int);
+            if (precision < 0)
+                precision = LOGGER__FMT_UNSET;
+        }
+
+        if (flags & LOGGER__FMT_SLOW) {
+            logger__out_slow(out, text, spec, width, precision, args);
+            continue;
+        }
+
+        char buffer[32];
+        char* end = buffer + sizeof(buffer);
+        switch (c) {
+            case 'd': case 'i': {
+                long long value;
+                switch (spec->length) {
+                    case LOGGER__LEN_HH: value = (signed char) va_arg(*args, int);  break;
+                    case LOGGER__LEN_H:  value = (short) va_arg(*args, int);        break;
+                    case LOGGER__LEN_L:  value = va_arg(*args, long);               break;
+                    case LOGGER__LEN_LL: value = va_arg(*args, long long);          break;
+                    case LOGGER__LEN_Z:  value = (long long) va_arg(*args, size_t); break;
+                    case LOGGER__LEN_J:  value = va_arg(*args, intmax_t);           break;
+                    case LOGGER__LEN_T:  value = va_arg(*args, ptrdiff_t);          break;
+                    default:             value = va_arg(*args, int);                break;
+                }
+                unsigned long long magnitude = (value < 0) ? 0ull - (unsigned long long) value : (unsigned long long) value;
+                char* p = logger__utoa(end, magnitude);
+                logger__out_number(out, value < 0, p, (size_t) (end - p), width, flags);
+            } break;
+
+            case 'u': case 'x': case 'X': {
+                unsigned long long value;
+                switch (spec->length) {
+                    case LOGGER__LEN_HH: value = (unsigned char) va_arg(*args, unsigned);   break;
+                    case LOGGER__LEN_H:  value = (unsigned short) va_arg(*args, unsigned);  break;
+                    case LOGGER__LEN_L:  value = va_arg(*args, unsigned long);              break;
+                    case LOGGER__LEN_LL: value = va_arg(*args, unsigned long long);         break;
+                    case LOGGER__LEN_Z:  value = va_arg(*args, size_t);                     break;
+                    case LOGGER__LEN_J:  value = va_arg(*args, uintmax_t);                  break;
+                    case LOGGER__LEN_T:  value = (unsigned long long) va_arg(*args, ptrdiff_t); break;
+                    default:             value = va_arg(*args, unsigned);                   break;
+                }
+                char* p = (c == 'u') ? logger__utoa(end, value) : logger__xtoa(end, value, c == 'X');
+                logger__out_number(out, 0, p, (size_t) (end - p), width, flags);
+            } break;
+
+            case 'p': {
+                void* value = va_arg(*args, void*);
+                if (!value) {
+                    logger__out_padded(out, "(nil)", 5, width, flags & ~LOGGER__FMT_ZERO);
+                } else {
+                    char* p = logger__xtoa(end, (uintptr_t) value, 0);
+                    *--p = 'x';
+                    *--p = '0';
+                    logger__out_padded(out, p, (size_t) (end - p), width, flags & ~LOGGER__FMT_ZERO);
+                }
+            } break;
+
+            case 'c': {
+                char ch = (char) va_arg(*args, int);
+                logger__out_padded(out, &ch, 1, width, flags);
+            } break;
+
+            case 's': {
+                const char* value = va_arg(*args, const char*);
+                if (!value) {
+                    // glibc prints "(null)", but only if the precision leaves room for it.
+                    if (precision >= 0 && precision < 6) logger__out_padded(out, "", 0, width, flags);
+                    else                                 logger__out_padded(out, "(null)", 6, width, flags);
+                    break;
+                }
+                size_t len = (precision >= 0) ? strnlen(value, (size_t) precision) : strlen(value);
+                logger__out_padded(out, value, len, width, flags);
+            } break;
+
+            case 'f': case 'F': {
+                double value = va_arg(*args, double);
+                if (!logger__out_fixed(out, value, (precision >= 0) ? precision : 6, width, flags, 0)) {
+                    int len = snprintf(buffer, sizeof(buffer), (c == 'f') ? "%*.*f" : "%*.*F", (flags & LOGGER__FMT_LEFT) ? -width : width, (precision >= 0) ? precision : 6, value);
+                    if (len >= (int) sizeof(buffer) || (flags & LOGGER__FMT_ZERO)) {
+                        // Rare: huge values, or zero padding; redo it exactly with the original spec.
+                        char fmt[32];
+                        snprintf(fmt, sizeof(fmt), "%%%s%s*.*%c", (flags & LOGGER__FMT_LEFT) ? "-" : "", (flags & LOGGER__FMT_ZERO) ? "0" : "", c);
+                        len = snprintf(NULL, 0, fmt, width, (precision >= 0) ? precision : 6, value);
+                        char* big = malloc((size_t) len + 1);
+                        if (big) {
+                            snprintf(big, (size_t) len + 1, fmt, width, (precision >= 0) ? precision : 6, value);
+                            logger__out_put(out, big, (size_t) len);
+                            free(big);
+                        }
+                    } else if (len > 0) {
+                        logger__out_put(out, buffer, (size_t) len);
+                    }
+                }
+            } break;
+
+            default:
+                break;
+        }
+    }
+}
+
+int log_vformat(char* buffer, int size, const char* format, va_list args) {
+    struct logger__fmt_spec local[LOGGER__FMT_MAX_SPECS];
+    const struct logger__fmt_spec* specs = local;
+    int count;
+    const struct logger__fmt* parsed;
+    if (format == logger_literal_format && (parsed = logger__fmt_lookup(format))) {
+        specs = parsed->specs;
+        count = parsed->count;
+    } else {
+        count = logger__fmt_parse(format, local);
+    }
+    if (count < 0)
+        return vsnprintf(buffer, (size_t) (size > 0 ? size : 0), format, args);
+
+    struct logger__out out = { buffer, (size > 0) ? (size_t) size - 1 : 0, 0 };
+    va_list ap;
+    va_copy(ap, args);
+    logger__out_format(&out, format, specs, count, &ap);
+    va_end(ap);
+
+    if (size > 0)
+        *out.p = '\0';
+    return (int) out.total;
+}
+
+int log_format(char* buffer, int size, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = log_vformat(buffer, size, format, args);
+    va_end(args);
+    return len;
+}
+
+
+static THREAD_LOCAL uint64_t logger__record_timestamp;
+
+uint64_t log_timestamp(void) {
+    return logger__record_timestamp;
+}
+
+// The date and time up to the seconds only change once a second, so each thread keeps
+// the last one it rendered and only writes the microseconds for every record.
+static THREAD_LOCAL struct {
+    uint64_t second;
+    char     text[24];
+    int      len;
+} logger__date_cache;
+
+int log_format_timestamp(char* buffer, int size, uint64_t timestamp) {
+    uint64_t second = timestamp / 1000000000ull;
+    unsigned micros = (unsigned) (timestamp % 1000000000ull / 1000);
+
+    if (second != logger__date_cache.second || logger__date_cache.len == 0) {
+        time_t t = (time_t) second;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        logger__date_cache.len = (int) strftime(logger__date_cache.text, sizeof(logger__date_cache.text), "%Y-%m-%d %H:%M:%S.", &tm);
+        logger__date_cache.second = second;
+    }
+
+    char digits[8];
+    char* end = digits + sizeof(digits);
+    char* p = logger__utoa(end, micros);
+    while (end - p < 6)
+        *--p = '0';
+
+    struct logger__out out = { buffer, (size > 0) ? (size_t) size - 1 : 0, 0 };
+    logger__out_put(&out, logger__date_cache.text, (size_t) logger__date_cache.len);
+    logger__out_put(&out, p, 6);
+    if (size > 0)
+        *out.p = '\0';
+    return (int) out.total;
+}
+
+int timestamp_formatter(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args) {
+    int len = log_format_timestamp(buffer, size, logger__record_timestamp);
+    if (len + 1 < size)
+        buffer[len] = ' ';
+    len += 1;
+    int used = (len < size) ? len : (size > 0 ? size - 1 : 0);
+    int rest = default_formatter(buffer + used, (size > 0) ? size - used : 0, logger, level, source_location, message, args);
+    return len + (rest > 0 ? rest : 0);
+}
+
+
+int default_formatter(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args) {
+    const char* file = source_location.file ? source_location.file : "";
+    const char* name = logger->name ? logger->name : "";
+    const char* level_name = LOG_LEVEL_NAMES[level];
+
+    // Prefix is "<file>:<line> [<level>:<name>]: " with the line left aligned in 3 columns.
+    struct logger__out out = { buffer, (size > 0) ? (size_t) size - 1 : 0, 0 };
+    if (*file) {
+        char digits[16];
+        char* end = digits + sizeof(digits);
+        int line = source_location.line;
+        char* p = logger__utoa(end, (unsigned long long) (line < 0 ? -(long long) line : line));
+        logger__out_put(&out, file, strlen(file));
+        logger__out_put(&out, ":", 1);
+        logger__out_number(&out, line < 0, p, (size_t) (end - p), 3, LOGGER__FMT_LEFT);
+        logger__out_put(&out, " ", 1);
+    }
+    logger__out_put(&out, "[", 1);
+    logger__out_put(&out, level_name, strlen(level_name));
+    if (*name) {
+        logger__out_put(&out, ":", 1);
+        logger__out_put(&out, name, strlen(name));
+    }
+    logger__out_put(&out, "]: ", 3);
+
+    // The message goes right after whatever part of the prefix fit.
+    int used = (int) (out.p - buffer);
+    int len = log_vformat(out.p, (size > 0) ? size - used : 0, message, args);
+    return (int) out.total + (len > 0 ? len : 0);
+}
+
+
+// ---- Encoders ----
+
+static const char logger__hex_digits[] = "0123456789abcdef";
+
+static inline int logger__json_needs_escape(unsigned char ch) {
+    return ch < 0x20 || ch == '"' || ch == '\\';
+}
+
+// Returns the index of the first byte that needs escaping, or `n`. Scans 16 bytes at a time
+// where SSE2 is available, which covers every x86-64 target.
+static inline size_t logger__json_scan(const char* s, size_t i, size_t n) {
+#if defined(__SSE2__)
+    const __m128i bias  = _mm_set1_epi8((char) 0x80);
+    const __m128i space = _mm_set1_epi8((char) (0x20 ^ 0x80));
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i control = _mm_cmplt_epi8(_mm_xor_si128(v, bias), space);     // Unsigned v < 0x20
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash));
+        int mask = _mm_movemask_epi8(_mm_or_si128(control, special));
+        if (mask)
+            return i + (size_t) __builtin_ctz((unsigned) mask);
+    }
+#endif
+    while (i < n && !logger__json_needs_escape((unsigned char) s[i]))
+        ++i;
+    return i;
+}
+
+// Writes the escaped contents of a JSON string, without the quotes.
+static void logger__out_json_escaped(struct logger__out* out, const char* s, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t end = logger__json_scan(s, i, n);
+        logger__out_put(out, s + i, end - i);
+        if (end == n)
+            break;
+
+        unsigned char ch = (unsigned char) s[end];
+        switch (ch) {
+            case '"':  logger__out_put(out, "\\\"", 2); break;
+            case '\\': logger__out_put(out, "\\\\", 2); break;
+            case '\n': logger__out_put(out, "\\n",  2); break;
+            case '\r': logger__out_put(out, "\\r",  2); break;
+            case '\t': logger__out_put(out, "\\t",  2); break;
+            default: {
+                char u[6] = { '\\', 'u', '0', '0', logger__hex_digits[ch >> 4], logger__hex_digits[ch & 0xF] };
+                logger__out_put(out, u, sizeof(u));
+            } break;
+        }
+        i = end + 1;
+    }
+}
+
+static void logger__out_json_string(struct logger__out* out, const char* s, size_t n) {
+    logger__out_put(out, "\"", 1);
+    logger__out_json_escaped(out, s, n);
+    logger__out_put(out, "\"", 1);
+}
+
+static void logger__out_u64(struct logger__out* out, uint64_t value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = logger__utoa(end, value);
+    logger__out_put(out, p, (size_t) (end - p));
+}
+
+static void logger__out_i64(struct logger__out* out, int64_t value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = logger__utoa(end, (value < 0) ? 0ull - (uint64_t) value : (uint64_t) value);
+    logger__out_number(out, value < 0, p, (size_t) (end - p), 0, 0);
+}
+
+// Shortest of %.15g and %.17g that reads back as the same double.
+static void logger__out_double(struct logger__out* out, double value) {
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%.15g", value);
+    if (strtod(text, NULL) != value)
+        len = snprintf(text, sizeof(text), "%.17g", value);
+    logger__out_put(out, text, (size_t) len);
+}
+
+static inline int logger__is_finite(double value) {
+    return value == value && !__builtin_isinf(value);
+}
+
+// Whether a logfmt value has to be quoted.
+static int logger__logfmt_needs_quotes(const char* s, size_t n) {
+    if (n == 0)
+        return 1;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char ch = (unsigned char) s[i];
+        if (ch <= ' ' || ch == '=' || ch == '"' || ch == '\\')
+            return 1;
+    }
+    return 0;
+}
+
+static void logger__out_logfmt_string(struct logger__out* out, const char* s, size_t n) {
+    if (logger__logfmt_needs_quotes(s, n))
+        logger__out_json_string(out, s, n);
+    else
+        logger__out_put(out, s, n);
+}
+
+// Appends " key=value" for every field, used for structured statements in plain text too.
+static void logger__out_logfmt_fields(struct logger__out* out, const log_field_t* fields, size_t field_count) {
+    for (size_t i = 0; i < field_count; ++i) {
+        const log_field_t* field = &fields[i];
+        const char* key = field->key ? field->key : "";
+        logger__out_put(out, " ", 1);
+        logger__out_logfmt_string(out, key, strlen(key));
+        logger__out_put(out, "=", 1);
+        switch (field->type) {
+            case LOG_FIELD_INT:     logger__out_i64(out, field->value.i); break;
+            case LOG_FIELD_UINT:    logger__out_u64(out, field->value.u); break;
+            case LOG_FIELD_BOOL:    logger__out_put(out, field->value.u ? "true" : "false", field->value.u ? 4 : 5); break;
+            case LOG_FIELD_DOUBLE:
+                if (logger__is_finite(field->value.d))      logger__out_double(out, field->value.d);
+                else if (field->value.d != field->value.d)  logger__out_put(out, "NaN", 3);
+                else                                        logger__out_put(out, (field->value.d > 0) ? "+Inf" : "-Inf", 4);
+                break;
+            case LOG_FIELD_STRING:
+                if (field->value.s) logger__out_logfmt_string(out, field->value.s, strlen(field->value.s));
+                else                logger__out_put(out, "null", 4);
+                break;
+        }
+    }
+}
+
+static int logger__out_finish(struct logger__out* out, int size) {
+    if (size > 0)
+        *out->p = '\0';
+    return (int) out->total;
+}
+
+int log_encode_json(char* buffer, int size, const struct log_record_t* record) {
+    struct logger__out out = { buffer, (size > 0) ? (size_t) size - 1 : 0, 0 };
+    const char* level = LOG_LEVEL_NAMES[record->level];
+
+    logger__out_put(&out, "{\"ts\":", 6);
+    logger__out_u64(&out, record->timestamp);
+    logger__out_put(&out, ",\"level\":\"", 10);
+    logger__out_put(&out, level, strlen(level));
+    logger__out_put(&out, "\"", 1);
+    if (record->logger_name && *record->logger_name) {
+        logger__out_put(&out, ",\"logger\":", 10);
+        logger__out_json_string(&out, record->logger_name, strlen(record->logger_name));
+    }
+    if (record->location.file && *record->location.file) {
+        logger__out_put(&out, ",\"file\":", 8);
+        logger__out_json_string(&out, record->location.file, strlen(record->location.file));
+        logger__out_put(&out, ",\"line\":", 8);
+        logger__out_i64(&out, record->location.line);
+    }
+    logger__out_put(&out, ",\"msg\":", 7);
+    logger__out_json_string(&out, record->message, record->message_len);
+
+    for (size_t i = 0; i < record->field_count; ++i) {
+        const log_field_t* field = &record->fields[i];
+        const char* key = field->key ? field->key : "";
+        logger__out_put(&out, ",", 1);
+        logger__out_json_string(&out, key, strlen(key));
+        logger__out_put(&out, ":", 1);
+        switch (field->type) {
+            case LOG_FIELD_INT:     logger__out_i64(&out, field->value.i); break;
+            case LOG_FIELD_UINT:    logger__out_u64(&out, field->value.u); break;
+            case LOG_FIELD_BOOL:    logger__out_put(&out, field->value.u ? "true" : "false", field->value.u ? 4 : 5); break;
+            case LOG_FIELD_DOUBLE:
+                // JSON has no NaN or infinities.
+                if (logger__is_finite(field->value.d)) logger__out_double(&out, field->value.d);
+                else                                   logger__out_put(&out, "null", 4);
+                break;
+            case LOG_FIELD_STRING:
+                if (field->value.s) logger__out_json_string(&out, field->value.s, strlen(field->value.s));
+                else                logger__out_put(&out, "null", 4);
+                break;
+        }
+    }
+    logger__out_put(&out, "}", 1);
+    return logger__out_finish(&out, size);
+}
+
+int log_encode_logfmt(char* buffer, int size, const struct log_record_t* record) {
+    struct logger__out out = { buffer, (size > 0) ? (size_t) size - 1 : 0, 0 };
+    const char* level = LOG_LEVEL_NAMES[record->level];
+
+    logger__out_put(&out, "ts=", 3);
+    logger__out_u64(&out, record->timestamp);
+    logger__out_put(&out, " level=", 7);
+    logger__out_put(&out, level, strlen(level));
+    if (record->logger_name && *record->logger_name) {
+        logger__out_put(&out, " logger=", 8);
+        logger__out_logfmt_string(&out, record->logger_name, strlen(record->logger_name));
+    }
+    if (record->location.file && *record->location.file) {
+        // Quoted together when the path needs it; the line number never does.
+        const char* file = record->location.file;
+        size_t file_len = strlen(file);
+        int quoted = logger__logfmt_needs_quotes(file, file_len);
+        logger__out_put(&out, quoted ? " file=\"" : " file=", quoted ? 7 : 6);
+        if (quoted) logger__out_json_escaped(&out, file, file_len);
+        else        logger__out_put(&out, file, file_len);
+        logger__out_put(&out, ":", 1);
+        logger__out_i64(&out, record->location.line);
+        if (quoted) logger__out_put(&out, "\"", 1);
+    }
+    logger__out_put(&out, " msg=", 5);
+    logger__out_logfmt_string(&out, record->message, record->message_len);
+    logger__out_logfmt_fields(&out, record->fields, record->field_count);
+    return logger__out_finish(&out, size);
+}
+
+static void logger__out_binary_string(struct logger__out* out, const char* s, size_t n) {
+    if (!s) {
+        uint16_t null = LOGGER_BINARY_NULL_STRING;
+        logger__out_put(out, (const char*) &null, sizeof(null));
+        return;
+    }
+    uint16_t len = (uint16_t) ((n < LOGGER_BINARY_NULL_STRING) ? n : LOGGER_BINARY_NULL_STRING - 1);
+    logger__out_put(out, (const char*) &len, sizeof(len));
+    logger__out_put(out, s, len);
+}
+
+// The size prefix is patched in at the end, once the rest is known to have fit.
+int log_encode_binary(char* buffer, int size, const struct log_record_t* record) {
+    struct logger__out out = { buffer, (size > 0) ? (size_t) size : 0, 0 };
+    uint32_t record_size = 0;
+    uint64_t timestamp = record->timestamp;
+    uint8_t  level = (uint8_t) record->level;
+    uint32_t line = (uint32_t) record->location.line;
+    uint8_t  count = (uint8_t) ((record->field_count < 0xFF) ? record->field_count : 0xFF);
+
+    logger__out_put(&out, (const char*) &record_size, sizeof(record_size));
+    logger__out_put(&out, (const char*) &timestamp, sizeof(timestamp));
+    logger__out_put(&out, (const char*) &level, sizeof(level));
+    logger__out_put(&out, (const char*) &line, sizeof(line));
+    logger__out_binary_string(&out, record->logger_name, record->logger_name ? strlen(record->logger_name) : 0);
+    logger__out_binary_string(&out, record->location.file, record->location.file ? strlen(record->location.file) : 0);
+    logger__out_binary_string(&out, record->message, record->message_len);
+    logger__out_put(&out, (const char*) &count, sizeof(count));
+
+    for (size_t i = 0; i < count; ++i) {
+        const log_field_t* field = &record->fields[i];
+        uint8_t type = (uint8_t) field->type;
+        logger__out_put(&out, (const char*) &type, sizeof(type));
+        logger__out_binary_string(&out, field->key, field->key ? strlen(field->key) : 0);
+        if (field->type == LOG_FIELD_STRING)
+            logger__out_binary_string(&out, field->value.s, field->value.s ? strlen(field->value.s) : 0);
+        else
+            logger__out_put(&out, (const char*) &field->value, 8);
+    }
+
+    if (out.total <= (size_t) (size > 0 ? size : 0)) {
+        record_size = (uint32_t) (out.total - sizeof(record_size));
+        memcpy(buffer, &record_size, sizeof(record_size));
+    }
+    return (int) out.total;
+}
+
+
+// ---- Stats export ----
+
+static void logger__out_str(struct logger__out* out, const char* s) {
+    logger__out_put(out, s, strlen(s));
+}
+
+static void logger__out_seconds(struct logger__out* out, uint64_t ns) {
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%.9g", (double) ns / 1e9);
+    logger__out_put(out, text, (size_t) len);
+}
+
+// The quoted label of a sink: its name, or else the address of its data, or of its writer
+// for sinks without data.
+static void logger__out_sink_label(struct logger__out* out, const log_sink_stats_t* sink) {
+    char address[32];
+    const char* name = sink->name;
+    if (!name) {
+        uintptr_t at = sink->data ? (uintptr_t) sink->data : (uintptr_t) sink->write;
+        snprintf(address, sizeof(address), "0x%jx", (uintmax_t) at);
+        name = address;
+    }
+    logger__out_json_string(out, name, strlen(name));
+}
+
+// "<metric>{<label>=<value>} <count>" for one counter of every level.
+static void logger__out_prometheus_levels(struct logger__out* out, const log_stats_t* stats, const char* metric, const char* help, size_t offset) {
+    logger__out_str(out, "# HELP logger_");
+    logger__out_str(out, metric);
+    logger__out_str(out, " ");
+    logger__out_str(out, help);
+    logger__out_str(out, "\n# TYPE logger_");
+    logger__out_str(out, metric);
+    logger__out_str(out, " counter\n");
+    for (int level = LOG_TRACE; level < LOG_LEVEL_COUNT; ++level) {
+        uint64_t value;
+        memcpy(&value, (const char*) &stats->levels[level] + offset, sizeof(value));
+        logger__out_str(out, "logger_");
+        logger__out_str(out, metric);
+        logger__out_str(out, "{level=\"");
+        logger__out_str(out, LOG_LEVEL_NAMES[level]);
+        logger__out_str(out, "\"} ");
+        logger__out_u64(out, value);
+        logger__out_str(out, "\n");
+    }
+}
+
+// The series of one histogram, labelled `label_name` with the level, or with the sink when there is one.
+static void logger__out_prometheus_histogram(struct logger__out* out, const char* metric, const char* label_name, const char* level, const log_sink_stats_t* sink, const log_histogram_t* h) {
+    uint64_t cumulative = 0;
+    for (int i = 0; i < LOG_STATS_BUCKETS; ++i) {
+        cumulative += h->buckets[i];
+        logger__out_str(out, "logger_");
+        logger__out_str(out, metric);
+        logger__out_str(out, "_bucket{");
+        logger__out_str(out, label_name);
+        logger__out_str(out, "=");
+        if (sink) {
+            logger__out_sink_label(out, sink);
+        } else {
+            logger__out_str(out, "\"");
+            logger__out_str(out, level);
+            logger__out_str(out, "\"");
+        }
+        logger__out_str(out, ",le=\"");
+        if (i == LOG_STATS_BUCKETS - 1)
+            logger__out_str(out, "+Inf");
+        else
+            logger__out_seconds(out, (uint64_t) 2 << i);
+        logger__out_str(out, "\"} ");
+        logger__out_u64(out, cumulative);
+        logger__out_str(out, "\n");
+    }
+
+    for (int sum = 1; sum >= 0; --sum) {
+        logger__out_str(out, "logger_");
+        logger__out_str(out, metric);
+        logger__out_str(out, sum ? "_sum{" : "_count{");
+        logger__out_str(out, label_name);
+        logger__out_str(out, "=");
+        if (sink) {
+            logger__out_sink_label(out, sink);
+        } else {
+            logger__out_str(out, "\"");
+            logger__out_str(out, level);
+            logger__out_str(out, "\"");
+        }
+        logger__out_str(out, "} ");
+        if (sum)
+            logger__out_seconds(out, h->sum_ns);
+        else
+            logger__out_u64(out, h->count);
+        logger__out_str(out, "\n");
+    }
+}
+
+static void logger__out_stats_prometheus(struct logger__out* out, const log_stats_t* stats) {
+    logger__out_prometheus_levels(out, stats, "emitted_total",   "Statements that passed the level.",              offsetof(log_level_stats_t, emitted));
+    logger__out_prometheus_levels(out, stats, "filtered_total",  "Statements below the level or switched off.",    offsetof(log_level_stats_t, filtered));
+    logger__out_prometheus_levels(out, stats, "unrouted_total",  "Emitted statements no sink took.",               offsetof(log_level_stats_t, unrouted));
+    logger__out_prometheus_levels(out, stats, "truncated_total", "Messages cut at the maximum message size.",      offsetof(log_level_stats_t, truncated));
+
+    logger__out_str(out, "# HELP logger_log_duration_seconds Time in the logger per emitted statement.\n"
+                         "# TYPE logger_log_duration_seconds histogram\n");
+    for (int level = LOG_TRACE; level < LOG_LEVEL_COUNT; ++level)
+        logger__out_prometheus_histogram(out, "log_duration_seconds", "level", LOG_LEVEL_NAMES[level], NULL, &stats->levels[level].latency);
+
+    logger__out_str(out, "# HELP logger_sink_records_total Records written to each sink.\n"
+                         "# TYPE logger_sink_records_total counter\n");
+    for (size_t i = 0; i < stats->sink_count; ++i) {
+        logger__out_str(out, "logger_sink_records_total{sink=");
+        logger__out_sink_label(out, &stats->sinks[i]);
+        logger__out_str(out, "} ");
+        logger__out_u64(out, stats->sinks[i].records);
+        logger__out_str(out, "\n");
+    }
+    logger__out_str(out, "# HELP logger_sink_bytes_total Text written to each sink.\n"
+                         "# TYPE logger_sink_bytes_total counter\n");
+    for (size_t i = 0; i < stats->sink_count; ++i) {
+        logger__out_str(out, "logger_sink_bytes_total{sink=");
+        logger__out_sink_label(out, &stats->sinks[i]);
+        logger__out_str(out, "} ");
+        logger__out_u64(out, stats->sinks[i].bytes);
+        logger__out_str(out, "\n");
+    }
+    logger__out_str(out, "# HELP logger_sink_write_duration_seconds Time in each sink's write.\n"
+                         "# TYPE logger_sink_write_duration_seconds histogram\n");
+    for (size_t i = 0; i < stats->sink_count; ++i)
+        logger__out_prometheus_histogram(out, "sink_write_duration_seconds", "sink", NULL, &stats->sinks[i], &stats->sinks[i].latency);
+
+    logger__out_str(out, "# HELP logger_async_dropped_total Records dropped because the async queue was full.\n"
+                         "# TYPE logger_async_dropped_total counter\n"
+                         "logger_async_dropped_total ");
+    logger__out_u64(out, stats->async_dropped);
+    logger__out_str(out, "\n");
+}
+
+static void logger__out_json_histogram(struct logger__out* out, const log_histogram_t* h) {
+    logger__out_str(out, "{\"count\":");
+    logger__out_u64(out, h->count);
+    logger__out_str(out, ",\"sum_ns\":");
+    logger__out_u64(out, h->sum_ns);
+    logger__out_str(out, ",\"buckets\":[");
+    for (int i = 0; i < LOG_STATS_BUCKETS; ++i) {
+        if (i)
+            logger__out_str(out, ",");
+        logger__out_u64(out, h->buckets[i]);
+    }
+    logger__out_str(out, "]}");
+}
+
+static void logger__out_stats_json(struct logger__out* out, const log_stats_t* stats) {
+    logger__out_str(out, "{\"levels\":{");
+    for (int level = LOG_TRACE; level < LOG_LEVEL_COUNT; ++level) {
+        const log_level_stats_t* l = &stats->levels[level];
+        if (level != LOG_TRACE)
+            logger__out_str(out, ",");
+        logger__out_str(out, "\"");
+        logger__out_str(out, LOG_LEVEL_NAMES[level]);
+        logger__out_str(out, "\":{\"emitted\":");
+        logger__out_u64(out, l->emitted);
+        logger__out_str(out, ",\"filtered\":");
+        logger__out_u64(out, l->filtered);
+        logger__out_str(out, ",\"unrouted\":");
+        logger__out_u64(out, l->unrouted);
+        logger__out_str(out, ",\"truncated\":");
+        logger__out_u64(out, l->truncated);
+        logger__out_str(out, ",\"latency\":");
+        logger__out_json_histogram(out, &l->latency);
+        logger__out_str(out, "}");
+    }
+
+    logger__out_str(out, "},\"sinks\":[");
+    for (size_t i = 0; i < stats->sink_count; ++i) {
+        const log_sink_stats_t* sink = &stats->sinks[i];
+        if (i)
+            logger__out_str(out, ",");
+        logger__out_str(out, "{\"sink\":");
+        logger__out_sink_label(out, sink);
+        logger__out_str(out, ",\"records\":");
+        logger__out_u64(out, sink->records);
+        logger__out_str(out, ",\"bytes\":");
+        logger__out_u64(out, sink->bytes);
+        logger__out_str(out, ",\"latency\":");
+        logger__out_json_histogram(out, &sink->latency);
+        logger__out_str(out, "}");
+    }
+
+    logger__out_str(out, "],\"async_dropped\":");
+    logger__out_u64(out, stats->async_dropped);
+    logger__out_str(out, "}\n");
+}
+
+int log_stats_format(char* buffer, int size, const log_stats_t* stats, log_stats_format_t format) {
+    struct logger__out out = { buffer, (size > 0) ? (size_t) size - 1 : 0, 0 };
+    if (format == LOG_STATS_JSON)
+        logger__out_stats_json(&out, stats);
+    else
+        logger__out_stats_prometheus(&out, stats);
+    return logger__out_finish(&out, size);
+}
+
+void log_stats_dump(int fd, log_stats_format_t format) {
+    log_stats_t* stats = malloc(sizeof(*stats));
+    if (!stats)
+        return;
+    log_stats_snapshot(stats);
+
+    char local[16 * 1024];
+    char* buffer = local;
+    int len = log_stats_format(buffer, (int) sizeof(local), stats, format);
+    if (len >= (int) sizeof(local) && (buffer = malloc((size_t) len + 1)) != NULL)
+        len = log_stats_format(buffer, len + 1, stats, format);
+    if (buffer) {
+        logger__write_all(fd, buffer, (size_t) len);
+        if (buffer != local)
+            free(buffer);
+    }
+    free(stats);
+}
+
+
+// ---- Flight recorder ----
+// Every thread keeps its last statements, whatever their level, as raw arguments in a
+// ring of fixed size slots, much like the binary capture does. A dump only parses the
+// formats and writes from memory that already exists, so it is safe in a signal handler.
+
+#define LOGGER_RECORDER_NULL_STRING 0xFF
+
+struct logger__recorder_slot {
+    size_t                  sequence;   // 2 * index + 1 while being written, 2 * index + 2 once complete
+    const log_callsite_t*   callsite;
+    const char*             format;     // A literal, so it outlives the statement
+    uint64_t                timestamp;
+    uint16_t                size;       // Bytes used in `data`
+    uint8_t                 arg_count;  // Arguments captured, fewer than the call site has if they didn't fit
+    uint8_t                 raw;        // `data` holds the message, the format wasn't a literal
+    unsigned char           data[LOG_RECORDER_SLOT_SIZE - 36];
+};
+
+// Never freed: a thread that exits leaves its recorder to the next new thread, and the list
+// is only ever prepended to, so a signal handler can walk it at any time. The signal stack
+// goes with it, so that a thread that overflows its own stack still gets a crash report.
+struct logger__recorder {
+    struct logger__recorder*        next;
+    int                             owner;  // Thread id, 0 once the thread exited
+    size_t                          head;   // Index of the next statement
+    struct logger__recorder_slot*   slots;
+    void*                           signal_stack;
+    int                             signal_stack_installed;
+};
+
+#define LOGGER_RECORDER_SIGNAL_STACK_SIZE (64 * 1024)
+
+int logger_recorder_enabled = 0;
+static size_t logger__recorder_size;
+static int logger__recorder_fd = STDERR_FILENO;
+static struct logger__recorder* logger__recorders;
+static pthread_key_t logger__recorder_key;
+static THREAD_LOCAL struct logger__recorder* logger__recorder_local;
+
+static void logger__recorder_thread_exit(void* data) {
+    struct logger__recorder* r = data;
+    if (r->signal_stack_installed) {
+        stack_t stack = { .ss_sp = NULL, .ss_size = 0, .ss_flags = SS_DISABLE };
+        sigaltstack(&stack, NULL);
+        r->signal_stack_installed = 0;
+    }
+    __atomic_store_n(&r->owner, 0, __ATOMIC_RELEASE);
+}
+
+// Unless the thread has a signal stack already, e.g. one of a sanitizer or of the program.
+static void logger__recorder_install_signal_stack(struct logger__recorder* r) {
+    stack_t current;
+    if (!r->signal_stack || sigaltstack(NULL, &current) != 0 || !(current.ss_flags & SS_DISABLE))
+        return;
+    stack_t stack = { .ss_sp = r->signal_stack, .ss_size = LOGGER_RECORDER_SIGNAL_STACK_SIZE, .ss_flags = 0 };
+    r->signal_stack_installed = sigaltstack(&stack, NULL) == 0;
+}
+
+__attribute__((noinline, cold))
+static struct logger__recorder* logger__recorder_thread(void) {
+    int tid = (int) syscall(SYS_gettid);
+    struct logger__recorder* r;
+
+    for (r = __atomic_load_n(&logger__recorders, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int free_owner = 0;
+        if (__atomic_load_n(&r->owner, __ATOMIC_RELAXED) == 0 && __atomic_compare_exchange_n(&r->owner, &free_owner, tid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            // Skip a whole lap so nothing the previous owner left behind is dumped as ours.
+            __atomic_store_n(&r->head, r->head + logger__recorder_size, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        struct logger__recorder_slot* slots = calloc(logger__recorder_size, sizeof(*slots));
+        if (!r || !slots) {
+            free(r);
+            free(slots);
+            return NULL;
+        }
+        r->owner = tid;
+        r->slots = slots;
+        r->signal_stack = malloc(LOGGER_RECORDER_SIGNAL_STACK_SIZE);
+        r->next = __atomic_load_n(&logger__recorders, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&logger__recorders, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    logger__recorder_install_signal_stack(r);
+    pthread_setspecific(logger__recorder_key, r);
+    logger__recorder_local = r;
+    return r;
+}
+
+static unsigned char* logger__recorder_put_string(unsigned char* p, const unsigned char* end, const char* str) {
+    if (end - p < 1)
+        return NULL;
+    if (!str) {
+        *p++ = LOGGER_RECORDER_NULL_STRING;
+        return p;
+    }
+    size_t room = (size_t) (end - p) - 1;
+    size_t len = strnlen(str, (room < LOGGER_RECORDER_NULL_STRING - 1) ? room : LOGGER_RECORDER_NULL_STRING - 1);
+    *p++ = (unsigned char) len;
+    memcpy(p, str, len);
+    return p + len;
+}
+
+void logger_recorder_capture(log_callsite_t* callsite, const char* message, ...) {
+    va_list args;
+    va_start(args, message);
+    logger_recorder_vcapture(callsite, message, args);
+    va_end(args);
+}
+
+void logger_recorder_vcapture(log_callsite_t* callsite, const char* message, va_list args) {
+    struct logger__recorder* r = logger__recorder_local;
+    if (__builtin_expect(!r, 0) && !(r = logger__recorder_thread()))
+        return;
+
+    size_t index = r->head;
+    struct logger__recorder_slot* slot = &r->slots[index % logger__recorder_size];
+    __atomic_store_n(&slot->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->callsite  = callsite;
+    slot->format    = message;
+    slot->timestamp = logger__now();
+    slot->raw       = !callsite->constant_format;
+
+    unsigned char* p = slot->data;
+    const unsigned char* end = slot->data + sizeof(slot->data);
+    int captured = 0;
+    if (slot->raw) {
+        p = logger__recorder_put_string(p, end, message);
+    } else {
+        if (__builtin_expect(__atomic_load_n(&callsite->args_checked, __ATOMIC_ACQUIRE) != 2, 0))
+            logger__callsite_check_args(callsite, message);
+        for (int i = 1; i < callsite->arg_count && p; ++i, ++captured) {
+            unsigned char* next = p;
+            switch (callsite->arg_types[i]) {
+                case LOG_ARG_INT:           if (end - p < 4) { next = NULL; break; } LOGGER__PUT(next, (int32_t) va_arg(args, int)); break;
+                case LOG_ARG_INT64:         if (end - p < 8) { next = NULL; break; } LOGGER__PUT(next, (int64_t) va_arg(args, long long)); break;
+                case LOG_ARG_DOUBLE:        if (end - p < 8) { next = NULL; break; } LOGGER__PUT(next, (double) va_arg(args, double)); break;
+                case LOG_ARG_LONG_DOUBLE:   if (end - p < 8) { next = NULL; break; } LOGGER__PUT(next, (double) va_arg(args, long double)); break;
+                case LOG_ARG_POINTER:       if (end - p < 8) { next = NULL; break; } LOGGER__PUT(next, (uint64_t) (uintptr_t) va_arg(args, void*)); break;
+                case LOG_ARG_STRING:        next = logger__recorder_put_string(p, end, va_arg(args, const char*)); break;
+                default:                    next = NULL; break;
+            }
+            if (!next)
+                break;
+            p = next;
+        }
+    }
+    slot->arg_count = (uint8_t) captured;
+    slot->size = (uint16_t) ((p ? p : slot->data) - slot->data);
+
+    __atomic_store_n(&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, index + 1, __ATOMIC_RELEASE);
+}
+
+
+struct logger__recorder_reader {
+    const unsigned char* p;
+    const unsigned char* end;
+    int remaining;
+};
+
+// Reads the next captured argument. Returns its `log_arg_type_t`, or 0 when there is none.
+static int logger__recorder_next(struct logger__recorder_reader* reader, const log_callsite_t* callsite, int* arg, uint64_t* bits, const char** str, size_t* len) {
+    if (reader->remaining <= 0 || *arg >= callsite->arg_count)
+        return 0;
+    int type = callsite->arg_types[(*arg)++];
+    reader->remaining -= 1;
+
+    if (type == LOG_ARG_STRING) {
+        unsigned char n = *reader->p++;
+        *str = (n == LOGGER_RECORDER_NULL_STRING) ? NULL : (const char*) reader->p;
+        *len = (n == LOGGER_RECORDER_NULL_STRING) ? 0 : n;
+        reader->p += *len;
+        return type;
+    }
+    if (type == LOG_ARG_INT) {
+        int32_t value;
+        memcpy(&value, reader->p, sizeof(value));
+        reader->p += sizeof(value);
+        *bits = (uint64_t) (int64_t) value;
+        return type;
+    }
+    memcpy(bits, reader->p, sizeof(*bits));
+    reader->p += sizeof(*bits);
+    return type;
+}
+
+// A best-effort printf over the captured arguments; close enough for a post-mortem.
+static void logger__recorder_render(struct logger__out* out, const struct logger__recorder_slot* slot) {
+    struct logger__recorder_reader reader = { slot->data, slot->data + slot->size, slot->arg_count };
+    if (slot->raw) {
+        size_t len = (slot->size > 0) ? slot->data[0] : 0;
+        if (len != LOGGER_RECORDER_NULL_STRING)
+            logger__out_put(out, (const char*) slot->data + 1, len);
+        return;
+    }
+
+    const char* format = slot->format;
+    struct logger__fmt_spec specs[LOGGER__FMT_MAX_SPECS];
+    int count = logger__fmt_parse(format, specs);
+    if (count < 0) {
+        logger__out_put(out, format, strlen(format));
+        return;
+    }
+
+    int arg = 1;
+    for (int i = 0; i < count; ++i) {
+        const struct logger__fmt_spec* spec = &specs[i];
+        logger__out_put(out, format + spec->literal_start, spec->literal_len);
+        char c = spec->conversion;
+        if (c == '\0' || c == '%')
+            continue;
+
+        uint64_t bits = 0;
+        const char* str = NULL;
+        size_t len = 0;
+        int flags = spec->flags & ~LOGGER__FMT_SLOW;
+        int width = spec->width;
+        int precision = spec->precision;
+        if (width == LOGGER__FMT_STAR) {
+            width = logger__recorder_next(&reader, slot->callsite, &arg, &bits, &str, &len) ? (int) bits : 0;
+            if (width < 0) {
+                flags |= LOGGER__FMT_LEFT;
+                width = -width;
+            }
+        }
+        if (precision == LOGGER__FMT_STAR)
+            precision = logger__recorder_next(&reader, slot->callsite, &arg, &bits, &str, &len) ? (int) bits : LOGGER__FMT_UNSET;
+
+        int type = logger__recorder_next(&reader, slot->callsite, &arg, &bits, &str, &len);
+        char digits[32];
+        char* end = digits + sizeof(digits);
+        switch (type) {
+            case 0:
+                logger__out_put(out, "?", 1);
+                break;
+            case LOG_ARG_STRING:
+                if (!str)                                         logger__out_padded(out, "(null)", 6, width, flags);
+                else if (precision >= 0 && (size_t) precision < len) logger__out_padded(out, str, (size_t) precision, width, flags);
+                else                                              logger__out_padded(out, str, len, width, flags);
+                break;
+            case LOG_ARG_DOUBLE:
+            case LOG_ARG_LONG_DOUBLE: {
+                double value;
+                memcpy(&value, &bits, sizeof(value));
+                if (!logger__out_fixed(out, value, (precision >= 0) ? precision : 6, width, flags, 1)) {
+                    char* p = logger__xtoa(end, bits, 0);
+                    logger__out_put(out, "<double 0x", 10);
+                    logger__out_put(out, p, (size_t) (end - p));
+                    logger__out_put(out, ">", 1);
+                }
+            } break;
+            default:
+                if (c == 'p' || type == LOG_ARG_POINTER) {
+                    char* p = logger__xtoa(end, bits, 0);
+                    *--p = 'x';
+                    *--p = '0';
+                    logger__out_padded(out, p, (size_t) (end - p), width, flags & ~LOGGER__FMT_ZERO);
+                } else if (c == 'c') {
+                    char ch = (char) bits;
+                    logger__out_padded(out, &ch, 1, width, flags);
+                } else if (c == 'x' || c == 'X') {
+                    uint64_t value = (type == LOG_ARG_INT) ? (uint32_t) bits : bits;
+                    char* p = logger__xtoa(end, value, c == 'X');
+                    logger__out_number(out, 0, p, (size_t) (end - p), width, flags);
+                } else if (c == 'u') {
+                    uint64_t value = (type == LOG_ARG_INT) ? (uint32_t) bits : bits;
+                    char* p = logger__utoa(end, value);
+                    logger__out_number(out, 0, p, (size_t) (end - p), width, flags);
+                } else {
+                    int64_t value = (int64_t) bits;
+                    char* p = logger__utoa(end, (value < 0) ? 0ull - (uint64_t) value : (uint64_t) value);
+                    logger__out_number(out, value < 0, p, (size_t) (end - p), width, flags);
+                }
+                break;
+        }
+    }
+}
+
+void log_recorder_dump(int fd) {
+    char line[1024];
+
+    for (struct logger__recorder* r = __atomic_load_n(&logger__recorders, __ATOMIC_ACQUIRE); r; r = r->next) {
+        struct logger__out out = { line, sizeof(line) - 1, 0 };
+        logger__out_put(&out, "--- thread ", 11);
+        logger__out_i64(&out, __atomic_load_n(&r->owner, __ATOMIC_RELAXED));
+        logger__out_put(&out, " ---\n", 5);
+        logger__write_all(fd, line, (size_t) (out.p - line));
+
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t first = (head > logger__recorder_size) ? head - logger__recorder_size : 0;
+        for (size_t index = first; index < head; ++index) {
+            const struct logger__recorder_slot* shared = &r->slots[index % logger__recorder_size];
+            struct logger__recorder_slot slot;
+            size_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+            if (sequence != 2 * index + 2)
+                continue;
+            memcpy(&slot, shared, sizeof(slot));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) != sequence || slot.size > sizeof(slot.data))
+                continue;
+
+            const log_callsite_t* callsite = slot.callsite;
+            const char* level = LOG_LEVEL_NAMES[callsite->level];
+            char micros[8];
+            char* micros_end = micros + sizeof(micros);
+            char* p = logger__utoa(micros_end, slot.timestamp % 1000000000ull / 1000);
+            while (micros_end - p < 6)
+                *--p = '0';
+
+            out = (struct logger__out) { line, sizeof(line) - 1, 0 };
+            logger__out_u64(&out, slot.timestamp / 1000000000ull);
+            logger__out_put(&out, ".", 1);
+            logger__out_put(&out, p, 6);
+            logger__out_put(&out, " ", 1);
+            logger__out_put(&out, callsite->location.file, strlen(callsite->location.file));
+            logger__out_put(&out, ":", 1);
+            logger__out_i64(&out, callsite->location.line);
+            logger__out_put(&out, " [", 2);
+            logger__out_put(&out, level, strlen(level));
+            logger__out_put(&out, "]: ", 3);
+            logger__recorder_render(&out, &slot);
+            logger__out_put(&out, "\n", 1);
+            if (out.total > sizeof(line) - 1)
+                line[sizeof(line) - 2] = '\n';
+            logger__write_all(fd, line, (size_t) (out.p - line));
+        }
+    }
+}
+
+
+// ---- Spans ----
+// Every thread keeps its last spans in a ring of 64 byte slots, one per span, written when
+// the span ends, like the flight recorder keeps statements. A span only stores TSC ticks;
+// they are turned into time when exported, with the clock's current scale. A slot carries
+// no sequence of its own: an export reads `head` before and after copying a ring and drops
+// the slots a writer may have been in.
+
+struct logger__span_slot {
+    const log_span_site_t*  site;
+    uint64_t                start;
+    uint64_t                end;
+    uint32_t                arg_count;
+    double                  args[LOG_SPAN_MAX_ARGS];
+};
+
+// Never freed: a thread that exits leaves its ring to the next new thread, once its spans
+// have been exported.
+struct logger__spans {
+    struct logger__spans*       next;
+    int                         owner;      // Thread id, 0 once the thread exited
+    int                         tid;        // Of the thread the spans are from
+    size_t                      head;       // Index of the next span
+    size_t                      exported;   // `head` as of the last export
+    struct logger__span_slot*   slots;
+};
+
+int logger_spans_enabled = 0;
+static size_t logger__spans_mask;
+static int logger__spans_tsc;
+static uint64_t logger__spans_origin;   // Ticks when recording began, time zero of an export
+static struct logger__spans* logger__spans_list;
+static pthread_key_t logger__spans_key;
+static THREAD_LOCAL struct logger__spans* logger__spans_local;
+
+static inline uint64_t logger__span_ticks(void) {
+#if LOGGER__HAS_TSC
+    if (__builtin_expect(logger__spans_tsc, 1))
+        return logger__rdtsc();
+#endif
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return logger__timespec_ns(now);
+}
+
+// Nanoseconds since the epoch of a span's ticks.
+static uint64_t logger__span_ns(uint64_t ticks) {
+#if LOGGER__HAS_TSC
+    if (logger__spans_tsc) {
+        uint64_t base, ns, mult;
+        unsigned sequence;
+        do {
+            sequence = __atomic_load_n(&logger__clock.sequence, __ATOMIC_ACQUIRE);
+            base     = __atomic_load_n(&logger__clock.tsc,  __ATOMIC_RELAXED);
+            ns       = __atomic_load_n(&logger__clock.ns,   __ATOMIC_RELAXED);
+            mult     = __atomic_load_n(&logger__clock.mult, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((sequence & 1) || sequence != __atomic_load_n(&logger__clock.sequence, __ATOMIC_RELAXED));
+
+        if (ticks >= base)
+            return ns + (uint64_t) (((logger__u128) (ticks - base) * mult) >> 32);
+        uint64_t before = (uint64_t) (((logger__u128) (base - ticks) * mult) >> 32);
+        return (before < ns) ? ns - before : 0;
+    }
+#endif
+    return ticks;
+}
+
+static void logger__spans_thread_exit(void* data) {
+    struct logger__spans* s = data;
+    __atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+}
+
+__attribute__((noinline, cold))
+static struct logger__spans* logger__spans_thread(void) {
+    int tid = (int) syscall(SYS_gettid);
+    struct logger__spans* s;
+
+    for (s = __atomic_load_n(&logger__spans_list, __ATOMIC_ACQUIRE); s; s = s->next) {
+        int free_owner = 0;
+        if (__atomic_load_n(&s->owner, __ATOMIC_RELAXED) == 0
+                && __atomic_load_n(&s->exported, __ATOMIC_RELAXED) == __atomic_load_n(&s->head, __ATOMIC_RELAXED)
+                && __atomic_compare_exchange_n(&s->owner, &free_owner, tid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            // Skip a whole lap so nothing the previous owner left behind is exported again.
+            __atomic_store_n(&s->head, s->head + logger__spans_mask + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&s->tid, tid, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+
+    if (!s) {
+        s = calloc(1, sizeof(*s));
+        struct logger__span_slot* slots = calloc(logger__spans_mask + 1, sizeof(*slots));
+        if (!s || !slots) {
+            free(s);
+            free(slots);
+            return NULL;
+        }
+        s->owner = tid;
+        s->tid = tid;
+        s->slots = slots;
+        s->next = __atomic_load_n(&logger__spans_list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&logger__spans_list, &s->next, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(logger__spans_key, s);
+    logger__spans_local = s;
+    return s;
+}
+
+void logger_span_begin(log_span_t* span, log_span_site_t* site, const log_span_arg_t* args, size_t count) {
+    if (count > LOG_SPAN_MAX_ARGS)
+        count = LOG_SPAN_MAX_ARGS;
+    if (count && __builtin_expect(!__atomic_load_n(&site->keys[0], __ATOMIC_ACQUIRE), 0)) {
+        // Every thread stores the same literals, so racing here is harmless.
+        for (size_t i = count; i-- > 0; )
+            __atomic_store_n(&site->keys[i], args[i].key, __ATOMIC_RELEASE);
+    }
+    for (size_t i = 0; i < count; ++i)
+        span->args[i] = args[i].value;
+    span->arg_count = (unsigned) count;
+    span->site  = site;
+    span->start = logger__span_ticks();
+}
+
+void logger_span_end(log_span_t* span) {
+    uint64_t end = logger__span_ticks();
+    struct logger__spans* s = logger__spans_local;
+    if (__builtin_expect(!s, 0) && !(s = logger__spans_thread()))
         return;
+
+    size_t index = s->head;
+    struct logger__span_slot* slot = &s->slots[index & logger__spans_mask];
+    slot->site      = span->site;
+    slot->start     = span->start;
+    slot->end       = end;
+    slot->arg_count = span->arg_count;
+    for (unsigned i = 0; i < span->arg_count; ++i)
+        slot->args[i] = span->args[i];
+    __atomic_store_n(&s->head, index + 1, __ATOMIC_RELEASE);
+}
+
+static void logger__spans_start(size_t size) {
+    if (pthread_key_create(&logger__spans_key, logger__spans_thread_exit) != 0) {
+        fprintf(stderr, "logger: failed to set up span recording\n");
+        return;
+    }
+    size_t capacity = 1;
+    while (capacity < size)
+        capacity *= 2;
+    logger__spans_mask = capacity - 1;
+    logger__spans_tsc = logger__clock_source() == LOG_CLOCK_TSC;
+    logger__spans_origin = logger__span_ticks();
+    __atomic_store_n(&logger_spans_enabled, 1, __ATOMIC_RELEASE);
+}
+
+// Times are microseconds since `origin_ns`, small enough for a double to keep the nanoseconds.
+static void logger__out_span(struct logger__out* out, const struct logger__span_slot* slot, int pid, int tid, uint64_t origin_ns) {
+    const log_span_site_t* site = slot->site;
+    uint64_t start = logger__span_ns(slot->start);
+    uint64_t end   = logger__span_ns(slot->end);
+    uint64_t duration = (end > start) ? end - start : 0;
+    start = (start > origin_ns) ? start - origin_ns : 0;
+    char fraction[4];
+
+    logger__out_str(out, "{\"name\":");
+    logger__out_json_string(out, site->name, strlen(site->name));
+    logger__out_str(out, ",\"ph\":\"X\",\"pid\":");
+    logger__out_u64(out, (uint64_t) pid);
+    logger__out_str(out, ",\"tid\":");
+    logger__out_u64(out, (uint64_t) tid);
+    logger__out_str(out, ",\"ts\":");
+    logger__out_u64(out, start / 1000);
+    snprintf(fraction, sizeof(fraction), "%03u", (unsigned) (start % 1000));
+    logger__out_put(out, ".", 1);
+    logger__out_put(out, fraction, 3);
+    logger__out_str(out, ",\"dur\":");
+    logger__out_u64(out, duration / 1000);
+    snprintf(fraction, sizeof(fraction), "%03u", (unsigned) (duration % 1000));
+    logger__out_put(out, ".", 1);
+    logger__out_put(out, fraction, 3);
+
+    logger__out_str(out, ",\"args\":{\"file\":");
+    logger__out_json_string(out, site->location.file, strlen(site->location.file));
+    logger__out_str(out, ",\"line\":");
+    logger__out_u64(out, (uint64_t) site->location.line);
+    for (uint32_t i = 0; i < slot->arg_count && i < LOG_SPAN_MAX_ARGS; ++i) {
+        const char* key = __atomic_load_n(&site->keys[i], __ATOMIC_ACQUIRE);
+        if (!key)
+            continue;
+        logger__out_put(out, ",", 1);
+        logger__out_json_string(out, key, strlen(key));
+        logger__out_put(out, ":", 1);
+        if (logger__is_finite(slot->args[i]))
+            logger__out_double(out, slot->args[i]);
+        else
+            logger__out_str(out, "null");
+    }
+    logger__out_str(out, "}}");
+}
+
+void log_spans_export(int fd) {
+    char chunk[64 * 1024];
+    size_t used = 0;
+    int pid = (int) getpid();
+    int first = 1;
+    struct logger__span_slot* copy = NULL;
+
+    uint64_t origin_ns = logger__span_ns(logger__spans_origin);
+    struct logger__out header = { chunk, 256, 0 };
+    logger__out_str(&header, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"origin_ns\":");
+    logger__out_u64(&header, origin_ns);
+    logger__out_str(&header, "},\"traceEvents\":[\n");
+    used = header.total;
+
+    if (__atomic_load_n(&logger_spans_enabled, __ATOMIC_ACQUIRE))
+        copy = malloc((logger__spans_mask + 1) * sizeof(*copy));
+
+    for (struct logger__spans* s = __atomic_load_n(&logger__spans_list, __ATOMIC_ACQUIRE); s && copy; s = s->next) {
+        size_t size = logger__spans_mask + 1;
+        size_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+        size_t from = (head > size) ? head - size : 0;
+        for (size_t i = from; i < head; ++i)
+            copy[i & logger__spans_mask] = s->slots[i & logger__spans_mask];
+        // The slot of span `head` may be mid-write, and so the slots of the spans written since,
+        // unless the ring is this thread's own.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        size_t after = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+        if (s != logger__spans_local && after >= size && after - size + 1 > from)
+            from = after - size + 1;
+        int tid = __atomic_load_n(&s->tid, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&s->exported, head, __ATOMIC_RELAXED);
+
+        for (size_t i = from; i < head; ++i) {
+            const struct logger__span_slot* slot = &copy[i & logger__spans_mask];
+            if (!slot->site)
+                continue;
+            char event[1024];
+            struct logger__out out = { event, sizeof(event) - 1, 0 };
+            if (!first)
+                logger__out_put(&out, ",\n", 2);
+            logger__out_span(&out, slot, pid, tid, origin_ns);
+            if (out.total > sizeof(event) - 1)
+                continue;   // Only a name or a file longer than anyone writes gets here
+            first = 0;
+
+            if (used + out.total > sizeof(chunk)) {
+                logger__write_all(fd, chunk, used);
+                used = 0;
+            }
+            memcpy(chunk + used, event, out.total);
+            used += out.total;
+        }
+    }
+    free(copy);
+
+    const char* end = "\n]}\n";
+    if (used + strlen(end) > sizeof(chunk)) {
+        logger__write_all(fd, chunk, used);
+        used = 0;
+    }
+    memcpy(chunk + used, end, strlen(end));
+    used += strlen(end);
+    logger__write_all(fd, chunk, used);
+}
+
+
+
+// ---- Crash reporting ----
+
+static const int logger__fatal_signals[] = { SIGSEGV, SIGABRT, SIGBUS };
+static struct sigaction logger__previous_actions[sizeof(logger__fatal_signals) / sizeof(logger__fatal_signals[0])];
+static int logger__crash_reported;
+
+// Everything here is async-signal-safe, save for the first call to `backtrace`, which
+// `logger__recorder_start` makes ahead of time.
+static void logger__crash_report(void) {
+    if (__atomic_exchange_n(&logger__crash_reported, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    int fd = logger_recorder_enabled ? logger__recorder_fd : STDERR_FILENO;
+    if (logger_recorder_enabled) {
+        static const char title[] = "--- flight recorder ---\n";
+        logger__write_all(fd, title, sizeof(title) - 1);
+        log_recorder_dump(fd);
+        static const char trace[] = "--- backtrace ---\n";
+        logger__write_all(fd, trace, sizeof(trace) - 1);
+    }
+
+    void* callstack[128];
+    int frames = backtrace(callstack, 128);
+    backtrace_symbols_fd(callstack, frames - 1, fd);
+}
+
+static void logger__crash_handler(int sig) {
+    logger__crash_report();
+
+    // Hand the signal to whoever had it before, the default action by default.
+    for (size_t i = 0; i < sizeof(logger__fatal_signals) / sizeof(logger__fatal_signals[0]); ++i) {
+        if (logger__fatal_signals[i] == sig)
+            sigaction(sig, &logger__previous_actions[i], NULL);
+    }
+    raise(sig);
+}
+
+static void logger__recorder_start(size_t size, int fd) {
+    if (pthread_key_create(&logger__recorder_key, logger__recorder_thread_exit) != 0) {
+        fprintf(stderr, "logger: failed to set up the flight recorder\n");
+        return;
+    }
+    logger__recorder_size = size;
+    logger__recorder_fd = fd;
+
+    void* warm_up[1];
+    backtrace(warm_up, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = logger__crash_handler;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(logger__fatal_signals) / sizeof(logger__fatal_signals[0]); ++i)
+        sigaction(logger__fatal_signals[i], &action, &logger__previous_actions[i]);
+
+    // Other threads set up their recorder, and their signal stack, on their first statement.
+    logger__recorder_thread();
+    __atomic_store_n(&logger_recorder_enabled, 1, __ATOMIC_RELEASE);
+}
+
+
+#if defined(__ELF__)
+// Provided by the linker for the `log_callsites` section; weak so a program without call sites still links.
+extern log_callsite_t __start_log_callsites[] __attribute__((weak));
+extern log_callsite_t __stop_log_callsites[]  __attribute__((weak));
+#endif
+
+void log_callsite_foreach(log_callsite_fn fn, void* data) {
+#if defined(__ELF__)
+    if (!__start_log_callsites)
+        return;
+    for (log_callsite_t* callsite = __start_log_callsites; callsite < __stop_log_callsites; ++callsite)
+        fn(callsite, data);
+#else
+    (void) fn;
+    (void) data;
+#endif
+}
+
+struct logger__callsite_filter {
+    const char* file;
+    const char* function;
+    int line;
+    log_callsite_state_t state;
+    size_t matched;
+};
+
+static void logger__callsite_apply(log_callsite_t* callsite, void* data) {
+    struct logger__callsite_filter* filter = data;
+    if (filter->line != 0 && filter->line != callsite->location.line)
+        return;
+    if (filter->file && fnmatch(filter->file, callsite->location.file, 0) != 0)
+        return;
+    if (filter->function && fnmatch(filter->function, callsite->location.function, 0) != 0)
+        return;
+    __atomic_store_n(&callsite->state, (unsigned char) filter->state, __ATOMIC_RELAXED);
+    filter->matched += 1;
+}
+
+size_t log_callsite_set(const char* file, const char* function, int line, log_callsite_state_t state) {
+    struct logger__callsite_filter filter = { file, function, line, state, 0 };
+    log_callsite_foreach(logger__callsite_apply, &filter);
+    return filter.matched;
+}
+
+
+// Generic cell rate algorithm: a token bucket of `per_second` tokens refilled at `per_second`
+// a second, kept as the single time at which the next record is due so one CAS updates it.
+int logger_limiter_admit_rate(log_limiter_t* limiter, unsigned per_second, const log_callsite_t* callsite) {
+    if (per_second == 0) {
+        __atomic_fetch_add(&limiter->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
     }
-    initialized = 1;
+    uint64_t interval = 1000000000ull / per_second;
+    uint64_t burst    = 1000000000ull - interval;
+    uint64_t now      = logger__now();
+
+    uint64_t due = __atomic_load_n(&limiter->count, __ATOMIC_RELAXED);
+    do {
+        if (due > now + burst) {
+            __atomic_fetch_add(&limiter->suppressed, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&limiter->count, &due, ((due > now) ? due : now) + interval, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    uint64_t suppressed = __atomic_exchange_n(&limiter->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed)
+        logger_log(log_current, callsite->level, callsite->location, "suppressed %llu messages from %s:%d",
+                   (unsigned long long) suppressed, callsite->location.file, callsite->location.line);
+    return 1;
+}
+
+logger_log_fn logger_log_internal = logger_log_init;
 
-    stdout_sink = log_sink_from_fd(STDOUT_FILENO);
-    stderr_sink = log_sink_from_fd(STDERR_FILENO);
+static int assert_is_enabled = 1;
+
+int logger_assert_is_enabled(void) {
+    return assert_is_enabled;
+}
 
-    global_log_formatter = (args.formatter == NULL) ? default_formatter : args.formatter;
-    global_log_level = (args.level == LOG_DEFAULT) ? LOG_INFO : args.level;
 
-    log_default.level = global_log_level;
+// The first record does this implicitly, with `implicit` set: it keeps whatever `log_reconfigure`
+// or `log_set_level` changed already instead of starting from the defaults.
+static void logger__init(log_init_args_t args, int implicit) {
+    // 0: not yet, 1: underway on some thread, 2: done. Nothing in here logs, so the thread
+    // doing it never waits for itself.
+    static int initialized = 0;
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&initialized, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&initialized, __ATOMIC_ACQUIRE) != 2)
+            sched_yield();
+        return;
+    }
 
-    global_sinks[LOG_TRACE]  = (args.sinks[LOG_TRACE]  == NULL) ? &stdout_sink : args.sinks[LOG_TRACE];
-    global_sinks[LOG_DEBUG]  = (args.sinks[LOG_DEBUG]  == NULL) ? &stdout_sink : args.sinks[LOG_DEBUG];
-    global_sinks[LOG_INFO]   = (args.sinks[LOG_INFO]   == NULL) ? &stdout_sink : args.sinks[LOG_INFO];
-    global_sinks[LOG_WARN]   = (args.sinks[LOG_WARN]   == NULL) ? &stderr_sink : args.sinks[LOG_WARN];
-    global_sinks[LOG_ERROR]  = (args.sinks[LOG_ERROR]  == NULL) ? &stderr_sink : args.sinks[LOG_ERROR];
-    global_sinks[LOG_PANIC]  = (args.sinks[LOG_PANIC]  == NULL) ? &stderr_sink : args.sinks[LOG_PANIC];
+    if (!implicit) {
+        log_config_args_t config = { ._sentinel = 0, .formatter = args.formatter, .level = args.level, .encoder = args.encoder, .reset = 1, .routes = args.routes, .route_count = args.route_count };
+        memcpy(config.sinks, args.sinks, sizeof(config.sinks));
+        log_reconfigure_from_args(config);
+        logger__config_keep_initial();
+    }
 
     assert_is_enabled = !args.disable_asserts;
+
+    if (args.clock != LOG_CLOCK_DEFAULT)
+        logger__clock_setup(args.clock);
+    else
+        pthread_once(&logger__clock_once, logger__clock_setup_default);
+
+    if (args.binary) {
+        logger__binary_start(args.binary_fd, args.binary_dedup_ms);
+    }
+
+    if (args.recorder) {
+        logger__recorder_start(args.recorder, args.recorder_fd ? args.recorder_fd : STDERR_FILENO);
+    }
+
+    if (args.spans) {
+        logger__spans_start(args.spans);
+    }
+
+    if (args.async) {
+        size_t capacity = args.async_capacity ? args.async_capacity : LOG_ASYNC_DEFAULT_CAPACITY;
+        logger__async_start(capacity, args.async_overflow);
+    }
+    __atomic_store_n(&initialized, 2, __ATOMIC_RELEASE);
+}
+
+void log_init_from_args(log_init_args_t args) {
+    logger__init(args, 0);
 }
 
 
 __attribute__((noinline, cold))
 void logger_log_init(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args) {
-    log_init();
-    logger_log_internal = logger_log_impl;
+    logger__init((log_init_args_t) { 0 }, 1);
+    __atomic_store_n(&logger_log_internal, logger_log_impl, __ATOMIC_RELAXED);
     logger_log_impl(logger, level, source_location, message, args);
 }
 
-void logger_log_impl(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args) {
-    char buffer[1024] = { 0 };
+// ---- Message buffers ----
+// Every thread formats into buffers of its own, which are neither cleared nor allocated
+// per record. A record that doesn't fit grows the buffer to the next power of two that
+// holds it, and once the record is written the thread goes back to the inline buffer.
+
+#define LOGGER_MESSAGE_INLINE_SIZE 1024
+
+struct logger__buffer {
+    char*  data;        // NULL until first used, then `inline_data` or a heap block
+    size_t size;
+    char   inline_data[LOGGER_MESSAGE_INLINE_SIZE];
+};
+
+static THREAD_LOCAL struct logger__buffer logger__message_buffer;  // What the sink gets
+static THREAD_LOCAL struct logger__buffer logger__text_buffer;     // The message an encoder wraps
+static THREAD_LOCAL int logger__buffers_busy;                       // Logging from inside a sink or formatter
+
+static inline void logger__buffer_init(struct logger__buffer* b) {
+    if (!b->data) {
+        b->data = b->inline_data;
+        b->size = sizeof(b->inline_data);
+    }
+}
+
+// Makes room for `needed` bytes. Returns 0 when the buffer can't grow any further.
+static int logger__buffer_grow(struct logger__buffer* b, size_t needed) {
+    if (needed > LOG_MESSAGE_MAX_SIZE)
+        needed = LOG_MESSAGE_MAX_SIZE;
+    size_t size = b->size;
+    while (size < needed)
+        size *= 2;
+    if (size > LOG_MESSAGE_MAX_SIZE)
+        size = LOG_MESSAGE_MAX_SIZE;
+    if (size <= b->size)
+        return 0;
+
+    char* data = malloc(size);
+    if (!data)
+        return 0;
+    if (b->data != b->inline_data)
+        free(b->data);
+    b->data = data;
+    b->size = size;
+    return 1;
+}
+
+static inline void logger__buffer_shrink(struct logger__buffer* b) {
+    if (b->data != b->inline_data) {
+        free(b->data);
+        b->data = b->inline_data;
+        b->size = sizeof(b->inline_data);
+    }
+}
+
+
+// For statements without arguments, which still go through the formatter.
+static int logger__format(log_formatter_fn formatter, char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, ...) {
+    va_list args;
+    va_start(args, message);
+    int len = formatter(buffer, size, logger, level, source_location, message, args);
+    va_end(args);
+    return len;
+}
+
+// Formats the record as text with any fields appended. Returns the length it needs like snprintf.
+static int logger__render_text(char* buffer, int size, log_formatter_fn formatter, const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list* args, const log_field_t* fields, size_t field_count) {
+    int len;
+    if (args) {
+        va_list copy;
+        va_copy(copy, *args);
+        len = formatter(buffer, size, logger, level, source_location, message, copy);
+        va_end(copy);
+    } else {
+        len = logger__format(formatter, buffer, size, logger, level, source_location, "%s", message);
+    }
+
+    if (field_count && len >= 0) {
+        size_t used = (len < size) ? (size_t) len : (size_t) size - 1;
+        struct logger__out out = { buffer + used, (size_t) size - 1 - used, (size_t) len };
+        logger__out_logfmt_fields(&out, fields, field_count);
+        len = logger__out_finish(&out, 1);
+    }
+    return len;
+}
+
+// Runs the encoder, or else the formatter, over the record into `out`. Returns the length written.
+static size_t logger__render(struct logger__buffer* out, struct logger__buffer* text, log_encoder_fn encoder, log_formatter_fn formatter, const struct log_ctx_t* logger, log_record_t record) {
+    const char* message = record.format;
+    va_list* args = record.args;
     int total_len;
 
-    log_formatter_fn formatter = logger->formatter;
-    if (!formatter)
-        formatter = get_global_log_formatter();
-    if (!formatter)
-        formatter = default_formatter;
+    if (encoder) {
+        if (args) {
+            int len;
+            for (;;) {
+                va_list copy;
+                va_copy(copy, *args);
+                len = log_vformat(text->data, (int) text->size, message, copy);
+                va_end(copy);
+                if (len < (int) text->size || !logger__buffer_grow(text, (size_t) len + 1))
+                    break;
+            }
+            record.message = text->data;
+            record.message_len = (len < 0) ? 0 : (len >= (int) text->size) ? text->size - 1 : (size_t) len;
+        } else {
+            record.message = message;
+            record.message_len = strlen(message);
+        }
+
+        do {
+            total_len = encoder(out->data, (int) out->size, &record);
+        } while (total_len >= (int) out->size && logger__buffer_grow(out, (size_t) total_len + 1));
+    } else {
+        if (!formatter)
+            formatter = default_formatter;
 
-    total_len = formatter(buffer, (int) sizeof(buffer), logger, level, source_location, message, args);
+        do {
+            total_len = logger__render_text(out->data, (int) out->size, formatter, logger, record.level, record.location, message, args, record.fields, record.field_count);
+        } while (total_len >= (int) out->size && logger__buffer_grow(out, (size_t) total_len + 1));
+    }
 
     if (total_len < 0)
         total_len = 0;
+    if (total_len >= (int) out->size) {
+        total_len = (int) out->size - 1;
+        logger__stats_count_truncated(record.level);
+    }
+    return (size_t) total_len;
+}
+
+// `args` is NULL when `message` is not a format, as for `log_fields`.
+// The record goes to the sink of its level and to every route it matches. Sinks are picked
+// before anything is formatted, and the text is only rendered when one of them wants it.
+static void logger__log(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list* args, const log_field_t* fields, size_t field_count) {
+    uint64_t start = logger__stats_start(0);
+
+    // A scope pushed since the last reconfiguration has everything filled in already.
+    const struct logger__config* config = logger__config_enter();
+    log_encoder_fn     encoder     = logger->encoder;
+    log_formatter_fn   formatter   = logger->formatter;
+    log_sink_t*        sink        = logger->sinks[level];
+    const log_route_t* routes      = logger->routes;
+    size_t             route_count = logger->route_count;
+    if (__builtin_expect(logger->config_version != config->version, 0)) {
+        // Not pushed (`log_default`, a context passed by hand) or pushed before a reconfiguration.
+        unsigned inherited = logger->inherited;
+        if (!logger->config_version && !route_count)
+            inherited |= LOGGER__INHERIT_ROUTES | (sink ? 0 : 1u << level);
+        if (!encoder || (inherited & LOGGER__INHERIT_ENCODER))
+            encoder = config->encoder;
+        if (!formatter || (inherited & LOGGER__INHERIT_FORMATTER))
+            formatter = config->formatter;
+        if (inherited & (1u << level))
+            sink = config->sinks[level];
+        if (inherited & LOGGER__INHERIT_ROUTES) {
+            routes = config->routes;
+            route_count = config->route_count;
+        }
+    }
+
+    // Bit 0 stands for the level's sink, bit i + 1 for route i.
+    uint32_t candidates = (sink && sink->write) ? 1 : 0;
+    for (size_t i = 0; i < route_count && i < LOG_MAX_ROUTES; ++i) {
+        const log_route_t* route = &routes[i];
+        if (route->sink && route->sink->write && level >= route->level)
+            candidates |= 2u << i;
+    }
+    if (!candidates) {
+        logger__config_exit(config);
+        logger__stats_count_logged(level, start, 1);
+        return;
+    }
 
-    if (total_len >= (int) sizeof(buffer))
-        total_len = (int) sizeof(buffer) - 1;
+    uint64_t timestamp = logger__now();
+    logger__record_timestamp = timestamp;
 
     struct log_record_t record = {
             .logger_name = logger->name,
             .level       = level,
             .location    = source_location,
-            .message     = buffer,
-            .message_len = (size_t)total_len,
+            .message     = NULL,
+            .message_len = 0,
+            .timestamp   = timestamp,
+            .fields      = fields,
+            .field_count = field_count,
+            .format      = message,
+            .args        = args,
+    };
+
+    uint32_t matched = candidates & 1;
+    for (uint32_t rest = candidates >> 1; rest; rest &= rest - 1) {
+        const log_route_t* route = &routes[__builtin_ctz(rest)];
+        if (!route->filter || route->filter(route->filter_data, &record))
+            matched |= 2u << __builtin_ctz(rest);
+    }
+
+    int wants_text = 0;
+    for (uint32_t rest = matched; rest; rest &= rest - 1) {
+        unsigned bit = (unsigned) __builtin_ctz(rest);
+        log_sink_t* target = bit ? routes[bit - 1].sink : sink;
+        if (target->flags & LOG_SINK_RAW)
+            logger__sink_write(target, &record);
+        else
+            wants_text = 1;
+    }
+
+    if (wants_text) {
+        struct logger__buffer* out  = &logger__message_buffer;
+        struct logger__buffer* text = &logger__text_buffer;
+        struct logger__buffer nested_out, nested_text;
+        if (logger__buffers_busy) {
+            nested_out.data  = NULL;
+            nested_text.data = NULL;
+            out  = &nested_out;
+            text = &nested_text;
+        }
+        logger__buffers_busy += 1;
+        logger__buffer_init(out);
+        logger__buffer_init(text);
+
+        struct log_record_t formatted = record;
+        formatted.message_len = logger__render(out, text, encoder, formatter, logger, record);
+        formatted.message     = out->data;
+
+        for (uint32_t rest = matched; rest; rest &= rest - 1) {
+            unsigned bit = (unsigned) __builtin_ctz(rest);
+            log_sink_t* target = bit ? routes[bit - 1].sink : sink;
+            if (!(target->flags & LOG_SINK_RAW))
+                logger__dispatch(target, &formatted);
+        }
+
+        logger__buffer_shrink(out);
+        logger__buffer_shrink(text);
+        logger__buffers_busy -= 1;
+    }
+    logger__config_exit(config);
+    logger__stats_count_logged(level, start, matched == 0);
+}
+
+void logger_log_impl(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    logger__log(logger, level, source_location, message, &copy, NULL, 0);
+    va_end(copy);
+}
+
+void logger_log_fields(const struct log_ctx_t* logger, log_level_t level, source_location_t source_location, const char* message, const log_field_t* fields, size_t field_count) {
+    if (__builtin_expect(__atomic_load_n(&logger_log_internal, __ATOMIC_RELAXED) != logger_log_impl, 0)) {
+        logger__init((log_init_args_t) { 0 }, 1);
+        __atomic_store_n(&logger_log_internal, logger_log_impl, __ATOMIC_RELAXED);
+    }
+    logger__log(logger, level, source_location, message, NULL, fields, field_count);
+}
+
+
+// ---- Dedup sink ----
+// A record is identified by the hash of its message and fields, seeded with its callsite. The
+// "repeated" record is formatted here, on the stack, as the sink's own records were formatted before.
+
+#define LOGGER__DEDUP_LINE_SIZE 512
+
+LOGGER__REGISTRY(struct dedup_sink_state, logger__dedup_sinks)
+
+// Passes on how often the last record was repeated, if it was. Must hold the sink's lock.
+static void logger__dedup_report(struct dedup_sink_state* st) {
+    if (st->repeated == 0)
+        return;
+
+    char text[64];
+    int text_len = snprintf(text, sizeof(text), "previous message repeated %zu times", st->repeated);
+    // None of the fields or arguments of the repeated record; they were only valid during its call.
+    log_record_t record = {
+        .logger_name = st->last.logger_name,
+        .level       = st->last.level,
+        .location    = st->last.location,
+        .message     = text,
+        .message_len = (size_t) text_len,
+        .timestamp   = st->last_ns,
+        .format      = text,
+    };
+    st->repeated = 0;
+
+    char line[LOGGER__DEDUP_LINE_SIZE];
+    uint64_t timestamp = logger__record_timestamp;
+    logger__record_timestamp = record.timestamp;
+    int len;
+    if (st->encoder) {
+        len = st->encoder(line, (int) sizeof(line), &record);
+    } else {
+        log_ctx_t logger = { .name = record.logger_name };
+        len = logger__format(st->formatter ? st->formatter : default_formatter, line, (int) sizeof(line), &logger, record.level, record.location, "%s", text);
+    }
+    logger__record_timestamp = timestamp;
+
+    if (len < 0)
+        len = 0;
+    if (len >= (int) sizeof(line))
+        len = (int) sizeof(line) - 1;
+    record.message     = line;
+    record.message_len = (size_t) len;
+    logger__dispatch(st->sink, &record);
+}
+
+static int logger__message_formatter(char* buffer, int size, const struct log_ctx_t* logger, log_level_t level, source_location_t location, const char* format, va_list args) {
+    (void) logger; (void) level; (void) location;
+    return log_vformat(buffer, size, format, args);
+}
+
+// Records that aren't from a statement, e.g. passed on by another sink, only have their text.
+static uint64_t logger__dedup_hash(const struct log_record_t* record) {
+    uint64_t seed = (uint64_t) (uintptr_t) record->location.file ^ ((uint64_t) record->location.line << 48);
+    if (!record->format)
+        return logger__hash(record->message, record->message_len, seed);
+
+    char text[LOGGER__DEDUP_LINE_SIZE];
+    char* buffer = text;
+    int len = logger__render_text(text, (int) sizeof(text), logger__message_formatter, NULL, record->level, record->location, record->format, record->args, record->fields, record->field_count);
+    if (len >= (int) sizeof(text) && (buffer = malloc((size_t) len + 1)) != NULL)
+        len = logger__render_text(buffer, len + 1, logger__message_formatter, NULL, record->level, record->location, record->format, record->args, record->fields, record->field_count);
+    if (!buffer) {
+        buffer = text;
+        len = (int) sizeof(text) - 1;
+    }
+
+    uint64_t hash = logger__hash(buffer, (len > 0) ? (size_t) len : 0, seed);
+    if (buffer != text)
+        free(buffer);
+    return hash;
+}
+
+static void dedup_sink_write(void* data, const struct log_record_t* record) {
+    struct dedup_sink_state* st = data;
+    uint64_t hash = logger__dedup_hash(record);
+    uint64_t window_ns = (uint64_t) st->window_ms * 1000000u;
+
+    logger__spin_lock(&st->lock);
+    if (hash == st->hash && record->timestamp - st->last.timestamp < window_ns) {
+        st->repeated += 1;
+        st->suppressed += 1;
+        st->last_ns = record->timestamp;
+        logger__spin_unlock(&st->lock);
+        return;
+    }
+
+    logger__dedup_report(st);
+    st->hash = hash;
+    st->last = (log_record_t) {
+        .logger_name = record->logger_name,
+        .level       = record->level,
+        .location    = record->location,
+        .timestamp   = record->timestamp,
     };
+    logger__dispatch(st->sink, record);
+    logger__spin_unlock(&st->lock);
+}
 
-    log_sink_t* sink = logger->sinks[level];
-    if (!sink)
-        sink = get_global_sink(level);
-    if (sink && sink->write) {
-        sink->write(sink->data, &record);
+static void logger__dedup_sinks_flush(void) {
+    pthread_mutex_lock(&logger__dedup_sinks_lock);
+    for (struct dedup_sink_state* st = logger__dedup_sinks; st; st = st->next) {
+        logger__spin_lock(&st->lock);
+        logger__dedup_report(st);
+        logger__spin_unlock(&st->lock);
     }
+    pthread_mutex_unlock(&logger__dedup_sinks_lock);
+}
+
+log_sink_t log_sink_dedup(struct dedup_sink_state* st) {
+    log_sink_t sink = {
+        .write = (st->sink && st->sink->write) ? dedup_sink_write : NULL,
+        .data  = st,
+        .flags = LOG_SINK_INLINE
+    };
+    // Starting over would lose the count of repeats not reported yet.
+    if (logger__dedup_sinks_contains(st))
+        return sink;
+
+    if (st->window_ms <= 0)
+        st->window_ms = LOG_DEDUP_DEFAULT_WINDOW_MS;
+    st->lock = 0;
+    st->hash = 0;
+    st->repeated = 0;
+    st->suppressed = 0;
+    memset(&st->last, 0, sizeof(st->last));
+
+    logger__dedup_sinks_add(st);
+    return sink;
+}
+
+void log_sink_dedup_close(struct dedup_sink_state* st) {
+    logger__dedup_sinks_remove(st);
+
+    logger__spin_lock(&st->lock);
+    logger__dedup_report(st);
+    logger__spin_unlock(&st->lock);
 }
 
 
@@ -0,0 +1,181 @@
+/*
+ * Drains the shared memory ring written by `log_sink_shm` from any number of processes,
+ * writing each record as a line to stdout in the order the records were reserved.
+ *
+ *     logger_collect [-p] [-d] [-u] [-s STALL_MS] NAME
+ *
+ *   -p   Starts every line with the writer's pid.
+ *   -d   Exits once the ring is empty instead of waiting for more records.
+ *   -u   Removes the ring when exiting.
+ *   -s   Gives up on a record still being written after STALL_MS milliseconds (default 5000).
+ *        A record whose writer no longer exists is given up on right away.
+ *
+ * A record that doesn't match its checksum is dropped: a writer that was given up on while
+ * only slow may have copied into the slot after a writer a lap later took it.
+ *
+ * Only one collector may drain a ring at a time. Start it after the ring was created: a
+ * ring created again with another size can't be followed. SIGINT and SIGTERM stop it after
+ * the record at hand; it tells on stderr how many records it collected, how many it gave
+ * up on, how many were torn and how many writers dropped because the ring was full, since
+ * it was created.
+ */
+#define _DEFAULT_SOURCE
+#define LOGGER_IMPLEMENTATION
+#include "logger.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stop = 1;
+}
+
+static void sleep_us(long us) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = us * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static int writer_exists(int32_t pid) {
+    return pid <= 0 || kill((pid_t) pid, 0) == 0 || errno != ESRCH;
+}
+
+
+int main(int argc, char** argv) {
+    int with_pid = 0;
+    int drain = 0;
+    int remove_ring = 0;
+    long stall_ms = 5000;
+    const char* name = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* opt = argv[i];
+        if (strcmp(opt, "-p") == 0) {
+            with_pid = 1;
+        } else if (strcmp(opt, "-d") == 0) {
+            drain = 1;
+        } else if (strcmp(opt, "-u") == 0) {
+            remove_ring = 1;
+        } else if (strcmp(opt, "-s") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            stall_ms = atol(argv[++i]);
+        } else if (opt[0] != '-' && !name) {
+            name = opt;
+        } else {
+            fprintf(stderr, "logger_collect: bad option %s\n", opt);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!name) {
+        fprintf(stderr, "usage: logger_collect [-p] [-d] [-u] [-s STALL_MS] NAME\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t size;
+    struct logger__shm_ring* ring = logger__shm_map(name, 0, 0, 0, &size);
+    if (!ring) {
+        fprintf(stderr, "logger_collect: cannot open the ring '%s'\n", name);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Lines are gathered and written in one go whenever the ring runs dry or this fills up.
+    static char out[1 << 16];
+    size_t used = 0;
+    size_t line_max = ring->slot_size + 16;
+
+    uint64_t collected = 0;
+    uint64_t abandoned = 0;
+    uint64_t torn = 0;
+    uint64_t waiting_since = 0;
+
+    while (!stop) {
+        uint64_t sequence = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        struct logger__shm_slot* slot = logger__shm_slot(ring, sequence);
+        uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if (state == 4 * sequence + LOGGER_SHM_COMPLETE) {
+            if (used + line_max > sizeof(out)) {
+                logger__write_all(STDOUT_FILENO, out, used);
+                used = 0;
+            }
+            // Copied out first, then checked, as a late writer may still change the slot.
+            int32_t pid = slot->pid;
+            uint32_t len = slot->len;
+            uint64_t timestamp = slot->timestamp;
+            uint64_t check = slot->check;
+            size_t start = used;
+            if (len > ring->slot_size - sizeof(*slot))
+                len = 0;
+            if (with_pid)
+                used += (size_t) snprintf(out + used, 16, "%d ", (int) pid);
+            memcpy(out + used, slot->text, len);
+            if (logger__shm_check(sequence, pid, len, timestamp, out + used) == check) {
+                used += len;
+                out[used++] = '\n';
+                collected += 1;
+            } else {
+                used = start;
+                torn += 1;
+            }
+
+            __atomic_store_n(&ring->tail, sequence + 1, __ATOMIC_RELEASE);
+            waiting_since = 0;
+            continue;
+        }
+
+        if (sequence == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            if (used > 0) {
+                logger__write_all(STDOUT_FILENO, out, used);
+                used = 0;
+            }
+            if (drain)
+                break;
+            sleep_us(1000);
+            continue;
+        }
+
+        // Reserved, but not written yet.
+        uint64_t now = log_now();
+        if (waiting_since == 0)
+            waiting_since = now;
+        int writing = state == 4 * sequence + LOGGER_SHM_WRITING;
+        if ((writing && !writer_exists(__atomic_load_n(&slot->pid, __ATOMIC_RELAXED)))
+            || now - waiting_since >= (uint64_t) stall_ms * 1000000) {
+            if (__atomic_compare_exchange_n(&slot->state, &state, 4 * sequence + LOGGER_SHM_ABANDONED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&ring->tail, sequence + 1, __ATOMIC_RELEASE);
+                abandoned += 1;
+                waiting_since = 0;
+            }
+            continue;
+        }
+        sleep_us(writing ? 10 : 100);
+    }
+
+    if (used > 0)
+        logger__write_all(STDOUT_FILENO, out, used);
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    fprintf(stderr, "logger_collect: %llu records collected, %llu abandoned, %llu torn, %llu dropped by writers since the ring was created\n",
+            (unsigned long long) collected, (unsigned long long) abandoned, (unsigned long long) torn, (unsigned long long) dropped);
+
+    munmap(ring, size);
+    if (remove_ring && shm_unlink(name) != 0) {
+        fprintf(stderr, "logger_collect: cannot remove the ring '%s'\n", name);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
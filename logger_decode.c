@@ -0,0 +1,426 @@
+/*
+ * Turns the stream written by `log_init(.binary = 1, .binary_fd = fd)` back into
+ * the text `default_formatter` would have produced.
+ *
+ *     logger_decode [-t] [FILE]     (reads stdin when FILE is omitted)
+ *
+ * With -t every line is prefixed with the time of the record, like `timestamp_formatter`.
+ *
+ * The stream must come from a machine with the same byte order and type sizes.
+ */
+#define LOGGER_IMPLEMENTATION
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+typedef struct callsite_t {
+    uint64_t    id;
+    log_level_t level;
+    int         line;
+    char*       file;
+    char*       function;
+    char*       format;
+    int         arg_count;
+    unsigned char arg_types[LOG_MAX_ARGS];
+} callsite_t;
+
+typedef struct entry_t {
+    uint64_t    timestamp;
+    size_t      offset;     /* Of the callsite ID, right after the record size */
+    size_t      order;      /* Keeps records with equal timestamps in stream order */
+    uint32_t    repeated;   /* Of an 'N' entry, whose offset is that of the callsite ID too */
+} entry_t;
+
+typedef struct reader_t {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    int    failed;
+} reader_t;
+
+
+static const void* take(reader_t* r, size_t n) {
+    if (r->failed || r->size - r->pos < n) {
+        r->failed = 1;
+        return NULL;
+    }
+    const void* p = r->data + r->pos;
+    r->pos += n;
+    return p;
+}
+
+#define DEFINE_READ(name, type) \
+    static type name(reader_t* r) { type v = 0; const void* p = take(r, sizeof(type)); if (p) memcpy(&v, p, sizeof(type)); return v; }
+
+DEFINE_READ(read_u8,  uint8_t)
+DEFINE_READ(read_u16, uint16_t)
+DEFINE_READ(read_u32, uint32_t)
+DEFINE_READ(read_u64, uint64_t)
+DEFINE_READ(read_i32, int32_t)
+DEFINE_READ(read_i64, int64_t)
+DEFINE_READ(read_f64, double)
+
+static char* read_string(reader_t* r) {
+    uint16_t len = read_u16(r);
+    if (len == LOGGER_BINARY_NULL_STRING)
+        return NULL;
+    const char* p = take(r, len);
+    char* str = malloc((size_t) len + 1);
+    if (p) memcpy(str, p, len);
+    str[p ? len : 0] = '\0';
+    return str;
+}
+
+
+static callsite_t* callsites = NULL;
+static size_t callsite_capacity = 0;    /* Power of two, open addressing on `id` */
+static size_t callsite_count = 0;
+
+static callsite_t* find_callsite(uint64_t id) {
+    if (callsite_capacity == 0)
+        return NULL;
+    size_t mask = callsite_capacity - 1;
+    for (size_t i = (size_t) (id >> 3) & mask; ; i = (i + 1) & mask) {
+        if (callsites[i].id == id) return &callsites[i];
+        if (callsites[i].id == 0)  return NULL;
+    }
+}
+
+static void add_callsite(callsite_t site) {
+    if ((callsite_count + 1) * 2 > callsite_capacity) {
+        callsite_t* old = callsites;
+        size_t old_capacity = callsite_capacity;
+        callsite_capacity = old_capacity ? old_capacity * 2 : 256;
+        callsites = calloc(callsite_capacity, sizeof(*callsites));
+        callsite_count = 0;
+        for (size_t i = 0; i < old_capacity; ++i)
+            if (old[i].id != 0) add_callsite(old[i]);
+        free(old);
+    }
+
+    size_t mask = callsite_capacity - 1;
+    size_t i = (size_t) (site.id >> 3) & mask;
+    while (callsites[i].id != 0 && callsites[i].id != site.id)
+        i = (i + 1) & mask;
+    if (callsites[i].id == 0)
+        callsite_count += 1;
+    callsites[i] = site;
+}
+
+
+// Whether `conversion` can print a value captured as `type`. The format and the argument
+// types of a call site may disagree, and printf must never get e.g. an address for %s.
+static int accepts(char conversion, log_arg_type_t type) {
+    switch (conversion) {
+        case 's':   return type == LOG_ARG_STRING;
+        case 'p':   return type == LOG_ARG_POINTER;
+        case 'c':   return type == LOG_ARG_INT;
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                    return type == LOG_ARG_INT || type == LOG_ARG_INT64;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                    return type == LOG_ARG_DOUBLE || type == LOG_ARG_LONG_DOUBLE;
+        default:    return 0;
+    }
+}
+
+// Shows a value its conversion can't print as what was captured, e.g. "<pointer 0x5610>".
+static int render_mismatch(char* out, size_t size, reader_t* r, log_arg_type_t type) {
+    switch (type) {
+        case LOG_ARG_INT:           return snprintf(out, size, "<int %d>", read_i32(r));
+        case LOG_ARG_INT64:         return snprintf(out, size, "<int64 %lld>", (long long) read_i64(r));
+        case LOG_ARG_DOUBLE:
+        case LOG_ARG_LONG_DOUBLE:   return snprintf(out, size, "<double %g>", read_f64(r));
+        case LOG_ARG_POINTER:       return snprintf(out, size, "<pointer 0x%llx>", (unsigned long long) read_u64(r));
+        case LOG_ARG_STRING: {
+            char* str = read_string(r);
+            int len = str ? snprintf(out, size, "<string \"%s\">", str) : snprintf(out, size, "<string (null)>");
+            free(str);
+            return len;
+        }
+        default:                    return 0;
+    }
+}
+
+// Takes the next value, whatever it was captured as, as the `int` a '*' width or precision
+// should be; 0 if it isn't a number.
+static int take_int(reader_t* r, log_arg_type_t type) {
+    switch (type) {
+        case LOG_ARG_INT:           return read_i32(r);
+        case LOG_ARG_INT64:         return (int) read_i64(r);
+        case LOG_ARG_DOUBLE:
+        case LOG_ARG_LONG_DOUBLE:   read_f64(r); return 0;
+        case LOG_ARG_POINTER:       read_u64(r); return 0;
+        case LOG_ARG_STRING:        free(read_string(r)); return 0;
+        default:                    return 0;
+    }
+}
+
+// Renders one conversion specification, e.g. "%-8.3lf", with the captured value.
+// Length modifiers are replaced to match how the value was captured.
+static int render_arg(char* out, size_t size, const char* spec, size_t spec_len, reader_t* r, log_arg_type_t type) {
+    char fmt[64];
+    size_t n = 0;
+    char conversion = spec[spec_len - 1];
+    if (!accepts(conversion, type))
+        return render_mismatch(out, size, r, type);
+
+    for (size_t i = 0; i < spec_len - 1 && n < sizeof(fmt) - 4; ++i) {
+        char ch = spec[i];
+        if (ch == 'l' || ch == 'L' || ch == 'j' || ch == 'z' || ch == 't' || ch == 'q')
+            continue;
+        if (ch == 'h' && type != LOG_ARG_INT)
+            continue;
+        fmt[n++] = ch;
+    }
+    if (type == LOG_ARG_INT64) {
+        fmt[n++] = 'l';
+        fmt[n++] = 'l';
+    }
+    fmt[n++] = conversion;
+    fmt[n]   = '\0';
+
+    switch (type) {
+        case LOG_ARG_INT:           return snprintf(out, size, fmt, read_i32(r));
+        case LOG_ARG_INT64:         return snprintf(out, size, fmt, (long long) read_i64(r));
+        case LOG_ARG_DOUBLE:
+        case LOG_ARG_LONG_DOUBLE:   return snprintf(out, size, fmt, read_f64(r));
+        case LOG_ARG_POINTER:       return snprintf(out, size, fmt, (void*) (uintptr_t) read_u64(r));
+        case LOG_ARG_STRING: {
+            char* str = read_string(r);
+            int len = snprintf(out, size, fmt, str ? str : "(null)");
+            free(str);
+            return len;
+        }
+        default:                    return 0;
+    }
+}
+
+// Walks the format string like printf does, pulling each argument out of the record.
+static size_t render_message(char* out, size_t size, const callsite_t* site, reader_t* r) {
+    const char* f = site->format;
+    int arg = 1;
+    size_t len = 0;
+
+    while (*f && len + 1 < size) {
+        if (*f != '%') {
+            out[len++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[len++] = '%';
+            f += 2;
+            continue;
+        }
+
+        // '*' width and precision consume an argument of their own.
+        const char* start = f++;
+        char spec[64];
+        size_t spec_len = 0;
+        spec[spec_len++] = '%';
+        while (*f && !strchr("diouxXeEfFgGaAcspn", *f) && spec_len < sizeof(spec) - 16) {
+            if (*f == '*' && arg < site->arg_count) {
+                int value = take_int(r, (log_arg_type_t) site->arg_types[arg++]);
+                spec_len += (size_t) snprintf(spec + spec_len, sizeof(spec) - spec_len, "%d", value);
+            } else {
+                spec[spec_len++] = *f;
+            }
+            ++f;
+        }
+        if (!*f || arg >= site->arg_count) {
+            // Malformed format or missing argument; copy the rest verbatim.
+            while (*start && len + 1 < size)
+                out[len++] = *start++;
+            break;
+        }
+        spec[spec_len++] = *f++;
+
+        if (spec[spec_len - 1] == 'n') {
+            take_int(r, (log_arg_type_t) site->arg_types[arg++]);
+            continue;
+        }
+
+        int n = render_arg(out + len, size - len, spec, spec_len, r, (log_arg_type_t) site->arg_types[arg++]);
+        if (n > 0)
+            len += ((size_t) n < size - len) ? (size_t) n : size - len - 1;
+    }
+
+    out[len] = '\0';
+    return len;
+}
+
+static log_formatter_fn line_formatter = default_formatter;
+
+static int format_line(char* buffer, int size, const log_ctx_t* logger, log_level_t level, source_location_t location, const char* message, ...) {
+    va_list args;
+    va_start(args, message);
+    int len = line_formatter(buffer, size, logger, level, location, message, args);
+    va_end(args);
+    return len;
+}
+
+
+static int compare_entries(const void* a, const void* b) {
+    const entry_t* x = a;
+    const entry_t* y = b;
+    if (x->timestamp != y->timestamp)
+        return (x->timestamp < y->timestamp) ? -1 : 1;
+    return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+static unsigned char* read_file(FILE* file, size_t* out_size) {
+    size_t capacity = 1 << 20;
+    size_t size = 0;
+    unsigned char* data = malloc(capacity);
+    size_t n;
+    while ((n = fread(data + size, 1, capacity - size, file)) > 0) {
+        size += n;
+        if (size == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    *out_size = size;
+    return data;
+}
+
+
+int main(int argc, char** argv) {
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-t") == 0) {
+        line_formatter = timestamp_formatter;
+        arg += 1;
+    }
+
+    FILE* file = stdin;
+    if (arg < argc && !(file = fopen(argv[arg], "rb"))) {
+        fprintf(stderr, "logger_decode: cannot open '%s'\n", argv[arg]);
+        return EXIT_FAILURE;
+    }
+
+    size_t size;
+    unsigned char* data = read_file(file, &size);
+    if (file != stdin)
+        fclose(file);
+
+    if (size < sizeof(LOGGER_BINARY_MAGIC) || memcmp(data, LOGGER_BINARY_MAGIC, sizeof(LOGGER_BINARY_MAGIC)) != 0) {
+        fprintf(stderr, "logger_decode: not a binary log stream\n");
+        return EXIT_FAILURE;
+    }
+
+    // First pass: collect callsite definitions and the position of every record. A
+    // record may precede the definition of its callsite when it comes from another
+    // thread's buffer, so records are only decoded once everything has been read.
+    reader_t r = { data, size, sizeof(LOGGER_BINARY_MAGIC), 0 };
+    entry_t* entries = NULL;
+    size_t entry_count = 0;
+    size_t entry_capacity = 0;
+
+    while (r.pos < r.size && !r.failed) {
+        char tag = (char) read_u8(&r);
+        if (tag == 'D') {
+            callsite_t site = { 0 };
+            site.id        = read_u64(&r);
+            site.level     = (log_level_t) read_u8(&r);
+            site.line      = (int) read_u32(&r);
+            site.file      = read_string(&r);
+            site.function  = read_string(&r);
+            site.format    = read_string(&r);
+            site.arg_count = read_u8(&r);
+            if (site.arg_count > LOG_MAX_ARGS) { r.failed = 1; break; }
+            const void* types = take(&r, (size_t) site.arg_count);
+            if (types) memcpy(site.arg_types, types, (size_t) site.arg_count);
+            add_callsite(site);
+        } else if (tag == 'R' || tag == 'N') {
+            if (entry_count == entry_capacity) {
+                entry_capacity = entry_capacity ? entry_capacity * 2 : 4096;
+                entries = realloc(entries, entry_capacity * sizeof(*entries));
+            }
+            entry_t* e = &entries[entry_count];
+            if (tag == 'N') {
+                e->offset    = r.pos;
+                e->order     = entry_count;
+                read_u64(&r);
+                e->timestamp = read_u64(&r);
+                e->repeated  = read_u32(&r);
+                if (r.failed || e->repeated == 0)
+                    break;
+                entry_count += 1;
+                continue;
+            }
+            uint32_t record_size = read_u32(&r);
+            e->offset    = r.pos;
+            e->order     = entry_count;
+            e->repeated  = 0;
+            read_u64(&r);
+            e->timestamp = read_u64(&r);
+            if (r.failed || record_size < 2 * sizeof(uint64_t))
+                break;
+            r.pos = e->offset;
+            take(&r, record_size);
+            entry_count += 1;
+        } else {
+            fprintf(stderr, "logger_decode: corrupt entry '%c' at offset %zu\n", tag, r.pos - 1);
+            r.failed = 1;
+        }
+    }
+
+    // Second pass: render the records in time order.
+    qsort(entries, entry_count, sizeof(*entries), compare_entries);
+
+    // Grown to fit the longest record, up to LOG_MESSAGE_MAX_SIZE like text mode.
+    size_t message_size = 1024;
+    size_t line_size = 1024;
+    char* message = malloc(message_size);
+    char* line = malloc(line_size);
+    for (size_t i = 0; i < entry_count; ++i) {
+        reader_t rec = { data, size, entries[i].offset, 0 };
+        uint64_t id = read_u64(&rec);
+        read_u64(&rec);
+        char* name = entries[i].repeated ? NULL : read_string(&rec);
+
+        const callsite_t* site = find_callsite(id);
+        if (!site) {
+            fprintf(stderr, "logger_decode: record of unknown callsite %#llx\n", (unsigned long long) id);
+            free(name);
+            continue;
+        }
+        if (entries[i].repeated) {
+            snprintf(message, message_size, "previous message repeated %u times", (unsigned) entries[i].repeated);
+        } else {
+            size_t start = rec.pos;
+            while (render_message(message, message_size, site, &rec) + 1 >= message_size && message_size < LOG_MESSAGE_MAX_SIZE) {
+                message_size *= 2;
+                message = realloc(message, message_size);
+                rec.pos = start;
+            }
+        }
+
+        log_ctx_t logger = { .name = name };
+        source_location_t location = { site->file, site->function, site->line };
+        logger__record_timestamp = entries[i].timestamp;
+        int len = format_line(line, (int) line_size, &logger, site->level, location, "%s", message);
+        if (len >= (int) line_size) {
+            line_size = (size_t) len + 1;
+            line = realloc(line, line_size);
+            len = format_line(line, (int) line_size, &logger, site->level, location, "%s", message);
+        }
+        if (len < 0)
+            len = 0;
+        if (len >= (int) line_size)
+            len = (int) line_size - 1;
+
+        fwrite(line, 1, (size_t) len, stdout);
+        fputc('\n', stdout);
+        free(name);
+    }
+
+    free(message);
+    free(line);
+    free(entries);
+    free(data);
+    return r.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*
+ * Turns the frames written by `log_sink_compressed` back into the text of the records.
+ *
+ *     logger_decompress [FILE]     (reads stdin when FILE is omitted)
+ *
+ * Every frame decodes on its own: a damaged one is reported and skipped, and decoding
+ * carries on with the next frame. A frame cut short, e.g. by a crash while it was being
+ * written, ends the output.
+ *
+ * The file must come from a machine with the same byte order.
+ */
+#define LOGGER_IMPLEMENTATION
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+static unsigned char* read_file(FILE* file, size_t* out_size) {
+    size_t capacity = 1 << 20;
+    size_t size = 0;
+    unsigned char* data = malloc(capacity);
+    size_t n;
+    while ((n = fread(data + size, 1, capacity - size, file)) > 0) {
+        size += n;
+        if (size == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    *out_size = size;
+    return data;
+}
+
+// Position of the next frame magic at or after `pos`, or `size` if there is none.
+static size_t find_frame(const unsigned char* data, size_t size, size_t pos) {
+    while (pos + sizeof(LOGGER_COMPRESSED_MAGIC) <= size) {
+        if (memcmp(data + pos, LOGGER_COMPRESSED_MAGIC, sizeof(LOGGER_COMPRESSED_MAGIC)) == 0)
+            return pos;
+        pos += 1;
+    }
+    return size;
+}
+
+
+int main(int argc, char** argv) {
+    FILE* file = stdin;
+    if (argc > 1 && !(file = fopen(argv[1], "rb"))) {
+        fprintf(stderr, "logger_decompress: cannot open '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    size_t size;
+    unsigned char* data = read_file(file, &size);
+    if (file != stdin)
+        fclose(file);
+
+    if (size > 0 && find_frame(data, size, 0) != 0) {
+        fprintf(stderr, "logger_decompress: not a compressed log\n");
+        free(data);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char* text = NULL;
+    size_t text_capacity = 0;
+    size_t damaged = 0;
+    int truncated = 0;
+
+    size_t pos = 0;
+    while (pos < size) {
+        if (size - pos < LOGGER_COMPRESSED_HEADER_SIZE) {
+            truncated = 1;
+            break;
+        }
+        uint32_t header[3];
+        memcpy(header, data + pos + sizeof(LOGGER_COMPRESSED_MAGIC), sizeof(header));
+        uint32_t text_size = header[0];
+        uint32_t payload_size = header[1];
+        const unsigned char* payload = data + pos + LOGGER_COMPRESSED_HEADER_SIZE;
+
+        int valid = text_size > 0 && text_size <= LOGGER_COMPRESSED_MAX_FRAME && payload_size <= text_size;
+        if (valid && size - pos - LOGGER_COMPRESSED_HEADER_SIZE < payload_size) {
+            truncated = 1;
+            break;
+        }
+
+        if (valid && text_size > text_capacity) {
+            free(text);
+            text_capacity = text_size;
+            text = malloc(text_capacity);
+        }
+        if (valid) {
+            ptrdiff_t n = text_size;
+            if (payload_size == text_size)
+                memcpy(text, payload, text_size);
+            else
+                n = logger__lz_decompress(payload, payload_size, text, text_size);
+            valid = n == (ptrdiff_t) text_size && logger__lz_checksum(text, text_size) == header[2];
+        }
+
+        if (!valid) {
+            fprintf(stderr, "logger_decompress: damaged frame at offset %zu, skipped\n", pos);
+            damaged += 1;
+            pos = find_frame(data, size, pos + 1);
+            continue;
+        }
+
+        fwrite(text, 1, text_size, stdout);
+        pos += LOGGER_COMPRESSED_HEADER_SIZE + payload_size;
+    }
+
+    if (truncated)
+        fprintf(stderr, "logger_decompress: last frame at offset %zu is incomplete\n", pos);
+
+    free(text);
+    free(data);
+    return (damaged || truncated) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,359 @@
+/*
+ * Prints the records of a file written by `log_sink_indexed` that match every filter given,
+ * formatted like `timestamp_formatter` with structured fields appended as key=value.
+ *
+ *     logger_query [-s START] [-e END] [-l LEVEL] [-L LEVEL]... [-n LOGGER] [-c FILE[:LINE]] [-v] FILE
+ *
+ *   -s, -e   Records from START up to, but not including, END. Either Unix time in seconds
+ *            ("1714563420.25") or local time ("2024-05-01 13:37" or "2024-05-01T13:37:00").
+ *   -l       Records at LEVEL or above, e.g. "warn".
+ *   -L       Records at exactly LEVEL; may be given more than once.
+ *   -n       Records of the logger named LOGGER.
+ *   -c       Records logged in FILE (its name, without directories), at LINE if given.
+ *   -v       Tells on stderr how many blocks were read and how many were skipped.
+ *
+ * The file is mapped rather than read, and blocks the index rules out are never touched.
+ * Without an index at its end the file is walked from one block header to the next.
+ *
+ * The file must come from a machine with the same byte order.
+ */
+#define _XOPEN_SOURCE 700     /* strptime */
+#define _DEFAULT_SOURCE
+#define LOGGER_IMPLEMENTATION
+#include "logger.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+
+typedef struct query_t {
+    uint64_t    start_ns;
+    uint64_t    end_ns;
+    uint32_t    levels;
+    const char* logger;
+    size_t      logger_len;
+    uint64_t    logger_key;
+    const char* file;
+    size_t      file_len;
+    int         line;       /* 0: any */
+    uint64_t    callsite_key;
+} query_t;
+
+typedef struct reader_t {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    int    failed;
+} reader_t;
+
+
+static const void* take(reader_t* r, size_t n) {
+    if (r->failed || r->size - r->pos < n) {
+        r->failed = 1;
+        return NULL;
+    }
+    const void* p = r->data + r->pos;
+    r->pos += n;
+    return p;
+}
+
+#define DEFINE_READ(name, type) \
+    static type name(reader_t* r) { type v = 0; const void* p = take(r, sizeof(type)); if (p) memcpy(&v, p, sizeof(type)); return v; }
+
+DEFINE_READ(read_u8,  uint8_t)
+DEFINE_READ(read_u16, uint16_t)
+DEFINE_READ(read_u32, uint32_t)
+DEFINE_READ(read_u64, uint64_t)
+
+// Points into the mapping, NULL for a NULL string.
+static const char* read_string(reader_t* r, size_t* len) {
+    uint16_t n = read_u16(r);
+    *len = 0;
+    if (n == LOGGER_BINARY_NULL_STRING)
+        return NULL;
+    const char* p = take(r, n);
+    if (p)
+        *len = n;
+    return p ? p : "";
+}
+
+
+static int parse_time(const char* text, uint64_t* ns) {
+    char* end;
+    double seconds = strtod(text, &end);
+    if (*end == '\0' && end != text) {
+        *ns = (uint64_t) (seconds * 1e9);
+        return 1;
+    }
+
+    const char* formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        struct tm tm = { 0 };
+        const char* rest = strptime(text, formats[i], &tm);
+        if (rest && *rest == '\0') {
+            tm.tm_isdst = -1;
+            time_t t = mktime(&tm);
+            if (t == (time_t) -1)
+                return 0;
+            *ns = (uint64_t) t * 1000000000u;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int parse_level(const char* text, log_level_t* level) {
+    for (int i = LOG_TRACE; i < LOG_LEVEL_COUNT; ++i) {
+        if (strcasecmp(text, log_level_name((log_level_t) i)) == 0) {
+            *level = (log_level_t) i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char* base_name(const char* file, size_t* len) {
+    for (size_t i = *len; i > 0; --i) {
+        if (file[i - 1] == '/') {
+            *len -= i;
+            return file + i;
+        }
+    }
+    return file;
+}
+
+
+static int block_may_match(const struct logger__index_block* block, const query_t* q) {
+    if (block->count == 0 || block->max_ns < q->start_ns || block->min_ns >= q->end_ns)
+        return 0;
+    if (!(block->levels & q->levels))
+        return 0;
+    if (q->logger && !logger__bloom_test(block->loggers, LOGGER_INDEXED_LOGGER_BITS, q->logger_key))
+        return 0;
+    if (q->file && !logger__bloom_test(block->callsites, LOGGER_INDEXED_CALLSITE_BITS, q->callsite_key))
+        return 0;
+    return 1;
+}
+
+static void print_fields(char* line, size_t size, size_t len, reader_t* r) {
+    uint8_t count = read_u8(r);
+    for (uint8_t i = 0; i < count && !r->failed && len + 1 < size; ++i) {
+        uint8_t type = read_u8(r);
+        size_t key_len;
+        const char* key = read_string(r, &key_len);
+        int n = 0;
+        if (type == LOG_FIELD_STRING) {
+            size_t value_len;
+            const char* value = read_string(r, &value_len);
+            n = snprintf(line + len, size - len, " %.*s=%.*s", (int) key_len, key ? key : "", (int) value_len, value ? value : "null");
+        } else {
+            log_field_t field = { 0 };
+            const void* p = take(r, 8);
+            if (p) memcpy(&field.value, p, 8);
+            switch (type) {
+                case LOG_FIELD_INT:     n = snprintf(line + len, size - len, " %.*s=%lld", (int) key_len, key ? key : "", (long long) field.value.i); break;
+                case LOG_FIELD_UINT:    n = snprintf(line + len, size - len, " %.*s=%llu", (int) key_len, key ? key : "", (unsigned long long) field.value.u); break;
+                case LOG_FIELD_DOUBLE:  n = snprintf(line + len, size - len, " %.*s=%.17g", (int) key_len, key ? key : "", field.value.d); break;
+                case LOG_FIELD_BOOL:    n = snprintf(line + len, size - len, " %.*s=%s", (int) key_len, key ? key : "", field.value.u ? "true" : "false"); break;
+                default:                break;
+            }
+        }
+        if (n > 0)
+            len += ((size_t) n < size - len) ? (size_t) n : size - len - 1;
+    }
+    fwrite(line, 1, len, stdout);
+    fputc('\n', stdout);
+}
+
+static int format_line(char* buffer, int size, const log_ctx_t* logger, log_level_t level, source_location_t location, const char* message, ...) {
+    va_list args;
+    va_start(args, message);
+    int len = timestamp_formatter(buffer, size, logger, level, location, message, args);
+    va_end(args);
+    return len;
+}
+
+// Returns the number of records printed, or -1 if the block is damaged.
+static long scan_block(const unsigned char* data, size_t size, const query_t* q) {
+    reader_t r = { data, size, 0, 0 };
+    char name[LOGGER_BINARY_NULL_STRING];
+    char file[LOGGER_BINARY_NULL_STRING];
+    char line[LOG_INDEXED_MAX_MESSAGE + 2048];
+    long printed = 0;
+
+    while (r.pos < r.size) {
+        uint32_t record_size = read_u32(&r);
+        size_t end = r.pos + record_size;
+        uint64_t timestamp = read_u64(&r);
+        log_level_t level = (log_level_t) read_u8(&r);
+        int line_number = (int) read_u32(&r);
+        size_t name_len, file_len, message_len;
+        const char* record_name = read_string(&r, &name_len);
+        const char* record_file = read_string(&r, &file_len);
+        const char* message = read_string(&r, &message_len);
+        if (r.failed || end > r.size || (unsigned) level >= LOG_LEVEL_COUNT)
+            return -1;
+
+        size_t base_len = file_len;
+        const char* base = record_file ? base_name(record_file, &base_len) : "";
+        int match = timestamp >= q->start_ns && timestamp < q->end_ns
+                 && (q->levels & (1u << level))
+                 && (!q->logger || (record_name && name_len == q->logger_len && memcmp(record_name, q->logger, name_len) == 0))
+                 && (!q->file || (base_len == q->file_len && memcmp(base, q->file, base_len) == 0))
+                 && (!q->line || line_number == q->line);
+
+        if (match) {
+            memcpy(name, record_name ? record_name : "", name_len);
+            name[name_len] = '\0';
+            memcpy(file, record_file ? record_file : "", file_len);
+            file[file_len] = '\0';
+
+            log_ctx_t logger = { .name = record_name ? name : NULL };
+            source_location_t location = { file, "", line_number };
+            logger__record_timestamp = timestamp;
+            int len = format_line(line, (int) sizeof(line), &logger, level, location, "%.*s", (int) message_len, message ? message : "");
+            if (len < 0)
+                len = 0;
+            if (len >= (int) sizeof(line))
+                len = (int) sizeof(line) - 1;
+            print_fields(line, sizeof(line), (size_t) len, &r);
+            printed += 1;
+        }
+        r.pos = end;
+    }
+    return printed;
+}
+
+
+int main(int argc, char** argv) {
+    query_t q = { .start_ns = 0, .end_ns = UINT64_MAX, .levels = 0 };
+    int verbose = 0;
+    const char* path = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* opt = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        log_level_t level;
+        if (strcmp(opt, "-v") == 0) {
+            verbose = 1;
+            continue;
+        }
+        if (opt[0] != '-') {
+            path = opt;
+            continue;
+        }
+        if (!value) {
+            fprintf(stderr, "logger_query: %s needs a value\n", opt);
+            return EXIT_FAILURE;
+        }
+        i += 1;
+
+        if ((strcmp(opt, "-s") == 0 && parse_time(value, &q.start_ns)) || (strcmp(opt, "-e") == 0 && parse_time(value, &q.end_ns))) {
+            continue;
+        } else if (strcmp(opt, "-l") == 0 && parse_level(value, &level)) {
+            q.levels |= ((1u << LOG_LEVEL_COUNT) - 1) & ~((1u << level) - 1);
+        } else if (strcmp(opt, "-L") == 0 && parse_level(value, &level)) {
+            q.levels |= 1u << level;
+        } else if (strcmp(opt, "-n") == 0) {
+            q.logger = value;
+            q.logger_len = strlen(value);
+            q.logger_key = logger__index_logger_key(value, q.logger_len);
+        } else if (strcmp(opt, "-c") == 0) {
+            const char* colon = strrchr(value, ':');
+            q.file = value;
+            q.file_len = colon ? (size_t) (colon - value) : strlen(value);
+            q.line = colon ? atoi(colon + 1) : 0;
+            q.callsite_key = logger__index_callsite_key(q.file, q.file_len, q.line);
+            q.file = base_name(q.file, &q.file_len);
+        } else {
+            fprintf(stderr, "logger_query: bad option %s %s\n", opt, value);
+            return EXIT_FAILURE;
+        }
+    }
+    if (q.levels == 0)
+        q.levels = (1u << LOG_LEVEL_COUNT) - 1;
+    if (!path) {
+        fprintf(stderr, "usage: logger_query [-s START] [-e END] [-l LEVEL] [-L LEVEL]... [-n LOGGER] [-c FILE[:LINE]] [-v] FILE\n");
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "logger_query: cannot open '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+    size_t size = (size_t) st.st_size;
+    const unsigned char* data = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (size < sizeof(LOGGER_INDEXED_MAGIC) || data == MAP_FAILED || memcmp(data, LOGGER_INDEXED_MAGIC, sizeof(LOGGER_INDEXED_MAGIC)) != 0) {
+        fprintf(stderr, "logger_query: not an indexed log\n");
+        return EXIT_FAILURE;
+    }
+
+    // Use the index at the end if it's complete, walk the block headers otherwise.
+    const unsigned char* index = NULL;
+    size_t index_count = 0;
+    struct logger__index_trailer trailer;
+    if (size >= sizeof(LOGGER_INDEXED_MAGIC) + sizeof(trailer)) {
+        memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+        if (memcmp(trailer.magic, LOGGER_INDEXED_MAGIC, sizeof(LOGGER_INDEXED_MAGIC)) == 0
+                && trailer.index_offset <= size - sizeof(trailer)
+                && (size - sizeof(trailer) - trailer.index_offset) / sizeof(struct logger__index_block) == trailer.count
+                && (size - sizeof(trailer) - trailer.index_offset) % sizeof(struct logger__index_block) == 0) {
+            index = data + trailer.index_offset;
+            index_count = trailer.count;
+        }
+    }
+    size_t end = index ? trailer.index_offset : size;
+
+    size_t blocks = 0;
+    size_t scanned = 0;
+    int damaged = 0;
+    size_t pos = sizeof(LOGGER_INDEXED_MAGIC);
+    for (size_t i = 0; index ? i < index_count : pos < end; ++i) {
+        struct logger__index_block block;
+        if (index) {
+            memcpy(&block, index + i * sizeof(block), sizeof(block));
+        } else if (end - pos < sizeof(block)) {
+            break;
+        } else {
+            memcpy(&block, data + pos, sizeof(block));
+            if (block.magic != LOGGER_INDEXED_BLOCK_MAGIC || block.offset != pos)
+                break;  // The start of an incomplete index, or a damaged block
+        }
+        if (block.offset > end || end - block.offset < sizeof(block) || end - block.offset - sizeof(block) < block.size) {
+            if (index) {
+                fprintf(stderr, "logger_query: damaged index\n");
+                damaged = 1;
+            }
+            break;
+        }
+        pos = block.offset + sizeof(block) + block.size;
+        blocks += 1;
+
+        if (!block_may_match(&block, &q))
+            continue;
+        scanned += 1;
+        if (scan_block(data + block.offset + sizeof(block), block.size, &q) < 0) {
+            fprintf(stderr, "logger_query: damaged block at offset %llu\n", (unsigned long long) block.offset);
+            damaged = 1;
+        }
+    }
+    if (!index && pos < end) {
+        fprintf(stderr, "logger_query: %zu bytes at the end are not a complete block\n", end - pos);
+        damaged = 1;
+    }
+
+    if (verbose)
+        fprintf(stderr, "logger_query: read %zu of %zu blocks%s\n", scanned, blocks, index ? "" : " (no index, walked the headers)");
+
+    munmap((void*) data, size);
+    return damaged ? EXIT_FAILURE : EXIT_SUCCESS;
+}
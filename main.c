@@ -34,7 +34,21 @@ int screaming_log(char* buffer, int size, const struct log_ctx_t* logger, log_le
 }
 
 
+void print_record(size_t sequence, const char* message, size_t message_len, void* data) {
+    (void) sequence;
+    (void) data;
+    printf("%.*s\n", (int) message_len, message);
+}
+
+void print_memory_sink(struct ring_sink_state* state) {
+    printf(">>> Memory sink contains\n");
+    log_sink_ring_buffer_read(state, 0, print_record, NULL);
+    printf("<<<\n");
+}
+
+
 int other_api(int x) {
+    log_span_args("other_api", log_span_arg("x", x));     /* Kept with `log_init(.spans = N)` */
     trace("Entering '%s'", __func__);
     debug("Got parameter %d", x);
     info("Hello from other_api");
@@ -56,6 +70,15 @@ int main() {
             [LOG_PANIC]  = &stderr_sink,
         },
         .disable_asserts = 0,
+        .encoder = NULL,                    // Encode whole records instead, e.g. `log_encode_json`
+        .async = 0,                         // Write on a background thread (see `log_flush`)
+        .async_capacity = LOG_ASYNC_DEFAULT_CAPACITY,
+        .async_overflow = LOG_ASYNC_BLOCK,
+        .binary = 0,                        // Capture raw arguments to `.binary_fd`, decode with `logger_decode`
+        .binary_dedup_ms = 0,               // Count repeats of a thread's last binary record instead of storing them
+        .clock = LOG_CLOCK_DEFAULT,         // Source of record timestamps
+        .recorder = 0,                      // Keep the last N statements per thread, dumped on a crash
+        .spans = 0,                         // Keep the last N spans per thread, see `log_spans_export`
     );
     */
     /* Or let default initialization take place automatically (same as above) */
@@ -74,15 +97,15 @@ int main() {
 
 
     printf("\n---------------------------------------- MEMORY SINK ---------------------------------------- \n");
-    char buffer[1024] = { 0 };
+    char buffer[1024];
     struct ring_sink_state state = { .buffer = buffer, .size = sizeof(buffer) };
     log_sink_t mem_sink = log_sink_ring_buffer(&state);
     with_log(.name = "memory_sink_for_warn_and_error", .level = LOG_TRACE, .sinks[LOG_WARN] = &mem_sink, .sinks[LOG_ERROR] = &mem_sink) {
-        printf(">>> Memory sink contains\n%s<<<\n", buffer);
+        print_memory_sink(&state);
         int result = other_api(10);
-        printf(">>> Memory sink contains\n%s<<<\n", buffer);
+        print_memory_sink(&state);
         error("Got this '%d'", result);
-        printf(">>> Memory sink contains\n%s<<<\n", buffer);
+        print_memory_sink(&state);
     }
 
 
@@ -93,6 +116,79 @@ int main() {
     }
 
 
+    printf("\n---------------------------------------- TIMESTAMPS ---------------------------------------- \n");
+    with_log(.name = "timestamps", .formatter = timestamp_formatter) {
+        info("Every record carries the time it was logged at");
+        warn("Only the formatter turns it into text");
+    }
+
+
+    printf("\n---------------------------------------- RATE LIMITING ---------------------------------------- \n");
+    for (int i = 0; i < 1000; ++i) {
+        log_first_n(LOG_INFO, 2, "First two iterations only, this is %d", i);
+        log_every_n(LOG_INFO, 400, "Every 400th iteration, this is %d", i);
+        log_per_second(LOG_WARN, 3, "At most three a second, this is %d", i);
+    }
+
+
+    printf("\n---------------------------------------- STRUCTURED LOGGING ---------------------------------------- \n");
+    log_fields(LOG_INFO, "Request served", log_str("path", "/index.html"), log_int("status", 200), log_double("seconds", 0.0042));
+    with_log(.name = "json", .encoder = log_encode_json) {
+        log_fields(LOG_INFO, "Request served", log_str("path", "/index.html"), log_int("status", 200), log_bool("cached", 1));
+        warn("Plain statements are encoded too, \"%s\"", "quotes and all");
+    }
+    with_log(.name = "logfmt", .encoder = log_encode_logfmt) {
+        log_fields(LOG_INFO, "Request served", log_str("path", "/index.html"), log_int("status", 200), log_str("agent", "curl/8.0"));
+    }
+
+
+    printf("\n---------------------------------------- ROUTING ---------------------------------------- \n");
+    char routed[4096];
+    struct ring_sink_state routed_state = { .buffer = routed, .size = sizeof(routed) };
+    log_sink_t routed_sink = log_sink_ring_buffer(&routed_state);
+    with_log(.name = "routes", .level = LOG_TRACE, log_routes({ .sink = &stderr_sink, .level = LOG_WARN },   /* Warnings and worse to stderr */
+                                                              { .sink = &routed_sink })) {                 /* Everything to memory */
+        other_api(10);
+    }
+    print_memory_sink(&routed_state);
+
+
+    printf("\n---------------------------------------- RUNTIME RECONFIGURATION ---------------------------------------- \n");
+    log_reconfigure(.level = LOG_DEBUG, .formatter = timestamp_formatter);   /* Safe while other threads log */
+    debug("Shown now that the level is LOG_DEBUG");
+    log_set_level(LOG_INFO);                                                /* Async-signal-safe */
+    debug("Hidden again");
+    log_reconfigure(.reset = 1);
+
+
+    printf("\n---------------------------------------- DEDUP ---------------------------------------- \n");
+    struct dedup_sink_state dedup_state = { .sink = &stderr_sink, .window_ms = 1000 };
+    log_sink_t dedup_sink = log_sink_dedup(&dedup_state);
+    with_log(.name = "dedup", .sinks[LOG_ERROR] = &dedup_sink) {
+        for (int i = 0; i < 100; ++i)
+            error("Dependency %s is unreachable", "db");   /* Written once, then counted */
+        error("Dependency %s is back", "db");
+    }
+    log_sink_dedup_close(&dedup_state);
+
+
+    printf("\n---------------------------------------- STATS ---------------------------------------- \n");
+    log_stats_t stats;
+    log_stats_snapshot(&stats);     /* Or `log_stats_dump(fd, LOG_STATS_PROMETHEUS)` for all of it */
+    for (int level = LOG_TRACE; level < LOG_LEVEL_COUNT; ++level)
+        printf("%-5s %3llu emitted, %3llu filtered\n", log_level_name((log_level_t) level),
+               (unsigned long long) stats.levels[level].emitted, (unsigned long long) stats.levels[level].filtered);
+    for (size_t i = 0; i < stats.sink_count; ++i)
+        printf("sink %-8s %3llu records, %5llu bytes\n", stats.sinks[i].name ? stats.sinks[i].name : "unnamed",
+               (unsigned long long) stats.sinks[i].records, (unsigned long long) stats.sinks[i].bytes);
+
+
+    printf("\n---------------------------------------- CALLSITE REGISTRY ---------------------------------------- \n");
+    log_callsite_set(NULL, "other_api", 0, LOG_CALLSITE_ON);    /* Every statement in other_api, whatever the level */
+    other_api(10);
+    log_callsite_set(NULL, "other_api", 0, LOG_CALLSITE_DEFAULT);
+
+
 //    printf("\n---------------------------------------- ASSERTIONS ---------------------------------------- \n");
 //    int a = 10;
 //    int b = 0;